@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -5,202 +6,1719 @@
 #include "common.h"
 #include "platform.h"
 
+#if defined(MILK_AVX2)
+#include <immintrin.h>
+#elif defined(MILK_SSE2)
+#include <emmintrin.h>
+#endif
+
 #define S16_MAX 32767
 #define S16_MIN -32768
+#define GAIN_SHIFT 14
+#define VOLUME_TO_GAIN(volume) ((volume) << (GAIN_SHIFT - 7))
+
+/**
+ * The game thread never touches mixer state directly. Every control call is pushed onto a single producer,
+ * single consumer ring that the mixer drains at the start of each callback, so neither side waits on the other.
+ *
+ * After every callback the mixer publishes the state of each voice, along with the serial of the last command it
+ * applied. Until a command has been applied, queries answer with the game thread's own prediction of its outcome.
+ *
+ * The few operations that must be synchronous, like releasing a wave that a voice may still be reading,
+ * take the device lock and drain the queue themselves. While the lock is held, the caller is the only consumer.
+ */
+
+#define COMMAND_QUEUE_MASK (AUDIO_COMMAND_QUEUE_SIZE - 1)
+
+static void __resetSoundSlot(SoundSlot *slot)
+{
+  slot->soundData = NULL;
+  slot->position = 0;
+  slot->rate = 0;
+  slot->state = STOPPED;
+  slot->volume = 0;
+  slot->send = 0;
+  slot->pan = 0;
+  slot->positional = false;
+  slot->hasGains = false;
+  slot->priority = 0;
+  slot->requestedMicros = 0;
+}
+
+// Resampling to the output rate and pitch shifting are the same operation: a voice just steps through its wave faster or slower.
+static uint32_t __playbackRate(const Wave *wave, float pitch)
+{
+  double sampleRate = wave->sampleRate > 0 ? wave->sampleRate : AUDIO_FREQUENCY;
+  double rate = sampleRate / AUDIO_FREQUENCY * pitch * PLAYBACK_RATE_ONE;
+  return (uint32_t)CLAMP(lrint(rate), 1, MAX_PLAYBACK_RATE);
+}
+
+static void __resetStreamSlot(StreamSlot *slot)
+{
+  int send = slot->send;
+
+  memset(slot, 0, sizeof(StreamSlot));
+  slot->send = send;
+  slot->linkedSlot = -1;
+  slot->rampStart = UNSCHEDULED;
+}
+
+#define RAMP_SHIFT 16
+
+/**
+ * Moves a stream's gain to targetGain over numFrames, starting at an absolute mixer frame. A ramp that starts at
+ * UNSCHEDULED waits until its stream actually starts producing. A ramp that's already running is picked up from
+ * wherever it got to, so fades can be interrupted without a jump.
+ */
+static void __scheduleRamp(StreamSlot *slot, uint64_t clock, int targetGain, int numFrames, uint64_t startFrame, bool stop)
+{
+  if (slot->rampFrames > 0 && slot->rampStart <= clock)
+    slot->gain = slot->rampGain >> RAMP_SHIFT;
+
+  numFrames = MAX(numFrames, 1);
+  slot->targetGain = targetGain;
+  slot->rampStart = startFrame;
+  slot->rampFrames = numFrames;
+  slot->rampGain = slot->gain << RAMP_SHIFT;
+  slot->rampStep = (int32_t)(((int64_t)(targetGain - slot->gain) << RAMP_SHIFT) / numFrames);
+  slot->stopAfterRamp = stop;
+}
+
+static void __playStreamSlot(Audio *audio, const AudioCommand *command)
+{
+  StreamSlot *slots = audio->streamSlots;
+  StreamSlot *slot = &slots[command->slotId];
+  int gain = VOLUME_TO_GAIN(command->volume);
+
+  // A stream has a single read position, so it can only ever play from one slot.
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+  {
+    if (slots[i].data == command->waveStream)
+      __resetStreamSlot(&slots[i]);
+  }
+
+  __resetStreamSlot(slot);
+  waveStreamSeekStart(command->waveStream, command->loop);
+  slot->data = command->waveStream;
+  slot->state = PLAYING;
+  slot->waiting = true;
+  slot->startFrame = audio->frameClock + (uint64_t)command->delayFrames;
+  slot->gain = command->fadeFrames > 0 ? 0 : gain;
+  slot->targetGain = gain;
+
+  if (command->fadeFrames > 0)
+    __scheduleRamp(slot, audio->frameClock, gain, command->fadeFrames, UNSCHEDULED, false);
+
+  if (command->type == COMMAND_CROSSFADE_STREAM && command->linkedSlotId != command->slotId && slots[command->linkedSlotId].state != STOPPED)
+  {
+    __scheduleRamp(&slots[command->linkedSlotId], audio->frameClock, 0, command->fadeFrames, UNSCHEDULED, true);
+    slot->linkedSlot = command->linkedSlotId;
+  }
+}
+
+static void __applyCommand(Audio *audio, const AudioCommand *command)
+{
+  SoundSlot *slots = audio->soundSlots;
+  StreamSlot *streamSlots = audio->streamSlots;
+
+  switch (command->type)
+  {
+    case COMMAND_PLAY_SOUND:
+      slots[command->slotId].state = PLAYING;
+      slots[command->slotId].soundData = command->wave;
+      slots[command->slotId].position = 0;
+      slots[command->slotId].rate = __playbackRate(command->wave, command->pitch);
+      resetAdpcmDecoder(&slots[command->slotId].decoder);
+      slots[command->slotId].volume = command->volume;
+      slots[command->slotId].send = 0;
+      slots[command->slotId].pan = 0;
+      slots[command->slotId].positional = false;
+      slots[command->slotId].hasGains = false;
+      slots[command->slotId].priority = command->priority;
+      slots[command->slotId].requestedMicros = command->issuedMicros;
+      break;
+    case COMMAND_STOP_SOUND:
+      for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+        if ((command->slotId == -1 || command->slotId == i) && slots[i].state == PLAYING)
+          __resetSoundSlot(&slots[i]);
+      break;
+    case COMMAND_PAUSE_SOUND:
+      for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+        if ((command->slotId == -1 || command->slotId == i) && slots[i].state == PLAYING)
+          slots[i].state = PAUSED;
+      break;
+    case COMMAND_RESUME_SOUND:
+      for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+        if ((command->slotId == -1 || command->slotId == i) && slots[i].state == PAUSED)
+          slots[i].state = PLAYING;
+      break;
+    case COMMAND_PLAY_STREAM:
+    case COMMAND_CROSSFADE_STREAM:
+      __playStreamSlot(audio, command);
+      break;
+    case COMMAND_FADE_STREAM:
+      if (streamSlots[command->slotId].state != STOPPED)
+        __scheduleRamp(&streamSlots[command->slotId], audio->frameClock, VOLUME_TO_GAIN(command->volume),
+          command->fadeFrames, audio->frameClock + (uint64_t)command->delayFrames, command->stop);
+      break;
+    case COMMAND_STOP_STREAM:
+      for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+        if (command->slotId == -1 || command->slotId == i)
+          __resetStreamSlot(&streamSlots[i]);
+      break;
+    case COMMAND_PAUSE_STREAM:
+      for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+      {
+        if ((command->slotId == -1 || command->slotId == i) && streamSlots[i].state == PLAYING)
+        {
+          streamSlots[i].state = PAUSED;
+          streamSlots[i].pausedAt = audio->frameClock;
+        }
+      }
+      break;
+    case COMMAND_RESUME_STREAM:
+      for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+      {
+        StreamSlot *slot = &streamSlots[i];
+
+        if ((command->slotId == -1 || command->slotId == i) && slot->state == PAUSED)
+        {
+          // Anything scheduled is shifted by the time spent paused, so delays and fades resume where they left off.
+          uint64_t pausedFrames = audio->frameClock - slot->pausedAt;
+
+          if (slot->waiting)
+            slot->startFrame += pausedFrames;
+          if (slot->rampStart != UNSCHEDULED)
+            slot->rampStart += pausedFrames;
+          slot->state = PLAYING;
+        }
+      }
+      break;
+    case COMMAND_SOUND_SEND:
+      for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+        if (command->slotId == -1 || command->slotId == i)
+          slots[i].send = command->volume;
+      break;
+    case COMMAND_STREAM_SEND:
+      for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+        if (command->slotId == -1 || command->slotId == i)
+          streamSlots[i].send = command->volume;
+      break;
+    case COMMAND_SOUND_PAN:
+      for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+        if (command->slotId == -1 || command->slotId == i)
+          slots[i].pan = command->volume;
+      break;
+    case COMMAND_SOUND_POSITION:
+      slots[command->slotId].positional = true;
+      slots[command->slotId].x = command->params[0];
+      slots[command->slotId].y = command->params[1];
+      break;
+    case COMMAND_LISTENER:
+      audio->listenerX = command->params[0];
+      audio->listenerY = command->params[1];
+      audio->listenerRange = command->params[2];
+      break;
+    case COMMAND_LOW_PASS:
+      setLowPass(&audio->effects, command->params[0], command->params[1]);
+      break;
+    case COMMAND_ECHO:
+      setEcho(&audio->effects, (float)command->volume / MAX_VOLUME, command->params[0], command->params[1]);
+      break;
+    case COMMAND_REVERB:
+      setReverb(&audio->effects, (float)command->volume / MAX_VOLUME, command->params[0], command->params[1]);
+      break;
+    case COMMAND_SYNTH_NOTE:
+      playSynthNote(&audio->synth, command->slotId, command->note, command->volume, command->durationFrames);
+      break;
+    case COMMAND_PLAY_PATTERN:
+      playSynthPattern(&audio->synth, command->slotId);
+      break;
+    case COMMAND_STOP_SYNTH:
+      stopSynth(&audio->synth);
+      break;
+    case COMMAND_MASTER_VOLUME:
+      audio->masterVolume = command->volume;
+      break;
+  }
+  audio->appliedSerial = command->serial;
+}
+
+static void __drainCommands(Audio *audio)
+{
+  AudioCommandQueue *queue = &audio->commandQueue;
+  unsigned tail = (unsigned)SDL_AtomicGet(&queue->tail);
+  unsigned head = (unsigned)SDL_AtomicGet(&queue->head);
+
+  while (tail != head)
+    __applyCommand(audio, &queue->commands[tail++ & COMMAND_QUEUE_MASK]);
+
+  SDL_AtomicSet(&queue->tail, (int)tail);
+}
+
+// States are published before the serial, so a reader that sees a serial also sees the states it produced.
+static void __publishStates(Audio *audio)
+{
+  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+    SDL_AtomicSet(&audio->publishedSoundStates[i], audio->soundSlots[i].state);
+
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+    SDL_AtomicSet(&audio->publishedStreamStates[i], audio->streamSlots[i].state);
+
+  SDL_AtomicSet(&audio->publishedSerial, (int)audio->appliedSerial);
+}
+
+// An offline mixer is only ever used by the thread that owns it, so there's no device to lock against.
+static void __lockMixer(Audio *audio)
+{
+  if (!audio->offline)
+    platform_lockAudioDevice();
+}
+
+static void __unlockMixer(Audio *audio)
+{
+  if (!audio->offline)
+    platform_unlockAudioDevice();
+}
+
+static void __pushCommand(Audio *audio, AudioCommand *command)
+{
+  AudioCommandQueue *queue = &audio->commandQueue;
+  unsigned head = (unsigned)SDL_AtomicGet(&queue->head);
+
+  // The mixer has fallen a full queue behind, most likely because the device is paused. Catch up instead of dropping.
+  if (head - (unsigned)SDL_AtomicGet(&queue->tail) == AUDIO_COMMAND_QUEUE_SIZE)
+  {
+    __lockMixer(audio);
+    __drainCommands(audio);
+    __publishStates(audio);
+    __unlockMixer(audio);
+  }
+
+  queue->commands[head & COMMAND_QUEUE_MASK] = *command;
+  SDL_AtomicSet(&queue->head, (int)(head + 1));
+}
+
+static SoundState __resolveState(Audio *audio, PendingState *pending, SDL_atomic_t *published)
+{
+  unsigned publishedSerial = (unsigned)SDL_AtomicGet(&audio->publishedSerial);
+
+  if ((int)(pending->serial - publishedSerial) > 0)
+    return pending->state;
+
+  return (SoundState)SDL_AtomicGet(published);
+}
+
+static void __predictSoundStates(Audio *audio, int slotId, SoundState from, SoundState to)
+{
+  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  {
+    if ((slotId == -1 || slotId == i) && getSoundState(audio, i) == from)
+    {
+      audio->pendingSoundStates[i].state = to;
+      audio->pendingSoundStates[i].serial = audio->commandSerial;
+    }
+  }
+}
+
+// Passing the same state as from and to predicts it whatever the slot's current state is.
+static void __predictStreamStates(Audio *audio, int slotId, SoundState from, SoundState to)
+{
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+  {
+    if ((slotId == -1 || slotId == i) && (from == to || getStreamState(audio, i) == from))
+    {
+      audio->pendingStreamStates[i].state = to;
+      audio->pendingStreamStates[i].serial = audio->commandSerial;
+    }
+  }
+}
+
+/**
+ * Constant power pan law, so a voice keeps its loudness as it moves across. The table is scaled by sqrt(2),
+ * so a centred voice plays at exactly its volume on both sides, as it did before voices could be panned.
+ */
+#define QUARTER_TURN 1.5707963267948966
+#define SQRT_2 1.4142135623730951
+
+static int16_t panGains[MAX_PAN * 2 + 1][2];
+static bool panTableBuilt = false;
+
+// Built by the first mixer to be initialized, which is the game's own, before its device starts.
+static void __buildPanTable()
+{
+  if (panTableBuilt)
+    return;
+
+  for (int i = 0; i <= MAX_PAN * 2; i++)
+  {
+    double angle = (double)i / (MAX_PAN * 2) * QUARTER_TURN;
+    panGains[i][0] = (int16_t)lrint(cos(angle) * SQRT_2 * (1 << GAIN_SHIFT));
+    panGains[i][1] = (int16_t)lrint(sin(angle) * SQRT_2 * (1 << GAIN_SHIFT));
+  }
+  panTableBuilt = true;
+}
+
+void initializeAudio(Audio *audio)
+{
+  memset(audio, 0, sizeof(Audio));
+  audio->masterVolume = MAX_VOLUME;
+  audio->listenerRange = DEFAULT_LISTENER_RANGE;
+  initializeEffects(&audio->effects);
+  initializeSynth(&audio->synth);
+  __buildPanTable();
+
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+    __resetStreamSlot(&audio->streamSlots[i]);
+
+  setAudioOutput(audio, AUDIO_FREQUENCY, AUDIO_OUTPUT_CHANNELS, AUDIO_FORMAT_S16, AUDIO_DEFAULT_BUFFER_FRAMES);
+  startWaveStreamPrefetch();
+}
+
+void disableAudio(Audio *audio)
+{
+  stopWaveStreamPrefetch();
+  memset(audio->soundSlots, 0, sizeof(audio->soundSlots));
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+    __resetStreamSlot(&audio->streamSlots[i]);
+  memset(audio->synth.voices, 0, sizeof(audio->synth.voices));
+  audio->synth.pattern = -1;
+}
+
+/**
+ * Sound slots are virtual voices. Scripts can still address one directly, or pass AUTO_SOUND_SLOT and let the game thread
+ * pick a free one from its predicted states. When every slot is busy, the least important voice is stolen: the lowest
+ * priority, then the quietest, then the oldest. A sound never steals a voice that outranks it, and is dropped instead.
+ */
+static int __allocateVoice(Audio *audio, int priority, int volume)
+{
+  int candidate = -1;
+
+  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  {
+    if (getSoundState(audio, i) == STOPPED)
+      return i;
+
+    VoiceInfo *voice = &audio->voices[i];
+
+    if (voice->priority > priority || (voice->priority == priority && voice->volume > volume))
+      continue;
+
+    if (candidate == -1)
+    {
+      candidate = i;
+      continue;
+    }
+
+    VoiceInfo *best = &audio->voices[candidate];
+
+    if (voice->priority < best->priority
+      || (voice->priority == best->priority && voice->volume < best->volume)
+      || (voice->priority == best->priority && voice->volume == best->volume && (int)(voice->started - best->started) < 0))
+      candidate = i;
+  }
+
+  return candidate;
+}
+
+int playSound(Audio *audio, Wave *wave, int slotId, int volume, float pitch, int priority)
+{
+  volume = CLAMP(volume, 0, MAX_VOLUME);
+
+  if (slotId == AUTO_SOUND_SLOT)
+    slotId = __allocateVoice(audio, priority, volume);
+
+  if (slotId < 0 || slotId >= MAX_SOUND_SLOTS)
+    return -1;
+
+  AudioCommand command = {
+    .type         = COMMAND_PLAY_SOUND,
+    .serial       = ++audio->commandSerial,
+    .slotId       = slotId,
+    .volume       = volume,
+    .priority     = priority,
+    .pitch        = pitch > 0.0f ? pitch : 1.0f,
+    .issuedMicros = platform_getMicros(),
+    .wave         = wave
+  };
+
+  audio->voices[slotId].priority = priority;
+  audio->voices[slotId].volume = volume;
+  audio->voices[slotId].started = audio->commandSerial;
+  audio->pendingSoundStates[slotId].state = PLAYING;
+  audio->pendingSoundStates[slotId].serial = audio->commandSerial;
+  __pushCommand(audio, &command);
+  return slotId;
+}
+
+void stopSound(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_STOP_SOUND, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictSoundStates(audio, slotId, PLAYING, STOPPED);
+  __pushCommand(audio, &command);
+}
+
+void stopInstances(Audio *audio, Wave *wave)
+{
+  __lockMixer(audio);
+  __drainCommands(audio);
+  SoundSlot *slots = audio->soundSlots;
+  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  {
+    if (slots[i].soundData == wave)
+      __resetSoundSlot(&slots[i]);
+  }
+  __publishStates(audio);
+  __unlockMixer(audio);
+}
+
+void pauseSound(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_PAUSE_SOUND, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictSoundStates(audio, slotId, PLAYING, PAUSED);
+  __pushCommand(audio, &command);
+}
+
+void resumeSound(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_RESUME_SOUND, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictSoundStates(audio, slotId, PAUSED, PLAYING);
+  __pushCommand(audio, &command);
+}
+
+SoundState getSoundState(Audio *audio, int slotId)
+{
+  if (slotId < 0 || slotId >= MAX_SOUND_SLOTS)
+    return STOPPED;
+
+  return __resolveState(audio, &audio->pendingSoundStates[slotId], &audio->publishedSoundStates[slotId]);
+}
+
+/**
+ * Streams play from MAX_STREAM_SLOTS slots at once. Fades and delays are counted in mixer frames, from the frame at which
+ * the mixer applies the command, so a whole batch of commands issued in one update lines up sample for sample.
+ *
+ * A crossfade starts fading the outgoing slot on the exact frame the incoming stream produces its first sample,
+ * which might be later than asked for if its prefetch ring hasn't been filled yet.
+ */
+
+static bool __isStreamSlot(int slotId)
+{
+  return slotId >= 0 && slotId < MAX_STREAM_SLOTS;
+}
+
+void playStream(Audio *audio, int slotId, WaveStream *waveStream, int volume, bool loop, int fadeFrames, int delayFrames)
+{
+  crossfadeStream(audio, slotId, slotId, waveStream, volume, loop, fadeFrames, delayFrames);
+}
+
+void crossfadeStream(Audio *audio, int fromSlotId, int toSlotId, WaveStream *waveStream, int volume, bool loop, int fadeFrames, int delayFrames)
+{
+  if (!__isStreamSlot(fromSlotId) || !__isStreamSlot(toSlotId))
+    return;
+
+  AudioCommand command = {
+    .type         = fromSlotId == toSlotId ? COMMAND_PLAY_STREAM : COMMAND_CROSSFADE_STREAM,
+    .serial       = ++audio->commandSerial,
+    .slotId       = toSlotId,
+    .linkedSlotId = fromSlotId,
+    .volume       = CLAMP(volume, 0, MAX_VOLUME),
+    .loop         = loop,
+    .fadeFrames   = MAX(fadeFrames, 0),
+    .delayFrames  = MAX(delayFrames, 0),
+    .waveStream   = waveStream
+  };
+
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+  {
+    if (i != toSlotId && audio->streamSlots[i].data == waveStream)
+      __predictStreamStates(audio, i, STOPPED, STOPPED);
+  }
+  __predictStreamStates(audio, toSlotId, PLAYING, PLAYING);
+  __pushCommand(audio, &command);
+}
+
+// With stop set, the slot stops once the fade completes. A fade to silence with stop is how streams are faded out.
+void fadeStream(Audio *audio, int slotId, int volume, int fadeFrames, int delayFrames, bool stop)
+{
+  if (!__isStreamSlot(slotId))
+    return;
+
+  AudioCommand command = {
+    .type         = COMMAND_FADE_STREAM,
+    .serial       = ++audio->commandSerial,
+    .slotId       = slotId,
+    .volume       = CLAMP(volume, 0, MAX_VOLUME),
+    .stop         = stop,
+    .fadeFrames   = MAX(fadeFrames, 0),
+    .delayFrames  = MAX(delayFrames, 0)
+  };
+
+  __pushCommand(audio, &command);
+}
+
+void stopStream(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_STOP_STREAM, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictStreamStates(audio, slotId, STOPPED, STOPPED);
+  __pushCommand(audio, &command);
+}
+
+void stopStreamInstances(Audio *audio, WaveStream *waveStream)
+{
+  __lockMixer(audio);
+  __drainCommands(audio);
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+  {
+    if (audio->streamSlots[i].data == waveStream)
+      __resetStreamSlot(&audio->streamSlots[i]);
+  }
+  __publishStates(audio);
+  __unlockMixer(audio);
+}
+
+void pauseStream(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_PAUSE_STREAM, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictStreamStates(audio, slotId, PLAYING, PAUSED);
+  __pushCommand(audio, &command);
+}
+
+void resumeStream(Audio *audio, int slotId)
+{
+  AudioCommand command = { .type = COMMAND_RESUME_STREAM, .serial = ++audio->commandSerial, .slotId = slotId };
+  __predictStreamStates(audio, slotId, PAUSED, PLAYING);
+  __pushCommand(audio, &command);
+}
+
+SoundState getStreamState(Audio *audio, int slotId)
+{
+  if (!__isStreamSlot(slotId))
+    return STOPPED;
+
+  return __resolveState(audio, &audio->pendingStreamStates[slotId], &audio->publishedStreamStates[slotId]);
+}
+
+/**
+ * Pan and position are applied by the mixer once per chunk, then glided to over its first few sub-blocks.
+ * A positional voice fades out linearly with its distance from the listener, reaching silence at the listener's range,
+ * and is panned by how far it is to either side, on top of its own pan.
+ */
+
+void setSoundPan(Audio *audio, int slotId, int pan)
+{
+  AudioCommand command = { .type = COMMAND_SOUND_PAN, .serial = ++audio->commandSerial, .slotId = slotId, .volume = CLAMP(pan, -MAX_PAN, MAX_PAN) };
+  __pushCommand(audio, &command);
+}
+
+void setSoundPosition(Audio *audio, int slotId, float x, float y)
+{
+  if (slotId < 0 || slotId >= MAX_SOUND_SLOTS)
+    return;
+
+  AudioCommand command = { .type = COMMAND_SOUND_POSITION, .serial = ++audio->commandSerial, .slotId = slotId, .params = { x, y } };
+  __pushCommand(audio, &command);
+}
+
+void setListener(Audio *audio, float x, float y, float range)
+{
+  AudioCommand command = { .type = COMMAND_LISTENER, .serial = ++audio->commandSerial, .params = { x, y, MAX(range, 1.0f) } };
+  __pushCommand(audio, &command);
+}
+
+/**
+ * A send routes a share of a voice or stream through the effect bus instead of straight to the output, so MAX_SEND
+ * makes it fully wet. Voices start with no send every time they're played. A stream slot keeps its send.
+ */
+
+void setSoundSend(Audio *audio, int slotId, int send)
+{
+  AudioCommand command = { .type = COMMAND_SOUND_SEND, .serial = ++audio->commandSerial, .slotId = slotId, .volume = CLAMP(send, 0, MAX_SEND) };
+  __pushCommand(audio, &command);
+}
+
+void setStreamSend(Audio *audio, int slotId, int send)
+{
+  AudioCommand command = { .type = COMMAND_STREAM_SEND, .serial = ++audio->commandSerial, .slotId = slotId, .volume = CLAMP(send, 0, MAX_SEND) };
+  __pushCommand(audio, &command);
+}
+
+// A cutoff of zero switches the filter off, as does a level of zero for the echo and reverb.
+void setLowPassEffect(Audio *audio, float cutoff, float resonance)
+{
+  AudioCommand command = { .type = COMMAND_LOW_PASS, .serial = ++audio->commandSerial, .params = { cutoff, resonance } };
+  __pushCommand(audio, &command);
+}
+
+void setEchoEffect(Audio *audio, int level, float seconds, float feedback)
+{
+  AudioCommand command = {
+    .type   = COMMAND_ECHO,
+    .serial = ++audio->commandSerial,
+    .volume = CLAMP(level, 0, MAX_VOLUME),
+    .params = { seconds, feedback }
+  };
+  __pushCommand(audio, &command);
+}
+
+void setReverbEffect(Audio *audio, int level, float roomSize, float damping)
+{
+  AudioCommand command = {
+    .type   = COMMAND_REVERB,
+    .serial = ++audio->commandSerial,
+    .volume = CLAMP(level, 0, MAX_VOLUME),
+    .params = { roomSize, damping }
+  };
+  __pushCommand(audio, &command);
+}
+
+/**
+ * Instruments and patterns are too big for the command queue, so they're copied in under the device lock. Commands
+ * already queued are applied first, so they still play with the definitions they were queued with.
+ */
+bool defineInstrument(Audio *audio, int id, const Instrument *instrument)
+{
+  if (id < 0 || id >= SYNTH_MAX_INSTRUMENTS)
+    return false;
+
+  __lockMixer(audio);
+  __drainCommands(audio);
+  audio->synth.instruments[id] = *instrument;
+  audio->synth.instruments[id].defined = true;
+  __publishStates(audio);
+  __unlockMixer(audio);
+  return true;
+}
+
+bool definePattern(Audio *audio, int id, const Pattern *pattern)
+{
+  if (id < 0 || id >= SYNTH_MAX_PATTERNS || pattern->rowCount < 1 || pattern->rowCount > SYNTH_MAX_ROWS)
+    return false;
+
+  __lockMixer(audio);
+  __drainCommands(audio);
+  audio->synth.patterns[id] = *pattern;
+  audio->synth.patterns[id].defined = true;
+  __publishStates(audio);
+  __unlockMixer(audio);
+  return true;
+}
+
+void playNote(Audio *audio, int instrument, int note, int volume, int durationFrames)
+{
+  AudioCommand command = {
+    .type           = COMMAND_SYNTH_NOTE,
+    .serial         = ++audio->commandSerial,
+    .slotId         = instrument,
+    .volume         = CLAMP(volume, 0, SYNTH_MAX_VOLUME),
+    .note           = note,
+    .durationFrames = durationFrames
+  };
+  __pushCommand(audio, &command);
+}
+
+void playPattern(Audio *audio, int pattern)
+{
+  AudioCommand command = { .type = COMMAND_PLAY_PATTERN, .serial = ++audio->commandSerial, .slotId = pattern };
+  __pushCommand(audio, &command);
+}
+
+void stopPattern(Audio *audio)
+{
+  AudioCommand command = { .type = COMMAND_STOP_SYNTH, .serial = ++audio->commandSerial };
+  __pushCommand(audio, &command);
+}
+
+void setMasterVolume(Audio *audio, int volume)
+{
+  AudioCommand command = { .type = COMMAND_MASTER_VOLUME, .serial = ++audio->commandSerial, .volume = CLAMP(volume, 0, MAX_VOLUME) };
+  __pushCommand(audio, &command);
+}
+
+/**
+ * Voices are summed into a 32 bit bus, so nothing clips or depends on mixing order until the bus is resolved.
+ * That also means the kernels never need saturating adds, only a widening multiply.
+ *
+ * Volume and pan are applied as a Q14 gain per output channel (MAX_VOLUME maps to 1 << 14), with a multiply and shift
+ * instead of a divide.
+ * The scalar kernels are the reference: every SIMD kernel must produce bit identical results, and they also
+ * finish the tail of each buffer that doesn't fill a whole vector.
+ */
+
+static void __mixMonoScalar(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  while (numFrames--)
+  {
+    int32_t sample = *source++;
+    *bus++ += (sample * leftGain) >> GAIN_SHIFT;
+    *bus++ += (sample * rightGain) >> GAIN_SHIFT;
+  }
+}
+
+static void __mixStereoScalar(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  while (numFrames--)
+  {
+    *bus++ += (*source++ * leftGain) >> GAIN_SHIFT;
+    *bus++ += (*source++ * rightGain) >> GAIN_SHIFT;
+  }
+}
+
+#if defined(MILK_AVX2)
+
+static int __mixMonoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  __m256i gains = _mm256_setr_epi32(leftGain, rightGain, leftGain, rightGain, leftGain, rightGain, leftGain, rightGain);
+  __m256i low   = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+  __m256i high  = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+  int i = 0;
+
+  for (; i + 8 <= numFrames; i += 8, bus += 16)
+  {
+    __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(source + i)));
+    __m256i first = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_permutevar8x32_epi32(samples, low), gains), GAIN_SHIFT);
+    __m256i second = _mm256_srai_epi32(_mm256_mullo_epi32(_mm256_permutevar8x32_epi32(samples, high), gains), GAIN_SHIFT);
+
+    __m256i *left = (__m256i *)bus, *right = (__m256i *)(bus + 8);
+    _mm256_storeu_si256(left, _mm256_add_epi32(_mm256_loadu_si256(left), first));
+    _mm256_storeu_si256(right, _mm256_add_epi32(_mm256_loadu_si256(right), second));
+  }
+  return i;
+}
+
+static int __mixStereoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  __m256i gains = _mm256_setr_epi32(leftGain, rightGain, leftGain, rightGain, leftGain, rightGain, leftGain, rightGain);
+  int numSamples = numFrames * 2;
+  int i = 0;
+
+  for (; i + 8 <= numSamples; i += 8)
+  {
+    __m256i samples = _mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i *)(source + i)));
+    samples = _mm256_srai_epi32(_mm256_mullo_epi32(samples, gains), GAIN_SHIFT);
+    _mm256_storeu_si256((__m256i *)(bus + i), _mm256_add_epi32(_mm256_loadu_si256((__m256i *)(bus + i)), samples));
+  }
+  return i / 2;
+}
+
+#elif defined(MILK_SSE2)
+
+// SSE2 has no 32 bit multiply, so products are widened from the low and high halves of a 16 bit multiply.
+#define WIDE_PRODUCTS(samples, gains, low, high)\
+  do {\
+    __m128i productLow  = _mm_mullo_epi16(samples, gains);\
+    __m128i productHigh = _mm_mulhi_epi16(samples, gains);\
+    low   = _mm_srai_epi32(_mm_unpacklo_epi16(productLow, productHigh), GAIN_SHIFT);\
+    high  = _mm_srai_epi32(_mm_unpackhi_epi16(productLow, productHigh), GAIN_SHIFT);\
+  } while(0)
+
+#define ACCUMULATE(bus, samples) _mm_storeu_si128((__m128i *)(bus), _mm_add_epi32(_mm_loadu_si128((__m128i *)(bus)), samples))
+
+// Gains fit in 16 bits, so a left and right gain pair packs into each 32 bit lane, lined up with an interleaved frame.
+#define GAIN_PAIRS(leftGain, rightGain) _mm_set1_epi32((int)((uint16_t)(leftGain) | (uint32_t)(uint16_t)(rightGain) << 16))
+
+static int __mixMonoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  __m128i gains = GAIN_PAIRS(leftGain, rightGain);
+  int i = 0;
+
+  for (; i + 8 <= numFrames; i += 8, bus += 16)
+  {
+    __m128i samples = _mm_loadu_si128((__m128i *)(source + i));
+    __m128i low, high;
+
+    WIDE_PRODUCTS(_mm_unpacklo_epi16(samples, samples), gains, low, high);
+    ACCUMULATE(bus, low);
+    ACCUMULATE(bus + 4, high);
+
+    WIDE_PRODUCTS(_mm_unpackhi_epi16(samples, samples), gains, low, high);
+    ACCUMULATE(bus + 8, low);
+    ACCUMULATE(bus + 12, high);
+  }
+  return i;
+}
+
+static int __mixStereoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  __m128i gains = GAIN_PAIRS(leftGain, rightGain);
+  int numSamples = numFrames * 2;
+  int i = 0;
+
+  for (; i + 8 <= numSamples; i += 8)
+  {
+    __m128i low, high;
+    WIDE_PRODUCTS(_mm_loadu_si128((__m128i *)(source + i)), gains, low, high);
+
+    ACCUMULATE(bus + i, low);
+    ACCUMULATE(bus + i + 4, high);
+  }
+  return i / 2;
+}
+
+#else
+
+static int __mixMonoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
+{
+  UNUSED(bus);
+  UNUSED(source);
+  UNUSED(numFrames);
+  UNUSED(leftGain);
+  UNUSED(rightGain);
+  return 0;
+}
 
-void initializeAudio(Audio *audio)
+static int __mixStereoSimd(int32_t *bus, const int16_t *source, int numFrames, int leftGain, int rightGain)
 {
-  memset(audio->soundSlots, 0, sizeof(audio->soundSlots));
-  memset(&audio->streamSlot, 0, sizeof(audio->streamSlot));
-  audio->masterVolume = MAX_VOLUME;
+  UNUSED(bus);
+  UNUSED(source);
+  UNUSED(numFrames);
+  UNUSED(leftGain);
+  UNUSED(rightGain);
+  return 0;
 }
 
-void disableAudio(Audio *audio)
+#endif
+
+static void __mixFrames(int32_t *bus, const int16_t *source, int numFrames, int numChannels, int leftGain, int rightGain, bool reference)
 {
-  memset(audio->soundSlots, 0, sizeof(audio->soundSlots));
-  memset(&audio->streamSlot, 0, sizeof(audio->streamSlot));
+  int mixed = 0;
+
+  if (numChannels == 1)
+  {
+    if (!reference)
+      mixed = __mixMonoSimd(bus, source, numFrames, leftGain, rightGain);
+    __mixMonoScalar(bus + mixed * 2, source + mixed, numFrames - mixed, leftGain, rightGain);
+  }
+  else
+  {
+    if (!reference)
+      mixed = __mixStereoSimd(bus, source, numFrames, leftGain, rightGain);
+    __mixStereoScalar(bus + mixed * 2, source + mixed * 2, numFrames - mixed, leftGain, rightGain);
+  }
+}
+
+#define SEND_SHIFT 7
+#define SCALE_BY_SEND(gain, send) ((int32_t)(((int64_t)(gain) * (send)) >> SEND_SHIFT))
+
+// Splits the gains between the bus and the send bus. The two shares always add back up to the whole gain.
+static void __mixRouted(int32_t *bus, int32_t *sendBus, const int16_t *source, int numFrames, int numChannels, int leftGain, int rightGain, int send, bool reference)
+{
+  int leftSend = SCALE_BY_SEND(leftGain, send);
+  int rightSend = SCALE_BY_SEND(rightGain, send);
+
+  if (leftGain > leftSend || rightGain > rightSend)
+    __mixFrames(bus, source, numFrames, numChannels, leftGain - leftSend, rightGain - rightSend, reference);
+  if (leftSend > 0 || rightSend > 0)
+    __mixFrames(sendBus, source, numFrames, numChannels, leftSend, rightSend, reference);
 }
 
-void playSound(Audio *audio, Wave *wave, int slotId, int volume)
+// Ramps are short and rare, so they only have the reference kernel. The gain steps once per frame.
+static void __mixFramesRamp(int32_t *bus, const int16_t *source, int numFrames, int numChannels, int32_t *rampGain, int32_t rampStep)
 {
-  if (slotId >= 0 && slotId < MAX_SOUND_SLOTS)
+  int32_t ramp = *rampGain;
+
+  for (int i = 0; i < numFrames; i++, ramp += rampStep)
   {
-    platform_lockAudioDevice();
-    SoundSlot *slot = &audio->soundSlots[slotId];
-    slot->state = PLAYING;
-    slot->soundData = wave;
-    slot->position = wave->samples;
-    slot->remainingSamples = wave->sampleCount;
-    slot->volume = CLAMP(volume, 0, MAX_VOLUME);
-    platform_unlockAudioDevice();
+    int gain = ramp >> RAMP_SHIFT;
+    int32_t left = (source[i * numChannels] * gain) >> GAIN_SHIFT;
+    int32_t right = numChannels == 1 ? left : (source[i * numChannels + 1] * gain) >> GAIN_SHIFT;
+    *bus++ += left;
+    *bus++ += right;
   }
+  *rampGain = ramp;
 }
 
-void stopSound(Audio *audio, int slotId)
+static void __mixRoutedRamp(int32_t *bus, int32_t *sendBus, const int16_t *source, int numFrames, int numChannels, int32_t *rampGain, int32_t rampStep, int send)
 {
-  platform_lockAudioDevice();
-  SoundSlot *slots = audio->soundSlots;
-  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  if (send == 0)
+  {
+    __mixFramesRamp(bus, source, numFrames, numChannels, rampGain, rampStep);
+    return;
+  }
+
+  int32_t dryRamp = SCALE_BY_SEND(*rampGain, MAX_SEND - send);
+  int32_t sendRamp = SCALE_BY_SEND(*rampGain, send);
+
+  if (send < MAX_SEND)
+    __mixFramesRamp(bus, source, numFrames, numChannels, &dryRamp, SCALE_BY_SEND(rampStep, MAX_SEND - send));
+  __mixFramesRamp(sendBus, source, numFrames, numChannels, &sendRamp, SCALE_BY_SEND(rampStep, send));
+  *rampGain += rampStep * numFrames;
+}
+
+void useReferenceMixing(Audio *audio, bool enabled)
+{
+  audio->referenceKernels = enabled;
+  useReferenceEffects(&audio->effects, enabled);
+}
+
+/**
+ * Voices that don't play at exactly one source frame per output frame are resampled into a scratch buffer first,
+ * then mixed by the regular kernels. Samples are linearly interpolated with a 14 bit fraction, which lets a pair of
+ * neighbouring samples and their weights go through a single multiply-add. As above, the scalar version is the reference.
+ */
+
+#define FRACTION_SHIFT 14
+#define FRACTION_ONE (1 << FRACTION_SHIFT)
+#define POSITION_FRACTION(position) ((int)((position) & (PLAYBACK_RATE_ONE - 1)) >> (PLAYBACK_RATE_SHIFT - FRACTION_SHIFT))
+
+static void __resampleScalar(int16_t *dest, const int16_t *source, int numChannels, int lastFrame, uint64_t position, uint32_t rate, int numFrames)
+{
+  for (int i = 0; i < numFrames; i++, position += rate)
   {
-    if ((slotId == -1 || slotId == i) && slots[i].state == PLAYING)
+    int frame = (int)(position >> PLAYBACK_RATE_SHIFT);
+    int next = MIN(frame + 1, lastFrame);
+    int fraction = POSITION_FRACTION(position);
+
+    for (int channel = 0; channel < numChannels; channel++)
     {
-      slots[i].soundData = NULL;
-      slots[i].position = NULL;
-      slots[i].state = STOPPED;
-      slots[i].remainingSamples = 0;
-      slots[i].volume = 0;
+      int32_t current = source[frame * numChannels + channel];
+      int32_t following = source[next * numChannels + channel];
+      *dest++ = (int16_t)((current * (FRACTION_ONE - fraction) + following * fraction) >> FRACTION_SHIFT);
     }
   }
-  platform_unlockAudioDevice();
 }
 
-void stopInstances(Audio *audio, Wave *wave)
+#if defined(MILK_SSE2)
+
+// SSE2 has no gather, so the sample pairs are loaded one frame at a time. Everything else happens four frames at once.
+static int __resampleSimd(int16_t *dest, const int16_t *source, int numChannels, int lastFrame, uint64_t position, uint32_t rate, int numFrames)
 {
-  platform_lockAudioDevice();
-  SoundSlot *slots = audio->soundSlots;
-  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  __m128i steps = _mm_setr_epi32(0, (int)rate, (int)rate * 2, (int)rate * 3);
+  __m128i fractionMask = _mm_set1_epi32(PLAYBACK_RATE_ONE - 1);
+  __m128i ones = _mm_set1_epi32(FRACTION_ONE);
+  int i = 0;
+
+  for (; i + 4 <= numFrames && (int)((position + (uint64_t)rate * 3) >> PLAYBACK_RATE_SHIFT) < lastFrame; i += 4, position += (uint64_t)rate * 4)
   {
-    if (slots[i].soundData == wave)
+    const int16_t *base = source + (position >> PLAYBACK_RATE_SHIFT) * numChannels;
+    __m128i offsets = _mm_add_epi32(_mm_set1_epi32((int)(position & (PLAYBACK_RATE_ONE - 1))), steps);
+    __m128i fractions = _mm_srli_epi32(_mm_and_si128(offsets, fractionMask), PLAYBACK_RATE_SHIFT - FRACTION_SHIFT);
+
+    // Each 32 bit lane holds the int16 weight pair (1 - fraction, fraction) to match a (current, following) sample pair.
+    __m128i weights = _mm_or_si128(_mm_sub_epi32(ones, fractions), _mm_slli_epi32(fractions, 16));
+    int32_t frames[4];
+    _mm_storeu_si128((__m128i *)frames, _mm_srli_epi32(offsets, PLAYBACK_RATE_SHIFT));
+
+    if (numChannels == 1)
+    {
+      int32_t pairs[4];
+      for (int j = 0; j < 4; j++)
+        memcpy(&pairs[j], base + frames[j], sizeof(int32_t));
+
+      __m128i mixed = _mm_srai_epi32(_mm_madd_epi16(_mm_loadu_si128((__m128i *)pairs), weights), FRACTION_SHIFT);
+      _mm_storel_epi64((__m128i *)(dest + i), _mm_packs_epi32(mixed, mixed));
+    }
+    else
     {
-      slots[i].soundData = NULL;
-      slots[i].position = NULL;
-      slots[i].state = STOPPED;
-      slots[i].remainingSamples = 0;
-      slots[i].volume = 0;
+      __m128i frameWeights[2] = { _mm_shuffle_epi32(weights, _MM_SHUFFLE(1, 1, 0, 0)), _mm_shuffle_epi32(weights, _MM_SHUFFLE(3, 3, 2, 2)) };
+      __m128i results[2];
+
+      for (int j = 0; j < 2; j++)
+      {
+        // [L0 R0 L1 R1] for two frames, reordered into (current, following) pairs per channel.
+        __m128i first = _mm_loadl_epi64((const __m128i *)(base + frames[j * 2] * 2));
+        __m128i second = _mm_loadl_epi64((const __m128i *)(base + frames[j * 2 + 1] * 2));
+        __m128i pairs = _mm_unpacklo_epi64(first, second);
+        pairs = _mm_shufflelo_epi16(pairs, _MM_SHUFFLE(3, 1, 2, 0));
+        pairs = _mm_shufflehi_epi16(pairs, _MM_SHUFFLE(3, 1, 2, 0));
+        results[j] = _mm_srai_epi32(_mm_madd_epi16(pairs, frameWeights[j]), FRACTION_SHIFT);
+      }
+      _mm_storeu_si128((__m128i *)(dest + i * 2), _mm_packs_epi32(results[0], results[1]));
     }
   }
-  platform_unlockAudioDevice();
+  return i;
 }
 
-void pauseSound(Audio *audio, int slotId)
+#else
+
+static int __resampleSimd(int16_t *dest, const int16_t *source, int numChannels, int lastFrame, uint64_t position, uint32_t rate, int numFrames)
 {
-  platform_lockAudioDevice();
-  SoundSlot *slots = audio->soundSlots;
-  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  UNUSED(dest);
+  UNUSED(source);
+  UNUSED(numChannels);
+  UNUSED(lastFrame);
+  UNUSED(position);
+  UNUSED(rate);
+  UNUSED(numFrames);
+  return 0;
+}
+
+#endif
+
+static void __resample(int16_t *dest, const int16_t *source, int numChannels, int lastFrame, uint64_t position, uint32_t rate, int numFrames, bool reference)
+{
+  int resampled = 0;
+
+  if (!reference)
+    resampled = __resampleSimd(dest, source, numChannels, lastFrame, position, rate, numFrames);
+
+  __resampleScalar(dest + resampled * numChannels, source, numChannels, lastFrame, position + (uint64_t)rate * resampled, rate, numFrames - resampled);
+}
+
+#define LIMITER_THRESHOLD 24576.0f
+#define LIMITER_RANGE     (S16_MAX - LIMITER_THRESHOLD)
+
+/**
+ * Applies master gain, then a soft knee above LIMITER_THRESHOLD that eases toward full scale instead of clipping hard.
+ * Below the threshold the signal passes through untouched. The final conversion saturates in case the knee overshoots.
+ */
+static void __resolveBus(const int32_t *bus, int16_t *stream, int numSamples, int masterVolume)
+{
+  float gain = (float)masterVolume / MAX_VOLUME;
+  int i = 0;
+
+#ifdef MILK_SSE2
+  __m128 gains      = _mm_set1_ps(gain);
+  __m128 thresholds = _mm_set1_ps(LIMITER_THRESHOLD);
+  __m128 inverse    = _mm_set1_ps(1.0f / LIMITER_RANGE);
+  __m128 ones       = _mm_set1_ps(1.0f);
+  __m128 zeros      = _mm_setzero_ps();
+  __m128 signBits   = _mm_set1_ps(-0.0f);
+
+  for (; i + 8 <= numSamples; i += 8)
+  {
+    __m128i packed[2];
+
+    for (int j = 0; j < 2; j++)
+    {
+      __m128 sample     = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((__m128i *)(bus + i + j * 4))), gains);
+      __m128 sign       = _mm_and_ps(sample, signBits);
+      __m128 magnitude  = _mm_andnot_ps(signBits, sample);
+      __m128 over       = _mm_max_ps(_mm_sub_ps(magnitude, thresholds), zeros);
+      __m128 knee       = _mm_div_ps(over, _mm_add_ps(ones, _mm_mul_ps(over, inverse)));
+
+      magnitude = _mm_add_ps(_mm_min_ps(magnitude, thresholds), knee);
+      packed[j] = _mm_cvtps_epi32(_mm_or_ps(magnitude, sign));
+    }
+    _mm_storeu_si128((__m128i *)(stream + i), _mm_packs_epi32(packed[0], packed[1]));
+  }
+#endif
+
+  for (; i < numSamples; i++)
   {
-    if ((slotId == -1 || slotId == i) && slots[i].state == PLAYING)
-      slots[i].state = PAUSED;
+    float sample = bus[i] * gain;
+    float magnitude = fabsf(sample);
+
+    if (magnitude > LIMITER_THRESHOLD)
+    {
+      float over = magnitude - LIMITER_THRESHOLD;
+      magnitude = LIMITER_THRESHOLD + over / (1.0f + over * (1.0f / LIMITER_RANGE));
+    }
+
+    int32_t resolved = (int32_t)lrintf(sample < 0 ? -magnitude : magnitude);
+    stream[i] = (int16_t)CLAMP(resolved, S16_MIN, S16_MAX);
   }
-  platform_unlockAudioDevice();
 }
 
-void resumeSound(Audio *audio, int slotId)
+/**
+ * Every chunk, each voice's left and right gains are worked out from its volume, pan and position. The kernels need a
+ * constant gain, so a voice whose gains changed steps toward them over GAIN_RAMP_STEPS sub-blocks of GAIN_STEP_FRAMES.
+ */
+static void __updateVoiceGains(Audio *audio)
 {
-  platform_lockAudioDevice();
-  SoundSlot *slots = audio->soundSlots;
   for (int i = 0; i < MAX_SOUND_SLOTS; i++)
   {
-    if ((slotId == -1 || slotId == i) && slots[i].state == PAUSED)
-      slots[i].state = PLAYING;
+    SoundSlot *slot = &audio->soundSlots[i];
+    int gain = VOLUME_TO_GAIN(slot->volume);
+    int pan = slot->pan;
+
+    if (slot->state != PLAYING)
+      continue;
+
+    if (slot->positional)
+    {
+      float dx = slot->x - audio->listenerX;
+      float dy = slot->y - audio->listenerY;
+      float attenuation = 1.0f - sqrtf(dx * dx + dy * dy) / audio->listenerRange;
+
+      gain = (int)lrintf(gain * CLAMP(attenuation, 0.0f, 1.0f));
+      pan = CLAMP(pan + (int)lrintf(CLAMP(dx / audio->listenerRange, -1.0f, 1.0f) * MAX_PAN), -MAX_PAN, MAX_PAN);
+    }
+
+    slot->targetGains[0] = (gain * panGains[pan + MAX_PAN][0]) >> GAIN_SHIFT;
+    slot->targetGains[1] = (gain * panGains[pan + MAX_PAN][1]) >> GAIN_SHIFT;
+
+    if (!slot->hasGains)
+    {
+      slot->gains[0] = slot->targetGains[0];
+      slot->gains[1] = slot->targetGains[1];
+      slot->hasGains = true;
+    }
   }
-  platform_unlockAudioDevice();
 }
 
-SoundState getSoundState(Audio *audio, int slotId)
+static int __rampedGain(int from, int to, int offset)
 {
-  return slotId >= 0 && slotId < MAX_SOUND_SLOTS ? audio->soundSlots[slotId].state : STOPPED;
+  int step = offset / GAIN_STEP_FRAMES;
+  return step >= GAIN_RAMP_STEPS ? to : from + (to - from) * (step + 1) / GAIN_RAMP_STEPS;
 }
 
-void playStream(Audio *audio, WaveStream *waveStream, int volume, bool loop)
+// Offset is where the frames start within the chunk, which places them on the gain ramp.
+static void __mixVoiceFrames(SoundSlot *slot, int32_t *bus, int32_t *sendBus, const int16_t *source, int numFrames, int numChannels, int offset, bool reference)
 {
-  platform_lockAudioDevice();
-  waveStreamSeekStart(waveStream);
-  audio->streamSlot.data = waveStream;
-  audio->streamSlot.state = PLAYING;
-  audio->streamSlot.volume = CLAMP(volume, 0, MAX_VOLUME);
-  audio->streamSlot.loop = loop;
-  platform_unlockAudioDevice();
+  bool ramping = slot->gains[0] != slot->targetGains[0] || slot->gains[1] != slot->targetGains[1];
+
+  while (numFrames > 0)
+  {
+    int frames = numFrames;
+
+    if (ramping && offset < GAIN_STEP_FRAMES * GAIN_RAMP_STEPS)
+      frames = MIN(frames, GAIN_STEP_FRAMES - offset % GAIN_STEP_FRAMES);
+
+    __mixRouted(bus, sendBus, source, frames, numChannels, __rampedGain(slot->gains[0], slot->targetGains[0], offset),
+      __rampedGain(slot->gains[1], slot->targetGains[1], offset), slot->send, reference);
+
+    bus += frames * AUDIO_OUTPUT_CHANNELS;
+    sendBus += frames * AUDIO_OUTPUT_CHANNELS;
+    source += frames * numChannels;
+    offset += frames;
+    numFrames -= frames;
+  }
 }
 
-void stopStream(Audio *audio)
+static void __mixVoice(Audio *audio, SoundSlot *slot, int32_t *bus, int32_t *sendBus, int numFrames)
 {
-  platform_lockAudioDevice();
-  audio->streamSlot.state = STOPPED;
-  audio->streamSlot.data = NULL;
-  audio->streamSlot.volume = 0;
-  audio->streamSlot.loop = false;
-  platform_unlockAudioDevice();
+  Wave *wave = slot->soundData;
+  int channelCount = wave->channelCount;
+  int lastFrame = wave->sampleCount / channelCount - 1;
+
+  if (slot->rate == PLAYBACK_RATE_ONE && (slot->position & (PLAYBACK_RATE_ONE - 1)) == 0)
+    __mixVoiceFrames(slot, bus, sendBus, wave->samples + (slot->position >> PLAYBACK_RATE_SHIFT) * channelCount, numFrames, channelCount, 0, audio->referenceKernels);
+  else
+  {
+    __resample(audio->resampleBuffer, wave->samples, channelCount, lastFrame, slot->position, slot->rate, numFrames, audio->referenceKernels);
+    __mixVoiceFrames(slot, bus, sendBus, audio->resampleBuffer, numFrames, channelCount, 0, audio->referenceKernels);
+  }
 }
 
-void pauseStream(Audio *audio)
+/**
+ * Compressed voices decode just the source frames the chunk covers, plus one for interpolation, then mix like any other.
+ * Fast voices are split into pieces so the frames they cover always fit the decode buffer.
+ */
+static void __mixCompressedVoice(Audio *audio, SoundSlot *slot, int32_t *bus, int32_t *sendBus, int numFrames)
 {
-  platform_lockAudioDevice();
-  if (audio->streamSlot.state == PLAYING)
-    audio->streamSlot.state = PAUSED;
-  platform_unlockAudioDevice();
+  Wave *wave = slot->soundData;
+  int channelCount = wave->channelCount;
+  int lastFrame = wave->sampleCount / channelCount - 1;
+  uint64_t position = slot->position;
+  uint32_t rate = slot->rate;
+  int maxFrames = (int)MAX(1, ((uint64_t)(DECODE_BUFFER_FRAMES - 2) << PLAYBACK_RATE_SHIFT) / rate);
+  int mixedFrames = 0;
+
+  while (numFrames > 0)
+  {
+    int frames = MIN(numFrames, maxFrames);
+    int first = (int)(position >> PLAYBACK_RATE_SHIFT);
+    int last = (int)MIN((uint64_t)lastFrame, ((position + (uint64_t)rate * (frames - 1)) >> PLAYBACK_RATE_SHIFT) + 1);
+    uint64_t offset = position - ((uint64_t)first << PLAYBACK_RATE_SHIFT);
+
+    decodeAdpcm(wave, &slot->decoder, audio->decodeBuffer, first, last);
+
+    if (rate == PLAYBACK_RATE_ONE && offset == 0)
+      __mixVoiceFrames(slot, bus, sendBus, audio->decodeBuffer, frames, channelCount, mixedFrames, audio->referenceKernels);
+    else
+    {
+      __resample(audio->resampleBuffer, audio->decodeBuffer, channelCount, last - first, offset, rate, frames, audio->referenceKernels);
+      __mixVoiceFrames(slot, bus, sendBus, audio->resampleBuffer, frames, channelCount, mixedFrames, audio->referenceKernels);
+    }
+
+    bus += frames * AUDIO_OUTPUT_CHANNELS;
+    sendBus += frames * AUDIO_OUTPUT_CHANNELS;
+    position += (uint64_t)rate * frames;
+    mixedFrames += frames;
+    numFrames -= frames;
+  }
 }
 
-void resumeStream(Audio *audio)
+/**
+ * Only the MAX_MIXED_VOICES most audible playing voices are mixed, so the mixer's cost is bounded however many sounds
+ * are triggered. Priority ranks first, then loudness, which accounts for pan and position. Silent voices are never mixed,
+ * and neither are positional voices beyond the listener's range.
+ */
+static int __loudness(const SoundSlot *slot)
 {
-  platform_lockAudioDevice();
-  if (audio->streamSlot.state == PAUSED)
-    audio->streamSlot.state = PLAYING;
-  platform_unlockAudioDevice();
+  return MAX(MAX(slot->gains[0], slot->gains[1]), MAX(slot->targetGains[0], slot->targetGains[1]));
 }
 
-void setMasterVolume(Audio *audio, int volume)
+static void __selectAudibleVoices(const SoundSlot *slots, bool *audible)
 {
-  audio->masterVolume = CLAMP(volume, 0, MAX_VOLUME);
+  int playing = 0;
+
+  for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+  {
+    audible[i] = slots[i].state == PLAYING && __loudness(&slots[i]) > 0;
+    playing += audible[i];
+  }
+
+  // Drop the least audible voice until the rest fit. Playing counts are small, so a linear scan per drop is plenty.
+  for (; playing > MAX_MIXED_VOICES; playing--)
+  {
+    int quietest = -1;
+
+    for (int i = 0; i < MAX_SOUND_SLOTS; i++)
+    {
+      if (audible[i] && (quietest == -1 || slots[i].priority < slots[quietest].priority
+        || (slots[i].priority == slots[quietest].priority && __loudness(&slots[i]) < __loudness(&slots[quietest]))))
+        quietest = i;
+    }
+    audible[quietest] = false;
+  }
 }
 
-static void __mixSamples(int16_t *destination, const int16_t *source, int numSamples, int numChannels, int volume)
+/**
+ * Resolves the start of every stream that's due within the chunk. A stream whose data hasn't been prefetched yet
+ * keeps waiting, and its start slides to the next chunk. Fade-ins, and the fade-out of a crossfade's outgoing slot,
+ * are anchored to the frame the stream really starts on.
+ */
+static void __startStreams(Audio *audio, uint64_t chunkStart, uint64_t chunkEnd)
 {
-  int16_t sourceSample, destSample;
-  while (numSamples--)
+  StreamSlot *slots = audio->streamSlots;
+
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
   {
-    sourceSample = (*source++ * volume) / MAX_VOLUME;
-    for (int i = 0; i < 3 - numChannels; i++)
+    StreamSlot *slot = &slots[i];
+
+    if (slot->state != PLAYING || !slot->waiting || slot->startFrame >= chunkEnd)
+      continue;
+
+    if (!isWaveStreamReady(slot->data))
+    {
+      slot->startFrame = chunkEnd;
+      continue;
+    }
+
+    slot->startFrame = MAX(slot->startFrame, chunkStart);
+    slot->waiting = false;
+
+    if (slot->rampFrames > 0 && slot->rampStart == UNSCHEDULED)
+      slot->rampStart = slot->startFrame;
+
+    if (slot->linkedSlot != -1)
     {
-      destSample = CLAMP(sourceSample + *destination, S16_MIN, S16_MAX);
-      *destination++ = destSample;
+      StreamSlot *outgoing = &slots[slot->linkedSlot];
+
+      if (outgoing->state != STOPPED && outgoing->stopAfterRamp && outgoing->rampStart == UNSCHEDULED)
+        outgoing->rampStart = slot->startFrame;
+      slot->linkedSlot = -1;
     }
   }
 }
 
-// We clamp on every mix, which can cause clipping when we're mixing many sounds together.
-// Ideally, we'd clamp after all sounds are mixed.
-// Haven't had any issues yet, but if we start to get distortion, then this is probably the issue.
-void mixSamplesIntoStream(Audio *audio, int16_t *stream, int numSamples)
+// Splits the frames at the ramp's edges, so only the frames that are actually ramping go through the ramp kernel.
+static void __mixStreamFrames(StreamSlot *slot, int32_t *bus, int32_t *sendBus, const int16_t *source, int numFrames, int numChannels, uint64_t frame, bool reference)
 {
-  if (audio->streamSlot.state == PLAYING)
+  while (numFrames > 0)
   {
-    WaveStream *streamData = audio->streamSlot.data;
+    int frames = numFrames;
 
-    if (streamData->channelCount == 1)
-      numSamples /= 2;
+    if (slot->rampFrames > 0 && slot->rampStart != UNSCHEDULED && frame >= slot->rampStart)
+    {
+      frames = MIN(frames, slot->rampFrames);
+      __mixRoutedRamp(bus, sendBus, source, frames, numChannels, &slot->rampGain, slot->rampStep, slot->send);
+      slot->rampFrames -= frames;
+      slot->rampStart = frame + frames;
+
+      if (slot->rampFrames == 0)
+        slot->gain = slot->targetGain;
+    }
+    else
+    {
+      if (slot->rampFrames > 0 && slot->rampStart != UNSCHEDULED)
+        frames = (int)MIN((uint64_t)frames, slot->rampStart - frame);
+      __mixRouted(bus, sendBus, source, frames, numChannels, slot->gain, slot->gain, slot->send, reference);
+    }
+
+    bus += frames * AUDIO_OUTPUT_CHANNELS;
+    sendBus += frames * AUDIO_OUTPUT_CHANNELS;
+    source += frames * numChannels;
+    frame += frames;
+    numFrames -= frames;
+  }
+}
+
+static void __mixStream(Audio *audio, StreamSlot *slot, int32_t *bus, int32_t *sendBus, uint64_t chunkStart, int numFrames)
+{
+  WaveStream *stream = slot->data;
+  uint64_t from = MAX(slot->startFrame, chunkStart);
+  uint64_t to = chunkStart + (uint64_t)numFrames;
+
+  // A stream that's fading out to stop reads no further than the end of its fade.
+  if (slot->stopAfterRamp && slot->rampStart != UNSCHEDULED)
+    to = MIN(to, slot->rampStart + (uint64_t)slot->rampFrames);
+
+  bool finished = true;
+
+  if (to > from)
+  {
+    int numSamples = (int)(to - from) * stream->channelCount;
+    finished = readWaveStream(stream, numSamples);
+    audio->callbackStreamBytes += stream->sampleCount * (int)sizeof(int16_t);
+
+    // The prefetcher fell behind, and the ring ran dry.
+    if (!finished && stream->sampleCount < numSamples)
+      SDL_AtomicAdd(&audio->statStreamStarves, 1);
+
+    uint64_t offset = (from - chunkStart) * AUDIO_OUTPUT_CHANNELS;
+    __mixStreamFrames(slot, bus + offset, sendBus + offset, stream->chunk,
+      stream->sampleCount / stream->channelCount, stream->channelCount, from, audio->referenceKernels);
+  }
+
+  slot->startFrame = to;
+
+  if (finished || (slot->stopAfterRamp && slot->rampFrames == 0))
+    __resetStreamSlot(slot);
+}
+
+/**
+ * Histograms are written by one thread and read by another, so every bucket is its own atomic, as are the other
+ * counters. A reader may see a sample in the count that isn't in its bucket yet, which is fine for statistics.
+ */
+static void __recordStat(StatHistogram *histogram, int value)
+{
+  int bucket = 0;
+
+  for (unsigned remaining = (unsigned)MAX(value, 0); remaining > 0 && bucket < STAT_BUCKETS - 1; remaining >>= 1)
+    bucket++;
+
+  SDL_AtomicAdd(&histogram->buckets[bucket], 1);
+  SDL_AtomicAdd(&histogram->count, 1);
+
+  if (value > SDL_AtomicGet(&histogram->max))
+    SDL_AtomicSet(&histogram->max, value);
+}
+
+// The time from playSound until the callback that mixed the voice's first frame, plus that frame's place in its buffer.
+static void __recordPlayLatency(Audio *audio, SoundSlot *slot)
+{
+  if (audio->callbackMicros != 0)
+  {
+    int64_t mixedMicros = audio->callbackMicros + (int64_t)audio->callbackFrames * 1000000 / AUDIO_FREQUENCY;
+    __recordStat(&audio->statPlayLatency, (int)MAX(mixedMicros - slot->requestedMicros, 0));
+  }
+
+  slot->requestedMicros = 0;
+}
 
-    bool finished = readWaveStream(streamData, numSamples, audio->streamSlot.loop);
-    __mixSamples(stream, streamData->chunk, streamData->sampleCount, streamData->channelCount, audio->streamSlot.volume);
+static void __mixChunk(Audio *audio, int16_t *stream, int numSamples)
+{
+  int32_t *bus = audio->bus;
+  int32_t *sendBus = audio->sendBus;
+  int numFrames = numSamples / AUDIO_OUTPUT_CHANNELS;
+  uint64_t chunkStart = audio->frameClock;
+  bool sent = false;
+
+  memset(bus, 0, numSamples * sizeof(int32_t));
+  memset(sendBus, 0, numSamples * sizeof(int32_t));
+
+  __startStreams(audio, chunkStart, chunkStart + (uint64_t)numFrames);
+
+  for (int i = 0; i < MAX_STREAM_SLOTS; i++)
+  {
+    StreamSlot *streamSlot = &audio->streamSlots[i];
 
-    if (finished)
-      audio->streamSlot.state = STOPPED;
+    if (streamSlot->state == PLAYING && !streamSlot->waiting)
+    {
+      sent |= streamSlot->send > 0;
+      __mixStream(audio, streamSlot, bus, sendBus, chunkStart, numFrames);
+    }
   }
 
   SoundSlot *slots = audio->soundSlots;
+  bool audible[MAX_SOUND_SLOTS];
+  int mixedVoices = 0;
+
+  __updateVoiceGains(audio);
+  __selectAudibleVoices(slots, audible);
 
   for (int i = 0; i < MAX_SOUND_SLOTS; i++)
   {
     if (slots[i].state == PLAYING)
     {
-      if (slots[i].remainingSamples > 0)
+      Wave *wave = slots[i].soundData;
+      uint64_t end = (uint64_t)(wave->sampleCount / wave->channelCount) << PLAYBACK_RATE_SHIFT;
+
+      if (slots[i].position < end)
       {
-        int samplesToMix = MIN(slots[i].remainingSamples, numSamples);
+        uint32_t rate = slots[i].rate;
+        int framesToMix = (int)MIN((uint64_t)numFrames, (end - slots[i].position + rate - 1) / rate);
+
+        // Voices that weren't selected are virtual: they keep time, but aren't heard.
+        if (audible[i] && wave->encoding == WAVE_IMA_ADPCM)
+          __mixCompressedVoice(audio, &slots[i], bus, sendBus, framesToMix);
+        else if (audible[i])
+          __mixVoice(audio, &slots[i], bus, sendBus, framesToMix);
 
-        if (slots[i].soundData->channelCount == 1)
-          samplesToMix /= 2;
+        sent |= audible[i] && slots[i].send > 0;
+        mixedVoices += audible[i];
 
-        __mixSamples(stream, slots[i].position, samplesToMix, slots[i].soundData->channelCount, slots[i].volume);
-        slots[i].position += samplesToMix;
-        slots[i].remainingSamples -= samplesToMix;
+        if (audible[i] && slots[i].requestedMicros != 0)
+          __recordPlayLatency(audio, &slots[i]);
+
+        slots[i].position += (uint64_t)rate * framesToMix;
+        slots[i].gains[0] = slots[i].targetGains[0];
+        slots[i].gains[1] = slots[i].targetGains[1];
       }
       else
+        __resetSoundSlot(&slots[i]);
+    }
+  }
+
+  renderSynth(&audio->synth, bus, numFrames);
+  processEffects(&audio->effects, sent ? sendBus : NULL, bus, numFrames);
+  __resolveBus(bus, stream, numSamples, audio->masterVolume);
+  audio->frameClock += (uint64_t)numFrames;
+  audio->callbackFrames += numFrames;
+  audio->callbackVoices = MAX(audio->callbackVoices, mixedVoices);
+}
+
+void mixSamplesIntoStream(Audio *audio, int16_t *stream, int numSamples)
+{
+  __drainCommands(audio);
+
+  while (numSamples > 0)
+  {
+    int chunkSize = MIN(numSamples, MIX_BUS_SIZE);
+    __mixChunk(audio, stream, chunkSize);
+    stream += chunkSize;
+    numSamples -= chunkSize;
+  }
+
+  __publishStates(audio);
+}
+
+/**
+ * Everything above mixes at AUDIO_FREQUENCY in stereo S16. The device gets whatever it natively runs at: when that
+ * differs, the mixed frames are linearly resampled (with the same kernel voices use) and then converted to the device's
+ * channel count and sample format. Mixing at the engine's own rate keeps streams and SFX timing independent of hardware.
+ *
+ * Mixed frames that a chunk didn't fully consume are kept for the next one, so interpolation is seamless across callbacks.
+ */
+
+bool setAudioOutput(Audio *audio, int frequency, int channels, AudioFormat format, int bufferFrames)
+{
+  AudioOutput *output = &audio->output;
+
+  if (frequency < MIN_OUTPUT_FREQUENCY || channels < 1 || channels > MAX_OUTPUT_CHANNELS)
+    return false;
+
+  output->frequency = frequency;
+  output->channels = channels;
+  output->format = format;
+  output->bufferFrames = bufferFrames;
+  output->step = (uint32_t)(((uint64_t)AUDIO_FREQUENCY << PLAYBACK_RATE_SHIFT) / (uint64_t)frequency);
+  output->position = 0;
+  output->bufferedFrames = 0;
+  return true;
+}
+
+static int __bytesPerSample(AudioFormat format)
+{
+  return format == AUDIO_FORMAT_S16 ? (int)sizeof(int16_t) : (int)sizeof(int32_t);
+}
+
+// Stereo is folded down to mono, or written to the front pair with any other channels left silent.
+static void __writeOutput(const AudioOutput *output, uint8_t *stream, const int16_t *frames, int numFrames)
+{
+  int16_t *s16 = (int16_t *)stream;
+  int32_t *s32 = (int32_t *)stream;
+  float *f32 = (float *)stream;
+  int channels = output->channels;
+  int i = 0;
+
+#ifdef MILK_SSE2
+  if (output->format == AUDIO_FORMAT_F32 && channels == AUDIO_OUTPUT_CHANNELS)
+  {
+    __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+
+    for (; i + 4 <= numFrames; i += 4)
+    {
+      __m128i samples = _mm_loadu_si128((__m128i *)(frames + i * 2));
+      __m128i low = _mm_srai_epi32(_mm_unpacklo_epi16(samples, samples), 16);
+      __m128i high = _mm_srai_epi32(_mm_unpackhi_epi16(samples, samples), 16);
+      _mm_storeu_ps(f32 + i * 2, _mm_mul_ps(_mm_cvtepi32_ps(low), scale));
+      _mm_storeu_ps(f32 + i * 2 + 4, _mm_mul_ps(_mm_cvtepi32_ps(high), scale));
+    }
+  }
+#endif
+
+  for (; i < numFrames; i++)
+  {
+    int32_t left = frames[i * 2];
+    int32_t right = frames[i * 2 + 1];
+
+    for (int channel = 0; channel < channels; channel++)
+    {
+      int32_t sample = channels == 1 ? (left + right) >> 1 : channel == 0 ? left : channel == 1 ? right : 0;
+      int index = i * channels + channel;
+
+      switch (output->format)
       {
-        slots[i].soundData = NULL;
-        slots[i].position = NULL;
-        slots[i].state = STOPPED;
-        slots[i].remainingSamples = 0;
-        slots[i].volume = 0;
+        case AUDIO_FORMAT_S16:
+          s16[index] = (int16_t)sample;
+          break;
+        case AUDIO_FORMAT_S32:
+          s32[index] = (int32_t)((uint32_t)sample << 16);
+          break;
+        case AUDIO_FORMAT_F32:
+          f32[index] = (float)sample * (1.0f / 32768.0f);
+          break;
       }
     }
   }
 }
+
+void mixAudioOutput(Audio *audio, uint8_t *stream, int numBytes)
+{
+  AudioOutput *output = &audio->output;
+  int frameSize = output->channels * __bytesPerSample(output->format);
+  int numFrames = numBytes / frameSize;
+
+  audio->callbackMicros = platform_getMicros();
+  audio->callbackFrames = 0;
+
+  if (output->frequency == AUDIO_FREQUENCY && output->channels == AUDIO_OUTPUT_CHANNELS && output->format == AUDIO_FORMAT_S16)
+  {
+    mixSamplesIntoStream(audio, (int16_t *)stream, numFrames * AUDIO_OUTPUT_CHANNELS);
+    return;
+  }
+
+  while (numFrames > 0)
+  {
+    int chunkFrames = MIN(numFrames, OUTPUT_CHUNK_FRAMES);
+    const int16_t *frames = output->frames;
+
+    if (output->frequency == AUDIO_FREQUENCY)
+      mixSamplesIntoStream(audio, output->frames, chunkFrames * AUDIO_OUTPUT_CHANNELS);
+    else
+    {
+      // Enough frames to interpolate the chunk's last output frame, and to hold the frame the next chunk starts from.
+      uint64_t last = output->position + (uint64_t)output->step * (chunkFrames - 1);
+      uint64_t next = output->position + (uint64_t)output->step * chunkFrames;
+      int framesNeeded = (int)MAX((last >> PLAYBACK_RATE_SHIFT) + 2, (next >> PLAYBACK_RATE_SHIFT) + 1);
+      int consumed = (int)(next >> PLAYBACK_RATE_SHIFT);
+
+      if (framesNeeded > output->bufferedFrames)
+        mixSamplesIntoStream(audio, output->frames + output->bufferedFrames * AUDIO_OUTPUT_CHANNELS, (framesNeeded - output->bufferedFrames) * AUDIO_OUTPUT_CHANNELS);
+
+      __resample(output->resampled, output->frames, AUDIO_OUTPUT_CHANNELS, framesNeeded - 1, output->position, output->step, chunkFrames, audio->referenceKernels);
+
+      output->bufferedFrames = framesNeeded - consumed;
+      output->position = next - ((uint64_t)consumed << PLAYBACK_RATE_SHIFT);
+      memmove(output->frames, output->frames + consumed * AUDIO_OUTPUT_CHANNELS, output->bufferedFrames * AUDIO_OUTPUT_CHANNELS * sizeof(int16_t));
+      frames = output->resampled;
+    }
+
+    __writeOutput(output, stream, frames, chunkFrames);
+    stream += chunkFrames * frameSize;
+    numFrames -= chunkFrames;
+  }
+
+  memset(stream, 0, (size_t)(numBytes % frameSize));
+}
+
+/**
+ * The device doesn't tell us when it ran dry, so underruns are inferred from the callback's timing: a callback that took
+ * longer than the buffer it filled, or that arrived more than a buffer late, means the device had nothing to play.
+ * Durations are written by the callback and read by the game thread, so each counter is its own atomic.
+ *
+ * Called by the callback once it has mixed, so it also closes the callback's counts of voices and stream bytes.
+ */
+
+#define AVERAGE_WEIGHT_SHIFT 4
+
+void recordAudioCallback(Audio *audio, int intervalMicros, int durationMicros)
+{
+  int bufferMicros = (int)((int64_t)audio->output.bufferFrames * 1000000 / audio->output.frequency);
+  int average = SDL_AtomicGet(&audio->statAverageDuration);
+  int callbacks = SDL_AtomicAdd(&audio->statCallbacks, 1);
+
+  // The first callback has no predecessor to be late against.
+  if (durationMicros > bufferMicros || (callbacks > 0 && intervalMicros > bufferMicros * 2))
+    SDL_AtomicAdd(&audio->statUnderruns, 1);
+
+  average = callbacks == 0 ? durationMicros : average + ((durationMicros - average) >> AVERAGE_WEIGHT_SHIFT);
+  SDL_AtomicSet(&audio->statLastDuration, durationMicros);
+  SDL_AtomicSet(&audio->statAverageDuration, average);
+
+  if (durationMicros > SDL_AtomicGet(&audio->statMaxDuration))
+    SDL_AtomicSet(&audio->statMaxDuration, durationMicros);
+
+  __recordStat(&audio->statCallback, durationMicros);
+  __recordStat(&audio->statVoices, audio->callbackVoices);
+  __recordStat(&audio->statStreamBytes, audio->callbackStreamBytes);
+  audio->callbackVoices = 0;
+  audio->callbackStreamBytes = 0;
+}
+
+// Called by the platform with how long the game thread waited on the device lock, which the callback holds while it mixes.
+void recordAudioLockWait(Audio *audio, int waitMicros)
+{
+  __recordStat(&audio->statLockWait, waitMicros);
+}
+
+static int __bucketLimit(const StatSummary *summary, int bucket)
+{
+  return bucket == STAT_BUCKETS - 1 ? summary->max : MIN((1 << bucket) - 1, summary->max);
+}
+
+static void __summarizeStat(StatHistogram *histogram, StatSummary *summary)
+{
+  int percentiles[] = { 50, 90, 99 };
+  int *values[] = { &summary->p50, &summary->p90, &summary->p99 };
+  int seen = 0;
+  int next = 0;
+
+  summary->count = SDL_AtomicGet(&histogram->count);
+  summary->max = SDL_AtomicGet(&histogram->max);
+  summary->p50 = summary->p90 = summary->p99 = 0;
+
+  for (int i = 0; i < STAT_BUCKETS; i++)
+  {
+    summary->buckets[i] = SDL_AtomicGet(&histogram->buckets[i]);
+    seen += summary->buckets[i];
+
+    while (next < 3 && summary->count > 0 && (int64_t)seen * 100 >= (int64_t)summary->count * percentiles[next])
+      *values[next++] = __bucketLimit(summary, i);
+  }
+}
+
+static void __resetStat(StatHistogram *histogram)
+{
+  SDL_AtomicSet(&histogram->count, 0);
+  SDL_AtomicSet(&histogram->max, 0);
+
+  for (int i = 0; i < STAT_BUCKETS; i++)
+    SDL_AtomicSet(&histogram->buckets[i], 0);
+}
+
+void getAudioStats(Audio *audio, AudioStats *stats)
+{
+  stats->frequency = audio->output.frequency;
+  stats->bufferFrames = audio->output.bufferFrames;
+  stats->callbacks = SDL_AtomicGet(&audio->statCallbacks);
+  stats->underruns = SDL_AtomicGet(&audio->statUnderruns);
+  stats->lastCallbackMicros = SDL_AtomicGet(&audio->statLastDuration);
+  stats->averageCallbackMicros = SDL_AtomicGet(&audio->statAverageDuration);
+  stats->maxCallbackMicros = SDL_AtomicGet(&audio->statMaxDuration);
+  stats->streamStarves = SDL_AtomicGet(&audio->statStreamStarves);
+  __summarizeStat(&audio->statCallback, &stats->callback);
+  __summarizeStat(&audio->statVoices, &stats->voices);
+  __summarizeStat(&audio->statStreamBytes, &stats->streamBytes);
+  __summarizeStat(&audio->statLockWait, &stats->lockWait);
+  __summarizeStat(&audio->statPlayLatency, &stats->playLatency);
+}
+
+void resetAudioStats(Audio *audio)
+{
+  SDL_AtomicSet(&audio->statCallbacks, 0);
+  SDL_AtomicSet(&audio->statUnderruns, 0);
+  SDL_AtomicSet(&audio->statLastDuration, 0);
+  SDL_AtomicSet(&audio->statAverageDuration, 0);
+  SDL_AtomicSet(&audio->statMaxDuration, 0);
+  SDL_AtomicSet(&audio->statStreamStarves, 0);
+  __resetStat(&audio->statCallback);
+  __resetStat(&audio->statVoices);
+  __resetStat(&audio->statStreamBytes);
+  __resetStat(&audio->statLockWait);
+  __resetStat(&audio->statPlayLatency);
+}
@@ -1,10 +1,13 @@
 #ifndef __AUDIO_H__
 #define __AUDIO_H__
 
+#include <SDL_atomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "effects.h"
+#include "synth.h"
 #include "wave.h"
 
 #define AUDIO_FREQUENCY 44100
@@ -12,8 +15,30 @@
 #define AUDIO_OUTPUT_CHANNELS 2
 #define AUDIO_OUTPUT_SAMPLES 4096
 #define AUDIO_CHUNK_SIZE (AUDIO_OUTPUT_SAMPLES * (AUDIO_BITS_PER_SAMPLE * AUDIO_OUTPUT_CHANNELS / 8))
-#define MAX_SOUND_SLOTS 16
+#define MIX_BUS_SIZE (AUDIO_OUTPUT_SAMPLES * AUDIO_OUTPUT_CHANNELS)
+#define MAX_SOUND_SLOTS 64
+#define MAX_MIXED_VOICES 16
+#define AUTO_SOUND_SLOT -1
+#define MAX_STREAM_SLOTS 4
+#define UNSCHEDULED UINT64_MAX
 #define MAX_VOLUME 128
+#define MAX_SEND 128
+#define MAX_PAN 128
+#define GAIN_STEP_FRAMES 32
+#define GAIN_RAMP_STEPS 8
+#define DEFAULT_LISTENER_RANGE 256.0f
+#define AUDIO_COMMAND_QUEUE_SIZE 1024
+#define PLAYBACK_RATE_SHIFT 16
+#define PLAYBACK_RATE_ONE (1 << PLAYBACK_RATE_SHIFT)
+#define MAX_PLAYBACK_RATE (64 << PLAYBACK_RATE_SHIFT)
+#define MIN_OUTPUT_FREQUENCY 8000
+#define MAX_OUTPUT_CHANNELS 8
+#define OUTPUT_CHUNK_FRAMES 512
+#define DECODE_BUFFER_FRAMES 2048
+#define AUDIO_DEFAULT_BUFFER_FRAMES 4096
+#define AUDIO_MIN_BUFFER_FRAMES 256
+#define AUDIO_MAX_BUFFER_FRAMES 4096
+#define STAT_BUCKETS 20
 
 typedef enum
 {
@@ -22,43 +47,258 @@ typedef enum
   PAUSED
 } SoundState;
 
+typedef enum
+{
+  AUDIO_FORMAT_S16,
+  AUDIO_FORMAT_S32,
+  AUDIO_FORMAT_F32
+} AudioFormat;
+
+typedef struct
+{
+  int frequency;
+  int channels;
+  AudioFormat format;
+  int bufferFrames;
+  uint32_t step;            // Mixed frames consumed per device frame, 16.16 fixed point.
+  uint64_t position;        // Position within frames, 16.16 fixed point.
+  int bufferedFrames;       // Mixed frames still waiting to be resampled.
+  int16_t frames[MIX_BUS_SIZE];
+  int16_t resampled[OUTPUT_CHUNK_FRAMES * AUDIO_OUTPUT_CHANNELS];
+} AudioOutput;
+
 typedef struct
 {
   Wave *soundData;
   SoundState state;
   int volume;
-  int remainingSamples;
-  int16_t *position;
+  int send;           // Share of the voice routed through the effect bus, out of MAX_SEND.
+  int pan;            // From -MAX_PAN, hard left, to MAX_PAN, hard right.
+  bool positional;    // Attenuated and panned by its position relative to the listener.
+  float x;
+  float y;
+  bool hasGains;
+  int gains[2];       // Left and right gains at the start of the chunk, Q14.
+  int targetGains[2]; // Left and right gains by the end of the chunk's ramp.
+  int priority;
+  int64_t requestedMicros; // When playSound was called, until the voice's first frame is mixed.
+  uint32_t rate;      // Source frames advanced per output frame, 16.16 fixed point.
+  uint64_t position;  // Current source frame, 16.16 fixed point.
+  AdpcmDecoder decoder;
 } SoundSlot;
 
 typedef struct
 {
   WaveStream *data;
   SoundState state;
+  int send;             // Belongs to the slot rather than to what's playing in it.
+  bool waiting;         // Not producing yet: waiting for its start frame, or for its first prefetched data.
+  uint64_t startFrame;
+  uint64_t pausedAt;
+  int linkedSlot;       // The slot a crossfade fades out once this one actually starts, or -1.
+
+  // Gains are Q14. During a ramp, rampGain carries 16 extra fractional bits.
+  int gain;
+  int targetGain;
+  uint64_t rampStart;
+  int rampFrames;
+  int32_t rampGain;
+  int32_t rampStep;
+  bool stopAfterRamp;
+} StreamSlot;
+
+typedef enum
+{
+  COMMAND_PLAY_SOUND,
+  COMMAND_STOP_SOUND,
+  COMMAND_PAUSE_SOUND,
+  COMMAND_RESUME_SOUND,
+  COMMAND_PLAY_STREAM,
+  COMMAND_CROSSFADE_STREAM,
+  COMMAND_FADE_STREAM,
+  COMMAND_STOP_STREAM,
+  COMMAND_PAUSE_STREAM,
+  COMMAND_RESUME_STREAM,
+  COMMAND_SOUND_SEND,
+  COMMAND_STREAM_SEND,
+  COMMAND_SOUND_PAN,
+  COMMAND_SOUND_POSITION,
+  COMMAND_LISTENER,
+  COMMAND_LOW_PASS,
+  COMMAND_ECHO,
+  COMMAND_REVERB,
+  COMMAND_SYNTH_NOTE,
+  COMMAND_PLAY_PATTERN,
+  COMMAND_STOP_SYNTH,
+  COMMAND_MASTER_VOLUME
+} AudioCommandType;
+
+typedef struct
+{
+  AudioCommandType type;
+  unsigned serial;
+  int slotId;
   int volume;
+  int priority;
+  float pitch;
   bool loop;
-} StreamSlot;
+  bool stop;
+  int linkedSlotId;
+  int fadeFrames;
+  int delayFrames;
+  int note;
+  int durationFrames;
+  float params[3];
+  int64_t issuedMicros;
+  Wave *wave;
+  WaveStream *waveStream;
+} AudioCommand;
 
 typedef struct
 {
+  AudioCommand commands[AUDIO_COMMAND_QUEUE_SIZE];
+  SDL_atomic_t head;
+  SDL_atomic_t tail;
+} AudioCommandQueue;
+
+typedef struct
+{
+  SoundState state;
+  unsigned serial;
+} PendingState;
+
+typedef struct
+{
+  int priority;
+  int volume;
+  unsigned started;
+} VoiceInfo;
+
+// Bucket 0 counts zeroes, and bucket n the values from 2^(n-1) up to 2^n. The last bucket also takes everything above.
+typedef struct
+{
+  SDL_atomic_t count;
+  SDL_atomic_t max;
+  SDL_atomic_t buckets[STAT_BUCKETS];
+} StatHistogram;
+
+typedef struct
+{
+  int count;
+  int max;
+  int p50;            // Percentiles are the upper bound of the bucket they fall in.
+  int p90;
+  int p99;
+  int buckets[STAT_BUCKETS];
+} StatSummary;
+
+typedef struct
+{
+  int frequency;
+  int bufferFrames;
+  int callbacks;
+  int underruns;
+  int lastCallbackMicros;
+  int averageCallbackMicros;
+  int maxCallbackMicros;
+  int streamStarves;
+  StatSummary callback;     // Microseconds per callback.
+  StatSummary voices;       // Most voices mixed at once in a callback.
+  StatSummary streamBytes;  // Stream bytes read per callback.
+  StatSummary lockWait;     // Microseconds the game thread waited for the device lock.
+  StatSummary playLatency;  // Microseconds from playSound until the first frame was mixed into a callback's buffer.
+} AudioStats;
+
+typedef struct
+{
+  // Owned by the mixer
   SoundSlot soundSlots[MAX_SOUND_SLOTS];
-  StreamSlot streamSlot;
+  StreamSlot streamSlots[MAX_STREAM_SLOTS];
+  uint64_t frameClock;
   int masterVolume;
+  float listenerX;
+  float listenerY;
+  float listenerRange;
+  unsigned appliedSerial;
+  int64_t callbackMicros;     // When the current device callback started, or 0 when mixing offline.
+  int callbackFrames;         // Frames mixed since.
+  int callbackVoices;
+  int callbackStreamBytes;
+  int32_t bus[MIX_BUS_SIZE];
+  int32_t sendBus[MIX_BUS_SIZE];
+  EffectBus effects;
+  Synth synth;        // Its instruments and patterns are written by the game thread under the device lock.
+  int16_t resampleBuffer[MIX_BUS_SIZE];
+  int16_t decodeBuffer[DECODE_BUFFER_FRAMES * AUDIO_OUTPUT_CHANNELS];
+
+  // Shared between the game thread and the mixer
+  AudioCommandQueue commandQueue;
+  SDL_atomic_t publishedSoundStates[MAX_SOUND_SLOTS];
+  SDL_atomic_t publishedStreamStates[MAX_STREAM_SLOTS];
+  SDL_atomic_t publishedSerial;
+  SDL_atomic_t statCallbacks;
+  SDL_atomic_t statUnderruns;
+  SDL_atomic_t statLastDuration;
+  SDL_atomic_t statAverageDuration;
+  SDL_atomic_t statMaxDuration;
+  SDL_atomic_t statStreamStarves;
+  StatHistogram statCallback;
+  StatHistogram statVoices;
+  StatHistogram statStreamBytes;
+  StatHistogram statLockWait;
+  StatHistogram statPlayLatency;
+
+  // Owned by the game thread
+  PendingState pendingSoundStates[MAX_SOUND_SLOTS];
+  VoiceInfo voices[MAX_SOUND_SLOTS];
+  PendingState pendingStreamStates[MAX_STREAM_SLOTS];
+  unsigned commandSerial;
+
+  // Owned by the device callback
+  AudioOutput output;
+
+  // Set by the owner after initializing, before anything is played
+  bool offline;           // Mixed by its owner instead of a device callback, so it never takes the device lock.
+  bool referenceKernels;  // Mixes with the scalar kernels only, to check the SIMD ones against.
 } Audio;
 
 void initializeAudio(Audio *audio);
 void disableAudio(Audio *audio);
-void playSound(Audio *audio, Wave *wave, int slotId, int volume);
+int playSound(Audio *audio, Wave *wave, int slotId, int volume, float pitch, int priority);
 void stopSound(Audio *audio, int slotId);
 void stopInstances(Audio *audio, Wave *wave);
 void pauseSound(Audio *audio, int slotId);
 void resumeSound(Audio *audio, int slotId);
 SoundState getSoundState(Audio *audio, int slotId);
-void playStream(Audio *audio, WaveStream *waveStream, int volume, bool loop);
-void stopStream(Audio *audio);
-void pauseStream(Audio *audio);
-void resumeStream(Audio *audio);
+void playStream(Audio *audio, int slotId, WaveStream *waveStream, int volume, bool loop, int fadeFrames, int delayFrames);
+void crossfadeStream(Audio *audio, int fromSlotId, int toSlotId, WaveStream *waveStream, int volume, bool loop, int fadeFrames, int delayFrames);
+void fadeStream(Audio *audio, int slotId, int volume, int fadeFrames, int delayFrames, bool stop);
+void stopStream(Audio *audio, int slotId);
+void stopStreamInstances(Audio *audio, WaveStream *waveStream);
+void pauseStream(Audio *audio, int slotId);
+void resumeStream(Audio *audio, int slotId);
+SoundState getStreamState(Audio *audio, int slotId);
+void setSoundSend(Audio *audio, int slotId, int send);
+void setStreamSend(Audio *audio, int slotId, int send);
+void setSoundPan(Audio *audio, int slotId, int pan);
+void setSoundPosition(Audio *audio, int slotId, float x, float y);
+void setListener(Audio *audio, float x, float y, float range);
+void setLowPassEffect(Audio *audio, float cutoff, float resonance);
+void setEchoEffect(Audio *audio, int level, float seconds, float feedback);
+void setReverbEffect(Audio *audio, int level, float roomSize, float damping);
+bool defineInstrument(Audio *audio, int id, const Instrument *instrument);
+bool definePattern(Audio *audio, int id, const Pattern *pattern);
+void playNote(Audio *audio, int instrument, int note, int volume, int durationFrames);
+void playPattern(Audio *audio, int pattern);
+void stopPattern(Audio *audio);
 void setMasterVolume(Audio *audio, int volume);
 void mixSamplesIntoStream(Audio *audio, int16_t *stream, int numSamples);
+bool setAudioOutput(Audio *audio, int frequency, int channels, AudioFormat format, int bufferFrames);
+void mixAudioOutput(Audio *audio, uint8_t *stream, int numBytes);
+void recordAudioCallback(Audio *audio, int intervalMicros, int durationMicros);
+void recordAudioLockWait(Audio *audio, int waitMicros);
+void getAudioStats(Audio *audio, AudioStats *stats);
+void resetAudioStats(Audio *audio);
+void useReferenceMixing(Audio *audio, bool enabled);
 
 #endif
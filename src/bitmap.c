@@ -34,6 +34,26 @@ Bitmap *loadBitmap(const char *filePath)
   return bitmap;
 }
 
+// Returns NULL when there isn't memory for the pixels. Callers bound the size, so it fits in a size_t.
+Bitmap *createBitmap(int width, int height, uint32_t color)
+{
+  size_t length = (size_t)width * (size_t)height;
+  Bitmap *bitmap = malloc(sizeof(Bitmap));
+  uint32_t *pixels = malloc(length * sizeof(uint32_t));
+  if (!bitmap || !pixels)
+  {
+    free(bitmap);
+    free(pixels);
+    return NULL;
+  }
+  bitmap->pixels = pixels;
+  bitmap->width = width;
+  bitmap->height = height;
+  for (size_t i = 0; i < length; i++)
+    bitmap->pixels[i] = color;
+  return bitmap;
+}
+
 void freeBitmap(Bitmap *bitmap)
 {
   free(bitmap->pixels);
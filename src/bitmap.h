@@ -11,6 +11,7 @@ typedef struct
 } Bitmap;
 
 Bitmap *loadBitmap(const char *filePath);
+Bitmap *createBitmap(int width, int height, uint32_t color);
 void freeBitmap(Bitmap *bitmap);
 
 #endif
@@ -0,0 +1,583 @@
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "buffer.h"
+#include "common.h"
+
+#if defined(MILK_AVX2)
+#include <immintrin.h>
+#elif defined(MILK_SSE2)
+#include <emmintrin.h>
+#endif
+
+/**
+ * Buffers are flat arrays of one numeric type, for data that's too big to be a table of numbers: tile maps,
+ * sprite batches, particles. Lua reads and writes them an element at a time or in bulk, and the engine reads them
+ * in place.
+ *
+ * Integer buffers behave like the C types they hold: numbers stored into them are truncated, and anything out of range
+ * wraps, as does arithmetic. That way an int32 buffer can hold colors with their alpha set. Integer arithmetic takes
+ * integer operands, so any fraction in an operand is dropped before it's applied.
+ *
+ * The scalar kernels are the reference. The SIMD kernels only use exact integer operations, and float multiplies and
+ * adds in the same order, so they give the same results for any length.
+ */
+
+static const int elementSizes[] = { sizeof(int8_t), sizeof(int16_t), sizeof(int32_t), sizeof(float) };
+
+Buffer *createBuffer(BufferElementType type, int length)
+{
+  Buffer *buffer = malloc(sizeof(Buffer));
+  void *data = calloc(MAX(length, 1), elementSizes[type]);
+
+  if (!buffer || !data)
+  {
+    free(buffer);
+    free(data);
+    return NULL;
+  }
+
+  buffer->type    = type;
+  buffer->length  = length;
+  buffer->data    = data;
+  return buffer;
+}
+
+void freeBuffer(Buffer *buffer)
+{
+  free(buffer->data);
+  free(buffer);
+}
+
+int getBufferElementSize(BufferElementType type)
+{
+  return elementSizes[type];
+}
+
+// Integer operands are cast through uint32_t, so overflow wraps instead of being undefined.
+#define WRAP(type, value) ((type)(uint32_t)(value))
+
+#define INT64_LOW   -9223372036854775808.0
+#define INT64_HIGH  9223372036854774784.0
+
+// Truncates, then wraps to 32 bits. NaN and anything past 64 bits can't be cast at all, so they're pinned first.
+static int32_t __toInteger(double value)
+{
+  if (value != value)
+    return 0;
+  return WRAP(int32_t, (uint64_t)(int64_t)CLAMP(value, INT64_LOW, INT64_HIGH));
+}
+
+double getBufferValue(const Buffer *buffer, int index)
+{
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+      return ((int8_t *)buffer->data)[index];
+    case BUFFER_INT16:
+      return ((int16_t *)buffer->data)[index];
+    case BUFFER_INT32:
+      return ((int32_t *)buffer->data)[index];
+    default:
+      return ((float *)buffer->data)[index];
+  }
+}
+
+int getBufferInt(const Buffer *buffer, int index)
+{
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+      return ((int8_t *)buffer->data)[index];
+    case BUFFER_INT16:
+      return ((int16_t *)buffer->data)[index];
+    case BUFFER_INT32:
+      return ((int32_t *)buffer->data)[index];
+    default:
+      return __toInteger(FLOOR(((float *)buffer->data)[index]));
+  }
+}
+
+static void __setValues(Buffer *buffer, int start, int count, double value)
+{
+  int end = start + count;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+    {
+      int8_t *data = buffer->data;
+      int8_t element = WRAP(int8_t, __toInteger(value));
+      for (int i = start; i < end; i++)
+        data[i] = element;
+      break;
+    }
+    case BUFFER_INT16:
+    {
+      int16_t *data = buffer->data;
+      int16_t element = WRAP(int16_t, __toInteger(value));
+      for (int i = start; i < end; i++)
+        data[i] = element;
+      break;
+    }
+    case BUFFER_INT32:
+    {
+      int32_t *data = buffer->data;
+      int32_t element = __toInteger(value);
+      for (int i = start; i < end; i++)
+        data[i] = element;
+      break;
+    }
+    case BUFFER_FLOAT32:
+    {
+      float *data = buffer->data;
+      float element = (float)value;
+      for (int i = start; i < end; i++)
+        data[i] = element;
+      break;
+    }
+  }
+}
+
+void setBufferValue(Buffer *buffer, int index, double value)
+{
+  __setValues(buffer, index, 1, value);
+}
+
+void fillBuffer(Buffer *buffer, int start, int count, double value)
+{
+  __setValues(buffer, start, count, value);
+}
+
+/**
+ * Copies between buffers of the same type are a straight memmove, so a buffer can be copied onto itself. Between
+ * types, each element is converted as if it had been stored from Lua.
+ */
+void copyBuffer(Buffer *dest, int destStart, const Buffer *source, int sourceStart, int count)
+{
+  if (dest->type == source->type)
+  {
+    int size = elementSizes[dest->type];
+    memmove((uint8_t *)dest->data + destStart * size, (uint8_t *)source->data + sourceStart * size, (size_t)count * size);
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+    __setValues(dest, destStart + i, 1, getBufferValue(source, sourceStart + i));
+}
+
+static void __addScalar(Buffer *buffer, int start, int32_t value, float floatValue)
+{
+  int length = buffer->length;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+      for (int8_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int8_t, (uint32_t)data[start] + (uint32_t)value);
+      break;
+    case BUFFER_INT16:
+      for (int16_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int16_t, (uint32_t)data[start] + (uint32_t)value);
+      break;
+    case BUFFER_INT32:
+      for (int32_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int32_t, (uint32_t)data[start] + (uint32_t)value);
+      break;
+    case BUFFER_FLOAT32:
+      for (float *data = buffer->data; start < length; start++)
+        data[start] += floatValue;
+      break;
+  }
+}
+
+static void __addBufferScalar(Buffer *buffer, const Buffer *other, int start, int32_t scale, float floatScale)
+{
+  int length = buffer->length;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+    {
+      int8_t *data = buffer->data;
+      const int8_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int8_t, (uint32_t)data[start] + (uint32_t)source[start] * (uint32_t)scale);
+      break;
+    }
+    case BUFFER_INT16:
+    {
+      int16_t *data = buffer->data;
+      const int16_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int16_t, (uint32_t)data[start] + (uint32_t)source[start] * (uint32_t)scale);
+      break;
+    }
+    case BUFFER_INT32:
+    {
+      int32_t *data = buffer->data;
+      const int32_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int32_t, (uint32_t)data[start] + (uint32_t)source[start] * (uint32_t)scale);
+      break;
+    }
+    case BUFFER_FLOAT32:
+    {
+      float *data = buffer->data;
+      const float *source = other->data;
+      for (; start < length; start++)
+        data[start] += source[start] * floatScale;
+      break;
+    }
+  }
+}
+
+static void __multiplyScalar(Buffer *buffer, int start, int32_t value, float floatValue)
+{
+  int length = buffer->length;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+      for (int8_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int8_t, (uint32_t)data[start] * (uint32_t)value);
+      break;
+    case BUFFER_INT16:
+      for (int16_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int16_t, (uint32_t)data[start] * (uint32_t)value);
+      break;
+    case BUFFER_INT32:
+      for (int32_t *data = buffer->data; start < length; start++)
+        data[start] = WRAP(int32_t, (uint32_t)data[start] * (uint32_t)value);
+      break;
+    case BUFFER_FLOAT32:
+      for (float *data = buffer->data; start < length; start++)
+        data[start] *= floatValue;
+      break;
+  }
+}
+
+static void __multiplyByBufferScalar(Buffer *buffer, const Buffer *other, int start)
+{
+  int length = buffer->length;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+    {
+      int8_t *data = buffer->data;
+      const int8_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int8_t, (uint32_t)data[start] * (uint32_t)source[start]);
+      break;
+    }
+    case BUFFER_INT16:
+    {
+      int16_t *data = buffer->data;
+      const int16_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int16_t, (uint32_t)data[start] * (uint32_t)source[start]);
+      break;
+    }
+    case BUFFER_INT32:
+    {
+      int32_t *data = buffer->data;
+      const int32_t *source = other->data;
+      for (; start < length; start++)
+        data[start] = WRAP(int32_t, (uint32_t)data[start] * (uint32_t)source[start]);
+      break;
+    }
+    case BUFFER_FLOAT32:
+    {
+      float *data = buffer->data;
+      const float *source = other->data;
+      for (; start < length; start++)
+        data[start] *= source[start];
+      break;
+    }
+  }
+}
+
+#if defined(MILK_SSE2)
+
+/**
+ * The SIMD kernels are written once against these, at whichever width the build has. Each returns how many elements
+ * it got through, and the scalar kernel does the rest. There's no 8 bit multiply at either width, and no 32 bit one
+ * before AVX2, so those are left to the scalar kernels unless the multiply is by one.
+ */
+#if defined(MILK_AVX2)
+#define VECTOR_BYTES            32
+#define LOAD_INTS(p)            _mm256_loadu_si256((const __m256i *)(p))
+#define STORE_INTS(p, v)        _mm256_storeu_si256((__m256i *)(p), v)
+#define LOAD_FLOATS(p)          _mm256_loadu_ps(p)
+#define STORE_FLOATS(p, v)      _mm256_storeu_ps(p, v)
+#define SPLAT_INT8(v)           _mm256_set1_epi8(v)
+#define SPLAT_INT16(v)          _mm256_set1_epi16(v)
+#define SPLAT_INT32(v)          _mm256_set1_epi32(v)
+#define SPLAT_FLOAT(v)          _mm256_set1_ps(v)
+#define ADD_INT8(a, b)          _mm256_add_epi8(a, b)
+#define ADD_INT16(a, b)         _mm256_add_epi16(a, b)
+#define ADD_INT32(a, b)         _mm256_add_epi32(a, b)
+#define MULTIPLY_INT16(a, b)    _mm256_mullo_epi16(a, b)
+#define MULTIPLY_INT32(a, b)    _mm256_mullo_epi32(a, b)
+#define ADD_FLOAT(a, b)         _mm256_add_ps(a, b)
+#define MULTIPLY_FLOAT(a, b)    _mm256_mul_ps(a, b)
+typedef __m256i IntVector;
+typedef __m256 FloatVector;
+#else
+#define VECTOR_BYTES            16
+#define LOAD_INTS(p)            _mm_loadu_si128((const __m128i *)(p))
+#define STORE_INTS(p, v)        _mm_storeu_si128((__m128i *)(p), v)
+#define LOAD_FLOATS(p)          _mm_loadu_ps(p)
+#define STORE_FLOATS(p, v)      _mm_storeu_ps(p, v)
+#define SPLAT_INT8(v)           _mm_set1_epi8(v)
+#define SPLAT_INT16(v)          _mm_set1_epi16(v)
+#define SPLAT_INT32(v)          _mm_set1_epi32(v)
+#define SPLAT_FLOAT(v)          _mm_set1_ps(v)
+#define ADD_INT8(a, b)          _mm_add_epi8(a, b)
+#define ADD_INT16(a, b)         _mm_add_epi16(a, b)
+#define ADD_INT32(a, b)         _mm_add_epi32(a, b)
+#define MULTIPLY_INT16(a, b)    _mm_mullo_epi16(a, b)
+#define ADD_FLOAT(a, b)         _mm_add_ps(a, b)
+#define MULTIPLY_FLOAT(a, b)    _mm_mul_ps(a, b)
+typedef __m128i IntVector;
+typedef __m128 FloatVector;
+#endif
+
+#define LANES(type) (VECTOR_BYTES / (int)sizeof(type))
+
+static int __addSimd(Buffer *buffer, int32_t value, float floatValue)
+{
+  int length = buffer->length;
+  int i = 0;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+    {
+      IntVector values = SPLAT_INT8((char)value);
+      for (int8_t *data = buffer->data; i + LANES(int8_t) <= length; i += LANES(int8_t))
+        STORE_INTS(data + i, ADD_INT8(LOAD_INTS(data + i), values));
+      break;
+    }
+    case BUFFER_INT16:
+    {
+      IntVector values = SPLAT_INT16((short)value);
+      for (int16_t *data = buffer->data; i + LANES(int16_t) <= length; i += LANES(int16_t))
+        STORE_INTS(data + i, ADD_INT16(LOAD_INTS(data + i), values));
+      break;
+    }
+    case BUFFER_INT32:
+    {
+      IntVector values = SPLAT_INT32(value);
+      for (int32_t *data = buffer->data; i + LANES(int32_t) <= length; i += LANES(int32_t))
+        STORE_INTS(data + i, ADD_INT32(LOAD_INTS(data + i), values));
+      break;
+    }
+    case BUFFER_FLOAT32:
+    {
+      FloatVector values = SPLAT_FLOAT(floatValue);
+      for (float *data = buffer->data; i + LANES(float) <= length; i += LANES(float))
+        STORE_FLOATS(data + i, ADD_FLOAT(LOAD_FLOATS(data + i), values));
+      break;
+    }
+  }
+  return i;
+}
+
+static int __addBufferSimd(Buffer *buffer, const Buffer *other, int32_t scale, float floatScale)
+{
+  int length = buffer->length;
+  int i = 0;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT8:
+    {
+      if (scale != 1)
+        break;
+
+      int8_t *data = buffer->data;
+      const int8_t *source = other->data;
+      for (; i + LANES(int8_t) <= length; i += LANES(int8_t))
+        STORE_INTS(data + i, ADD_INT8(LOAD_INTS(data + i), LOAD_INTS(source + i)));
+      break;
+    }
+    case BUFFER_INT16:
+    {
+      int16_t *data = buffer->data;
+      const int16_t *source = other->data;
+      IntVector scales = SPLAT_INT16((short)scale);
+      for (; i + LANES(int16_t) <= length; i += LANES(int16_t))
+        STORE_INTS(data + i, ADD_INT16(LOAD_INTS(data + i), MULTIPLY_INT16(LOAD_INTS(source + i), scales)));
+      break;
+    }
+    case BUFFER_INT32:
+    {
+      int32_t *data = buffer->data;
+      const int32_t *source = other->data;
+#if defined(MILK_AVX2)
+      IntVector scales = SPLAT_INT32(scale);
+      for (; i + LANES(int32_t) <= length; i += LANES(int32_t))
+        STORE_INTS(data + i, ADD_INT32(LOAD_INTS(data + i), MULTIPLY_INT32(LOAD_INTS(source + i), scales)));
+#else
+      if (scale != 1)
+        break;
+      for (; i + LANES(int32_t) <= length; i += LANES(int32_t))
+        STORE_INTS(data + i, ADD_INT32(LOAD_INTS(data + i), LOAD_INTS(source + i)));
+#endif
+      break;
+    }
+    case BUFFER_FLOAT32:
+    {
+      float *data = buffer->data;
+      const float *source = other->data;
+      FloatVector scales = SPLAT_FLOAT(floatScale);
+      for (; i + LANES(float) <= length; i += LANES(float))
+        STORE_FLOATS(data + i, ADD_FLOAT(LOAD_FLOATS(data + i), MULTIPLY_FLOAT(LOAD_FLOATS(source + i), scales)));
+      break;
+    }
+  }
+  return i;
+}
+
+static int __multiplySimd(Buffer *buffer, int32_t value, float floatValue)
+{
+  int length = buffer->length;
+  int i = 0;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT16:
+    {
+      IntVector values = SPLAT_INT16((short)value);
+      for (int16_t *data = buffer->data; i + LANES(int16_t) <= length; i += LANES(int16_t))
+        STORE_INTS(data + i, MULTIPLY_INT16(LOAD_INTS(data + i), values));
+      break;
+    }
+#if defined(MILK_AVX2)
+    case BUFFER_INT32:
+    {
+      IntVector values = SPLAT_INT32(value);
+      for (int32_t *data = buffer->data; i + LANES(int32_t) <= length; i += LANES(int32_t))
+        STORE_INTS(data + i, MULTIPLY_INT32(LOAD_INTS(data + i), values));
+      break;
+    }
+#endif
+    case BUFFER_FLOAT32:
+    {
+      FloatVector values = SPLAT_FLOAT(floatValue);
+      for (float *data = buffer->data; i + LANES(float) <= length; i += LANES(float))
+        STORE_FLOATS(data + i, MULTIPLY_FLOAT(LOAD_FLOATS(data + i), values));
+      break;
+    }
+    default:
+      break;
+  }
+  return i;
+}
+
+static int __multiplyByBufferSimd(Buffer *buffer, const Buffer *other)
+{
+  int length = buffer->length;
+  int i = 0;
+
+  switch (buffer->type)
+  {
+    case BUFFER_INT16:
+    {
+      int16_t *data = buffer->data;
+      const int16_t *source = other->data;
+      for (; i + LANES(int16_t) <= length; i += LANES(int16_t))
+        STORE_INTS(data + i, MULTIPLY_INT16(LOAD_INTS(data + i), LOAD_INTS(source + i)));
+      break;
+    }
+#if defined(MILK_AVX2)
+    case BUFFER_INT32:
+    {
+      int32_t *data = buffer->data;
+      const int32_t *source = other->data;
+      for (; i + LANES(int32_t) <= length; i += LANES(int32_t))
+        STORE_INTS(data + i, MULTIPLY_INT32(LOAD_INTS(data + i), LOAD_INTS(source + i)));
+      break;
+    }
+#endif
+    case BUFFER_FLOAT32:
+    {
+      float *data = buffer->data;
+      const float *source = other->data;
+      for (; i + LANES(float) <= length; i += LANES(float))
+        STORE_FLOATS(data + i, MULTIPLY_FLOAT(LOAD_FLOATS(data + i), LOAD_FLOATS(source + i)));
+      break;
+    }
+    default:
+      break;
+  }
+  return i;
+}
+
+#else
+
+static int __addSimd(Buffer *buffer, int32_t value, float floatValue)
+{
+  UNUSED(buffer);
+  UNUSED(value);
+  UNUSED(floatValue);
+  return 0;
+}
+
+static int __addBufferSimd(Buffer *buffer, const Buffer *other, int32_t scale, float floatScale)
+{
+  UNUSED(buffer);
+  UNUSED(other);
+  UNUSED(scale);
+  UNUSED(floatScale);
+  return 0;
+}
+
+static int __multiplySimd(Buffer *buffer, int32_t value, float floatValue)
+{
+  UNUSED(buffer);
+  UNUSED(value);
+  UNUSED(floatValue);
+  return 0;
+}
+
+static int __multiplyByBufferSimd(Buffer *buffer, const Buffer *other)
+{
+  UNUSED(buffer);
+  UNUSED(other);
+  return 0;
+}
+
+#endif
+
+void addToBuffer(Buffer *buffer, double value)
+{
+  int32_t integer = __toInteger(value);
+  int done = __addSimd(buffer, integer, (float)value);
+  __addScalar(buffer, done, integer, (float)value);
+}
+
+// Adds other, times scale. Both buffers must be the same type and length.
+void addBuffer(Buffer *buffer, const Buffer *other, double scale)
+{
+  int32_t integer = __toInteger(scale);
+  int done = __addBufferSimd(buffer, other, integer, (float)scale);
+  __addBufferScalar(buffer, other, done, integer, (float)scale);
+}
+
+void multiplyBuffer(Buffer *buffer, double value)
+{
+  int32_t integer = __toInteger(value);
+  int done = __multiplySimd(buffer, integer, (float)value);
+  __multiplyScalar(buffer, done, integer, (float)value);
+}
+
+// Multiplies element by element. Both buffers must be the same type and length.
+void multiplyByBuffer(Buffer *buffer, const Buffer *other)
+{
+  int done = __multiplyByBufferSimd(buffer, other);
+  __multiplyByBufferScalar(buffer, other, done);
+}
@@ -0,0 +1,34 @@
+#ifndef __BUFFER_H__
+#define __BUFFER_H__
+
+#include <stdint.h>
+
+typedef enum
+{
+  BUFFER_INT8,
+  BUFFER_INT16,
+  BUFFER_INT32,
+  BUFFER_FLOAT32
+} BufferElementType;
+
+typedef struct
+{
+  BufferElementType type;
+  int length;
+  void *data;
+} Buffer;
+
+Buffer *createBuffer(BufferElementType type, int length);
+void freeBuffer(Buffer *buffer);
+int getBufferElementSize(BufferElementType type);
+double getBufferValue(const Buffer *buffer, int index);
+int getBufferInt(const Buffer *buffer, int index);
+void setBufferValue(Buffer *buffer, int index, double value);
+void fillBuffer(Buffer *buffer, int start, int count, double value);
+void copyBuffer(Buffer *dest, int destStart, const Buffer *source, int sourceStart, int count);
+void addToBuffer(Buffer *buffer, double value);
+void addBuffer(Buffer *buffer, const Buffer *other, double scale);
+void multiplyBuffer(Buffer *buffer, double value);
+void multiplyByBuffer(Buffer *buffer, const Buffer *other);
+
+#endif
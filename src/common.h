@@ -16,4 +16,15 @@
 #define TOGGLE_BIT(val, bit)  ((val) ^= (bit))
 #define CHECK_BIT(val, bit)   (((val) & (bit)) > 0)
 
+#define IS_POWER_OF_TWO(x)  ((x) > 0 && ((x) & ((x) - 1)) == 0)
+
+// SIMD kernels are picked at compile time. SSE2 is baseline on every x64 target, AVX2 must be enabled in the build.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MILK_SSE2
+#endif
+
+#if defined(__AVX2__)
+#define MILK_AVX2
+#endif
+
 #endif
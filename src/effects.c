@@ -0,0 +1,555 @@
+#include <limits.h>
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+#include "effects.h"
+
+#if defined(MILK_SSE2)
+#include <emmintrin.h>
+#endif
+
+/**
+ * The effect bus is a small fixed chain that voices and streams are routed through by their send: a low-pass biquad,
+ * an echo and a reverb, run in that order, each an insert that can be switched off. The whole chunk goes through
+ * each effect in turn, in float. What the chain costs depends only on the chunk's length, never on how many voices
+ * feed it, and it isn't run at all once its input has been silent for longer than its tail.
+ *
+ * As in the mixer, the scalar kernels are the reference. The SIMD kernels do the same float operations in the same order.
+ */
+
+#define PI_F 3.14159265f
+#define MIN_CUTOFF 20.0f
+#define MAX_CUTOFF (EFFECT_FREQUENCY * 0.45f)
+#define MIN_RESONANCE 0.1f
+#define MAX_ECHO_FEEDBACK 0.95f
+#define REVERB_SPREAD 23
+#define REVERB_INPUT_GAIN 0.015f
+#define REVERB_OUTPUT_GAIN 6.0f
+#define REVERB_MIN_FEEDBACK 0.7f
+#define REVERB_FEEDBACK_RANGE 0.28f
+#define REVERB_MAX_DAMPING 0.4f
+#define ALLPASS_FEEDBACK 0.5f
+#define SILENCE_RATIO 65536.0f
+#define FLUSH_DENORMALS 0x8040
+
+// Comb and allpass lengths are Freeverb's, which were tuned by ear to avoid ringing. The right channel's are spread a little.
+static const int combLengths[REVERB_COMBS] = { 1116, 1188, 1277, 1356 };
+static const int allpassLengths[REVERB_ALLPASSES] = { 556, 441 };
+
+void useReferenceEffects(EffectBus *effects, bool enabled)
+{
+  effects->referenceKernels = enabled;
+}
+
+static void __clearEffects(EffectBus *effects)
+{
+  Reverb *reverb = &effects->reverb;
+
+  memset(effects->lowPass.z1, 0, sizeof(effects->lowPass.z1));
+  memset(effects->lowPass.z2, 0, sizeof(effects->lowPass.z2));
+  memset(effects->echo.line, 0, sizeof(effects->echo.line));
+  memset(reverb->damped, 0, sizeof(reverb->damped));
+
+  for (int channel = 0; channel < 2; channel++)
+  {
+    for (int i = 0; i < REVERB_COMBS; i++)
+      memset(reverb->combs[channel][i].buffer, 0, sizeof(reverb->combs[channel][i].buffer));
+    for (int i = 0; i < REVERB_ALLPASSES; i++)
+      memset(reverb->allpasses[channel][i].buffer, 0, sizeof(reverb->allpasses[channel][i].buffer));
+  }
+}
+
+// Frames until a loop of the given period, fed back at the given gain, has decayed by SILENCE_RATIO.
+static int __decayFrames(int period, float feedback)
+{
+  if (feedback <= 0.0f)
+    return period;
+
+  double loops = ceil(log(1.0 / SILENCE_RATIO) / log(feedback));
+  return (int)MIN((double)(INT_MAX / 2), period * (loops + 1.0));
+}
+
+static void __updateTail(EffectBus *effects)
+{
+  Reverb *reverb = &effects->reverb;
+  int tail = effects->lowPass.enabled ? EFFECT_MAX_FRAMES : 0;
+
+  if (effects->echo.enabled)
+    tail = MAX(tail, __decayFrames(effects->echo.frames, effects->echo.feedback));
+
+  if (reverb->enabled)
+    tail = MAX(tail, __decayFrames(reverb->combs[1][REVERB_COMBS - 1].length, reverb->feedback) + REVERB_LINE_SIZE * REVERB_ALLPASSES);
+
+  effects->tailFrames = tail;
+}
+
+void initializeEffects(EffectBus *effects)
+{
+  memset(effects, 0, sizeof(EffectBus));
+  effects->echo.frames = 1;
+
+  for (int channel = 0; channel < 2; channel++)
+  {
+    for (int i = 0; i < REVERB_COMBS; i++)
+      effects->reverb.combs[channel][i].length = combLengths[i] + channel * REVERB_SPREAD;
+    for (int i = 0; i < REVERB_ALLPASSES; i++)
+      effects->reverb.allpasses[channel][i].length = allpassLengths[i] + channel * REVERB_SPREAD;
+  }
+}
+
+// Coefficients from the Audio EQ Cookbook. A cutoff of zero or less switches the filter off.
+void setLowPass(EffectBus *effects, float cutoff, float resonance)
+{
+  Biquad *filter = &effects->lowPass;
+
+  if (cutoff <= 0.0f)
+    filter->enabled = false;
+  else
+  {
+    float omega = 2.0f * PI_F * CLAMP(cutoff, MIN_CUTOFF, MAX_CUTOFF) / EFFECT_FREQUENCY;
+    float alpha = sinf(omega) / (2.0f * MAX(resonance, MIN_RESONANCE));
+    float cosine = cosf(omega);
+    float a0 = 1.0f + alpha;
+
+    filter->b0 = (1.0f - cosine) * 0.5f / a0;
+    filter->b1 = (1.0f - cosine) / a0;
+    filter->b2 = filter->b0;
+    filter->a1 = -2.0f * cosine / a0;
+    filter->a2 = (1.0f - alpha) / a0;
+
+    if (!filter->enabled)
+    {
+      memset(filter->z1, 0, sizeof(filter->z1));
+      memset(filter->z2, 0, sizeof(filter->z2));
+    }
+    filter->enabled = true;
+  }
+  __updateTail(effects);
+}
+
+void setEcho(EffectBus *effects, float level, float seconds, float feedback)
+{
+  Echo *echo = &effects->echo;
+  int frames = (int)CLAMP(lrintf(seconds * EFFECT_FREQUENCY), 1, ECHO_MAX_FRAMES);
+
+  // Changing the delay would otherwise replay whatever was left in the line at the wrong time.
+  if (frames != echo->frames)
+  {
+    memset(echo->line, 0, sizeof(echo->line));
+    echo->frames = frames;
+    echo->position = 0;
+  }
+
+  echo->enabled = level > 0.0f;
+  echo->level = level;
+  echo->feedback = CLAMP(feedback, 0.0f, MAX_ECHO_FEEDBACK);
+  __updateTail(effects);
+}
+
+void setReverb(EffectBus *effects, float level, float roomSize, float damping)
+{
+  Reverb *reverb = &effects->reverb;
+
+  reverb->enabled = level > 0.0f;
+  reverb->level = level;
+  reverb->feedback = REVERB_MIN_FEEDBACK + REVERB_FEEDBACK_RANGE * CLAMP(roomSize, 0.0f, 1.0f);
+  reverb->damping = REVERB_MAX_DAMPING * CLAMP(damping, 0.0f, 1.0f);
+  __updateTail(effects);
+}
+
+static void __toFloat(float *dest, const int32_t *source, int numSamples, bool reference)
+{
+  int i = 0;
+
+#if defined(MILK_SSE2)
+  if (!reference)
+  {
+    for (; i + 4 <= numSamples; i += 4)
+      _mm_storeu_ps(dest + i, _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(source + i))));
+  }
+#else
+  UNUSED(reference);
+#endif
+
+  for (; i < numSamples; i++)
+    dest[i] = (float)source[i];
+}
+
+static void __addToBus(int32_t *bus, const float *source, int numSamples, bool reference)
+{
+  int i = 0;
+
+#if defined(MILK_SSE2)
+  if (!reference)
+  {
+    for (; i + 4 <= numSamples; i += 4)
+    {
+      __m128i samples = _mm_cvtps_epi32(_mm_loadu_ps(source + i));
+      _mm_storeu_si128((__m128i *)(bus + i), _mm_add_epi32(_mm_loadu_si128((__m128i *)(bus + i)), samples));
+    }
+  }
+#else
+  UNUSED(reference);
+#endif
+
+  for (; i < numSamples; i++)
+    bus[i] += (int32_t)lrintf(source[i]);
+}
+
+/**
+ * A biquad is recursive, so there's nothing to vectorize over time. Both channels go through it at once instead,
+ * as the two low lanes of a vector. Transposed direct form II.
+ */
+static void __lowPassScalar(Biquad *filter, float *samples, int numFrames)
+{
+  for (int i = 0; i < numFrames * 2; i++)
+  {
+    int channel = i & 1;
+    float input = samples[i];
+    float output = filter->b0 * input + filter->z1[channel];
+
+    filter->z1[channel] = filter->b1 * input - filter->a1 * output + filter->z2[channel];
+    filter->z2[channel] = filter->b2 * input - filter->a2 * output;
+    samples[i] = output;
+  }
+}
+
+#if defined(MILK_SSE2)
+
+static void __lowPassSimd(Biquad *filter, float *samples, int numFrames)
+{
+  __m128 b0 = _mm_set1_ps(filter->b0);
+  __m128 b1 = _mm_set1_ps(filter->b1);
+  __m128 b2 = _mm_set1_ps(filter->b2);
+  __m128 a1 = _mm_set1_ps(filter->a1);
+  __m128 a2 = _mm_set1_ps(filter->a2);
+  __m128 z1 = _mm_setr_ps(filter->z1[0], filter->z1[1], 0.0f, 0.0f);
+  __m128 z2 = _mm_setr_ps(filter->z2[0], filter->z2[1], 0.0f, 0.0f);
+
+  for (int i = 0; i < numFrames; i++)
+  {
+    __m128 input = _mm_castpd_ps(_mm_load_sd((const double *)(samples + i * 2)));
+    __m128 output = _mm_add_ps(_mm_mul_ps(b0, input), z1);
+
+    z1 = _mm_add_ps(_mm_sub_ps(_mm_mul_ps(b1, input), _mm_mul_ps(a1, output)), z2);
+    z2 = _mm_sub_ps(_mm_mul_ps(b2, input), _mm_mul_ps(a2, output));
+    _mm_store_sd((double *)(samples + i * 2), _mm_castps_pd(output));
+  }
+
+  float state[4];
+  _mm_storeu_ps(state, z1);
+  memcpy(filter->z1, state, sizeof(filter->z1));
+  _mm_storeu_ps(state, z2);
+  memcpy(filter->z2, state, sizeof(filter->z2));
+}
+
+#endif
+
+static void __applyLowPass(Biquad *filter, float *samples, int numFrames, bool reference)
+{
+#if defined(MILK_SSE2)
+  if (!reference)
+  {
+    __lowPassSimd(filter, samples, numFrames);
+    return;
+  }
+#else
+  UNUSED(reference);
+#endif
+
+  __lowPassScalar(filter, samples, numFrames);
+}
+
+/**
+ * Delay lines are read and written at the same position, one period apart, so within a stretch that doesn't wrap
+ * around the line every sample is independent of its neighbours and the SIMD kernels can take four at a time.
+ */
+
+static void __echoScalar(float *line, float *samples, int numSamples, float level, float feedback)
+{
+  for (int i = 0; i < numSamples; i++)
+  {
+    float delayed = line[i];
+    line[i] = samples[i] + feedback * delayed;
+    samples[i] = samples[i] + level * delayed;
+  }
+}
+
+static void __allpassScalar(float *line, float *samples, int numSamples)
+{
+  for (int i = 0; i < numSamples; i++)
+  {
+    float delayed = line[i];
+    float input = samples[i];
+    line[i] = input + delayed * ALLPASS_FEEDBACK;
+    samples[i] = delayed - input;
+  }
+}
+
+#if defined(MILK_SSE2)
+
+static int __echoSimd(float *line, float *samples, int numSamples, float level, float feedback)
+{
+  __m128 levels = _mm_set1_ps(level);
+  __m128 feedbacks = _mm_set1_ps(feedback);
+  int i = 0;
+
+  for (; i + 4 <= numSamples; i += 4)
+  {
+    __m128 delayed = _mm_loadu_ps(line + i);
+    __m128 input = _mm_loadu_ps(samples + i);
+    _mm_storeu_ps(line + i, _mm_add_ps(input, _mm_mul_ps(feedbacks, delayed)));
+    _mm_storeu_ps(samples + i, _mm_add_ps(input, _mm_mul_ps(levels, delayed)));
+  }
+  return i;
+}
+
+static int __allpassSimd(float *line, float *samples, int numSamples)
+{
+  __m128 feedbacks = _mm_set1_ps(ALLPASS_FEEDBACK);
+  int i = 0;
+
+  for (; i + 4 <= numSamples; i += 4)
+  {
+    __m128 delayed = _mm_loadu_ps(line + i);
+    __m128 input = _mm_loadu_ps(samples + i);
+    _mm_storeu_ps(line + i, _mm_add_ps(input, _mm_mul_ps(delayed, feedbacks)));
+    _mm_storeu_ps(samples + i, _mm_sub_ps(delayed, input));
+  }
+  return i;
+}
+
+#else
+
+static int __echoSimd(float *line, float *samples, int numSamples, float level, float feedback)
+{
+  UNUSED(line);
+  UNUSED(samples);
+  UNUSED(numSamples);
+  UNUSED(level);
+  UNUSED(feedback);
+  return 0;
+}
+
+static int __allpassSimd(float *line, float *samples, int numSamples)
+{
+  UNUSED(line);
+  UNUSED(samples);
+  UNUSED(numSamples);
+  return 0;
+}
+
+#endif
+
+static void __applyEcho(Echo *echo, float *samples, int numFrames, bool reference)
+{
+  while (numFrames > 0)
+  {
+    int frames = MIN(numFrames, echo->frames - echo->position);
+    float *line = echo->line + echo->position * 2;
+    int done = 0;
+
+    if (!reference)
+      done = __echoSimd(line, samples, frames * 2, echo->level, echo->feedback);
+    __echoScalar(line + done, samples + done, frames * 2 - done, echo->level, echo->feedback);
+
+    echo->position = (echo->position + frames) % echo->frames;
+    samples += frames * 2;
+    numFrames -= frames;
+  }
+}
+
+static void __applyAllpass(ReverbLine *allpass, float *samples, int numFrames, bool reference)
+{
+  while (numFrames > 0)
+  {
+    int frames = MIN(numFrames, allpass->length - allpass->position);
+    float *line = allpass->buffer + allpass->position;
+    int done = 0;
+
+    if (!reference)
+      done = __allpassSimd(line, samples, frames);
+    __allpassScalar(line + done, samples + done, frames - done);
+
+    allpass->position = (allpass->position + frames) % allpass->length;
+    samples += frames;
+    numFrames -= frames;
+  }
+}
+
+/**
+ * The reverb is a reduced Freeverb: a mono mix of the input feeds four damped combs per channel in parallel,
+ * then two allpasses in series. The combs' damping is recursive, so the SIMD kernel runs the four combs of a channel
+ * side by side in one vector rather than stepping through time.
+ */
+static void __reverbCombsScalar(Reverb *reverb, const float *samples, float (*wet)[EFFECT_MAX_FRAMES], int numFrames)
+{
+  for (int i = 0; i < numFrames; i++)
+  {
+    float input = (samples[i * 2] + samples[i * 2 + 1]) * REVERB_INPUT_GAIN;
+
+    for (int channel = 0; channel < 2; channel++)
+    {
+      float output[REVERB_COMBS];
+
+      for (int j = 0; j < REVERB_COMBS; j++)
+      {
+        ReverbLine *comb = &reverb->combs[channel][j];
+        float *damped = &reverb->damped[channel][j];
+
+        output[j] = comb->buffer[comb->position];
+        *damped = output[j] * (1.0f - reverb->damping) + *damped * reverb->damping;
+        comb->buffer[comb->position] = input + *damped * reverb->feedback;
+
+        if (++comb->position == comb->length)
+          comb->position = 0;
+      }
+      wet[channel][i] = (output[0] + output[2]) + (output[1] + output[3]);
+    }
+  }
+}
+
+#if defined(MILK_SSE2)
+
+static void __reverbCombsSimd(Reverb *reverb, const float *samples, float (*wet)[EFFECT_MAX_FRAMES], int numFrames)
+{
+  __m128 undamped = _mm_set1_ps(1.0f - reverb->damping);
+  __m128 damping = _mm_set1_ps(reverb->damping);
+  __m128 feedback = _mm_set1_ps(reverb->feedback);
+  __m128 damped[2] = { _mm_loadu_ps(reverb->damped[0]), _mm_loadu_ps(reverb->damped[1]) };
+
+  for (int i = 0; i < numFrames; i++)
+  {
+    __m128 input = _mm_set1_ps((samples[i * 2] + samples[i * 2 + 1]) * REVERB_INPUT_GAIN);
+
+    for (int channel = 0; channel < 2; channel++)
+    {
+      ReverbLine *combs = reverb->combs[channel];
+      float stored[REVERB_COMBS];
+      __m128 output = _mm_setr_ps(combs[0].buffer[combs[0].position], combs[1].buffer[combs[1].position],
+        combs[2].buffer[combs[2].position], combs[3].buffer[combs[3].position]);
+
+      damped[channel] = _mm_add_ps(_mm_mul_ps(output, undamped), _mm_mul_ps(damped[channel], damping));
+      _mm_storeu_ps(stored, _mm_add_ps(input, _mm_mul_ps(damped[channel], feedback)));
+
+      for (int j = 0; j < REVERB_COMBS; j++)
+      {
+        combs[j].buffer[combs[j].position] = stored[j];
+        if (++combs[j].position == combs[j].length)
+          combs[j].position = 0;
+      }
+
+      __m128 pairs = _mm_add_ps(output, _mm_movehl_ps(output, output));
+      wet[channel][i] = _mm_cvtss_f32(_mm_add_ss(pairs, _mm_shuffle_ps(pairs, pairs, _MM_SHUFFLE(1, 1, 1, 1))));
+    }
+  }
+
+  _mm_storeu_ps(reverb->damped[0], damped[0]);
+  _mm_storeu_ps(reverb->damped[1], damped[1]);
+}
+
+#endif
+
+static void __applyReverb(Reverb *reverb, float *samples, float (*wet)[EFFECT_MAX_FRAMES], int numFrames, bool reference)
+{
+  float gain = reverb->level * REVERB_OUTPUT_GAIN;
+  int i = 0;
+
+#if defined(MILK_SSE2)
+  if (!reference)
+    __reverbCombsSimd(reverb, samples, wet, numFrames);
+  else
+    __reverbCombsScalar(reverb, samples, wet, numFrames);
+#else
+  __reverbCombsScalar(reverb, samples, wet, numFrames);
+#endif
+
+  for (int channel = 0; channel < 2; channel++)
+  {
+    for (int j = 0; j < REVERB_ALLPASSES; j++)
+      __applyAllpass(&reverb->allpasses[channel][j], wet[channel], numFrames, reference);
+  }
+
+#if defined(MILK_SSE2)
+  if (!reference)
+  {
+    __m128 gains = _mm_set1_ps(gain);
+
+    for (; i + 4 <= numFrames; i += 4)
+    {
+      __m128 left = _mm_loadu_ps(wet[0] + i);
+      __m128 right = _mm_loadu_ps(wet[1] + i);
+      float *frames = samples + i * 2;
+
+      _mm_storeu_ps(frames, _mm_add_ps(_mm_loadu_ps(frames), _mm_mul_ps(gains, _mm_unpacklo_ps(left, right))));
+      _mm_storeu_ps(frames + 4, _mm_add_ps(_mm_loadu_ps(frames + 4), _mm_mul_ps(gains, _mm_unpackhi_ps(left, right))));
+    }
+  }
+#endif
+
+  for (; i < numFrames; i++)
+  {
+    samples[i * 2] = samples[i * 2] + gain * wet[0][i];
+    samples[i * 2 + 1] = samples[i * 2 + 1] + gain * wet[1][i];
+  }
+}
+
+/**
+ * Runs the chain over what was sent this chunk, and adds the result to the bus. Pass NULL when nothing was sent,
+ * so a ringing tail still plays out. Denormals are flushed while the chain runs: decaying tails are full of them,
+ * and they are very slow on x86.
+ */
+void processEffects(EffectBus *effects, const int32_t *send, int32_t *bus, int numFrames)
+{
+  int numSamples = numFrames * 2;
+  bool active = effects->lowPass.enabled || effects->echo.enabled || effects->reverb.enabled;
+
+  if (send)
+    effects->silentFrames = 0;
+  else if (effects->silentFrames <= effects->tailFrames)
+    effects->silentFrames += numFrames;
+
+  // Once the tail has died away, what's left in the lines is inaudible. Clear it so a later sound doesn't bring it back.
+  if (effects->silentFrames > effects->tailFrames)
+  {
+    if (effects->silentFrames - numFrames <= effects->tailFrames)
+    {
+      __clearEffects(effects);
+      effects->silentFrames = INT_MAX;
+    }
+    return;
+  }
+
+  if (!active)
+  {
+    for (int i = 0; i < numSamples; i++)
+      bus[i] += send[i];
+    return;
+  }
+
+#if defined(MILK_SSE2)
+  unsigned int control = _mm_getcsr();
+  _mm_setcsr(control | FLUSH_DENORMALS);
+#endif
+
+  if (send)
+    __toFloat(effects->samples, send, numSamples, effects->referenceKernels);
+  else
+    memset(effects->samples, 0, numSamples * sizeof(float));
+
+  if (effects->lowPass.enabled)
+    __applyLowPass(&effects->lowPass, effects->samples, numFrames, effects->referenceKernels);
+
+  if (effects->echo.enabled)
+    __applyEcho(&effects->echo, effects->samples, numFrames, effects->referenceKernels);
+
+  if (effects->reverb.enabled)
+    __applyReverb(&effects->reverb, effects->samples, effects->wet, numFrames, effects->referenceKernels);
+
+  __addToBus(bus, effects->samples, numSamples, effects->referenceKernels);
+
+#if defined(MILK_SSE2)
+  _mm_setcsr(control);
+#endif
+}
@@ -0,0 +1,69 @@
+#ifndef __EFFECTS_H__
+#define __EFFECTS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define EFFECT_FREQUENCY 44100
+#define EFFECT_MAX_FRAMES 4096
+#define ECHO_MAX_FRAMES EFFECT_FREQUENCY
+#define REVERB_COMBS 4
+#define REVERB_ALLPASSES 2
+#define REVERB_LINE_SIZE 1400
+
+typedef struct
+{
+  bool enabled;
+  float b0, b1, b2, a1, a2;
+  float z1[2];
+  float z2[2];
+} Biquad;
+
+typedef struct
+{
+  bool enabled;
+  float level;
+  float feedback;
+  int frames;
+  int position;
+  float line[ECHO_MAX_FRAMES * 2];
+} Echo;
+
+typedef struct
+{
+  float buffer[REVERB_LINE_SIZE];
+  int length;
+  int position;
+} ReverbLine;
+
+typedef struct
+{
+  bool enabled;
+  float level;
+  float feedback;
+  float damping;
+  float damped[2][REVERB_COMBS];
+  ReverbLine combs[2][REVERB_COMBS];
+  ReverbLine allpasses[2][REVERB_ALLPASSES];
+} Reverb;
+
+typedef struct
+{
+  Biquad lowPass;
+  Echo echo;
+  Reverb reverb;
+  int tailFrames;   // How long the chain keeps ringing after its input goes silent.
+  int silentFrames;
+  bool referenceKernels;  // Runs the scalar kernels only.
+  float samples[EFFECT_MAX_FRAMES * 2];
+  float wet[2][EFFECT_MAX_FRAMES];
+} EffectBus;
+
+void initializeEffects(EffectBus *effects);
+void setLowPass(EffectBus *effects, float cutoff, float resonance);
+void setEcho(EffectBus *effects, float level, float seconds, float feedback);
+void setReverb(EffectBus *effects, float level, float roomSize, float damping);
+void processEffects(EffectBus *effects, const int32_t *send, int32_t *bus, int numFrames);
+void useReferenceEffects(EffectBus *effects, bool enabled);
+
+#endif
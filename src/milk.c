@@ -1,8 +1,13 @@
+#include <SDL_atomic.h>
+#include <SDL_thread.h>
+#include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "logs.h"
 #include "milk.h"
+#include "mixbench.h"
 #include "platform.h"
 
 #ifdef BUILD_WITH_CONSOLE
@@ -29,13 +34,13 @@ static void __toggleConsole(Milk *milk)
 		{
 			__resetCandidate(console);
 			pauseSound(&modules->audio, -1);
-			pauseStream(&modules->audio);
+			pauseStream(&modules->audio, -1);
 			platform_startTextInput();
 		}
 		else
 		{
 			resumeSound(&modules->audio, -1);
-			resumeStream(&modules->audio);
+			resumeStream(&modules->audio, -1);
 			platform_stopTextInput();
 		}
 	}
@@ -69,6 +74,127 @@ static void __cmdQuit(Milk *milk)
 	platform_close();
 }
 
+static void __cmdAudioStats(Milk *milk)
+{
+	AudioStats stats;
+	getAudioStats(&milk->modules.audio, &stats);
+	snprintf(milk->console.message, MESSAGE_MAX_LENGTH,
+		"%dhz, %d frame buffer. %d callbacks, %d underruns. callback last %dus, avg %dus, max %dus.",
+		stats.frequency, stats.bufferFrames, stats.callbacks, stats.underruns,
+		stats.lastCallbackMicros, stats.averageCallbackMicros, stats.maxCallbackMicros);
+}
+
+// Percentiles rather than averages, since what matters is the callbacks that ran long. Times are in microseconds.
+static void __cmdAudioHistograms(Milk *milk)
+{
+	AudioStats stats;
+	getAudioStats(&milk->modules.audio, &stats);
+	snprintf(milk->console.message, MESSAGE_MAX_LENGTH,
+		"callback p50 %d p99 %d. voices p99 %d. stream p99 %dB, %d starved. lock p99 %d. latency p50 %d p99 %d.",
+		stats.callback.p50, stats.callback.p99, stats.voices.p99, stats.streamBytes.p99, stats.streamStarves,
+		stats.lockWait.p99, stats.playLatency.p50, stats.playLatency.p99);
+}
+
+#define CONSOLE_BENCH_SECONDS 1
+#define CONSOLE_BENCH_WAVES 2
+
+/**
+ * A short run of the offline mixer benchmark. It renders several seconds of audio, so it runs on a thread of its own
+ * to keep the frame going, and in a mixer of its own so the game's audio carries on. That mixer is offline and shares
+ * nothing with the game's but constant tables, so the two never lock against each other.
+ */
+typedef struct MixBenchRun
+{
+	Audio audio;
+	Wave *waves[CONSOLE_BENCH_WAVES];
+	MixResult results[MIX_BENCH_MAX_RESULTS];
+	int numResults;
+	SDL_Thread *thread;
+	SDL_atomic_t isDone;
+} MixBenchRun;
+
+static int __runMixBench(void *data)
+{
+	MixBenchRun *run = data;
+	run->numResults = benchmarkMixer(&run->audio, run->waves, CONSOLE_BENCH_WAVES, CONSOLE_BENCH_SECONDS, run->results);
+	SDL_AtomicSet(&run->isDone, 1);
+	return 0;
+}
+
+static void __freeMixBench(MixBenchRun *run)
+{
+	for (int i = 0; i < CONSOLE_BENCH_WAVES; i++)
+	{
+		if (run->waves[i])
+			freeWave(run->waves[i]);
+	}
+	free(run);
+}
+
+static void __cmdMixBench(Milk *milk)
+{
+	Console *console = &milk->console;
+
+	if (console->mixBench)
+	{
+		snprintf(console->message, MESSAGE_MAX_LENGTH, "The mixer benchmark is already running.");
+		return;
+	}
+
+	MixBenchRun *run = calloc(1, sizeof(MixBenchRun));
+
+	if (run)
+	{
+		run->waves[0] = createBenchWave(1, AUDIO_FREQUENCY * 2);
+		run->waves[1] = createBenchWave(2, AUDIO_FREQUENCY);
+	}
+
+	if (run && run->waves[0] && run->waves[1])
+		run->thread = SDL_CreateThread(__runMixBench, "milk mix bench", run);
+
+	if (!run || !run->thread)
+	{
+		snprintf(console->message, MESSAGE_MAX_LENGTH, "Could not start the mixer benchmark.");
+		if (run)
+			__freeMixBench(run);
+		return;
+	}
+
+	console->mixBench = run;
+	snprintf(console->message, MESSAGE_MAX_LENGTH, "Running the mixer benchmark...");
+}
+
+// Called every frame. Once the benchmark is done, its results replace whatever the console was showing.
+static void __collectMixBench(Milk *milk)
+{
+	Console *console = &milk->console;
+	MixBenchRun *run = console->mixBench;
+
+	if (!run || !SDL_AtomicGet(&run->isDone))
+		return;
+
+	char *message = console->message;
+	bool matches = true;
+	int length = 0;
+
+	SDL_WaitThread(run->thread, NULL);
+
+	for (int i = 0; i < run->numResults; i++)
+	{
+		length += snprintf(message + length, MESSAGE_MAX_LENGTH - length, "%dv %.1fM ", run->results[i].voices, run->results[i].samplesPerSecond / 1000000.0);
+		length = MIN(length, MESSAGE_MAX_LENGTH - 1);
+		matches &= run->results[i].matchesReference;
+	}
+
+	if (run->numResults > 0)
+		snprintf(message + length, MESSAGE_MAX_LENGTH - length, matches ? "samples/s, matches reference." : "samples/s, reference MISMATCH.");
+	else
+		snprintf(message, MESSAGE_MAX_LENGTH, "Not enough memory to run the mixer benchmark.");
+
+	__freeMixBench(run);
+	console->mixBench = NULL;
+}
+
 typedef struct
 {
 	char *cmd;
@@ -80,6 +206,9 @@ static Command commands[] =
 	{"reload", __cmdReload},
 	{"fullscreen", __cmdFullscreen},
 	{"quit", __cmdQuit},
+	{"audiostats", __cmdAudioStats},
+	{"audiohist", __cmdAudioHistograms},
+	{"mixbench", __cmdMixBench},
 };
 
 static void __initializeConsole(Milk *milk)
@@ -89,6 +218,11 @@ static void __initializeConsole(Milk *milk)
 
 static void __disableConsole(Milk *milk)
 {
+	if (milk->console.mixBench)
+	{
+		SDL_WaitThread(milk->console.mixBench->thread, NULL);
+		__freeMixBench(milk->console.mixBench);
+	}
 	memset(&milk->console, 0, sizeof(milk->console));
 }
 
@@ -96,6 +230,7 @@ static void __executeCommand(Milk *milk)
 {
 	int numCommands = sizeof(commands) / sizeof(Command);
 
+	milk->console.message[0] = '\0';
 	while (numCommands--)
 	{
 		if (strcmp(milk->console.candidate, commands[numCommands].cmd) == 0)
@@ -155,6 +290,12 @@ static void __drawConsole(Milk *milk)
 		__drawPanel(video, "ERROR", 0, CONSOLE_Y - 79, FRAMEBUFFER_WIDTH, 80);
 		drawWrappedFont(video, NULL, 5, CONSOLE_Y - 79 + 20, FRAMEBUFFER_WIDTH - 10, getError(), 1, 0xffbf4040);
 	}
+	// Output panel
+	else if (console->message[0] != '\0')
+	{
+		__drawPanel(video, "OUTPUT", 0, CONSOLE_Y - 49, FRAMEBUFFER_WIDTH, 50);
+		drawWrappedFont(video, NULL, 5, CONSOLE_Y - 49 + 20, FRAMEBUFFER_WIDTH - 10, console->message, 1, 0xffffff);
+	}
 
 	// Console panel
 	__drawPanel(video, "TERMINAL", 0, CONSOLE_Y, FRAMEBUFFER_WIDTH, FRAMEBUFFER_HEIGHT - CONSOLE_Y);
@@ -205,6 +346,7 @@ void initializeMilk(Milk *milk)
 void updateMilk(Milk *milk)
 {
 #ifdef BUILD_WITH_CONSOLE
+	__collectMixBench(milk);
 	if (hasError() && !milk->console.isEnabled)
 		__toggleConsole(milk);
 	if (isKeyPressed(&milk->modules.input, KEY_ESCAPE))
@@ -10,12 +10,15 @@ typedef struct
 
 #ifdef BUILD_WITH_CONSOLE
 #define COMMAND_MAX_LENGTH 36
+#define MESSAGE_MAX_LENGTH 128
 	struct Console
 	{
 		char candidate[COMMAND_MAX_LENGTH];
+		char message[MESSAGE_MAX_LENGTH];
 		int candidateLength;
 		int ticks;
 		bool isEnabled;
+		struct MixBenchRun *mixBench;	// Running on a thread of its own until it's collected.
 	} console;
 #endif
 } Milk;
@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "mixbench.h"
+#include "platform.h"
+
+/**
+ * Drives the mixer offline, with no audio device: a script of play and stop events is applied at exact frames, and
+ * the output is rendered as fast as the mixer can go. The same script always renders the same samples, so the
+ * checksum of a render is a bit-exact regression check, and rendering it again with the reference kernels checks
+ * the SIMD ones.
+ *
+ * Scripts are generated from a seed rather than recorded, so a benchmark only needs its voice count, its length and
+ * its seed to be reproduced.
+ */
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define RENDER_FRAMES 1024
+#define WAVE_HEADER_SIZE 44
+#define MIN_NOTE_FRAMES (AUDIO_FREQUENCY / 8)
+#define MAX_NOTE_FRAMES AUDIO_FREQUENCY
+#define BENCH_SEED 0x6d696c6b
+
+static const float pitches[] = { 0.5f, 0.75f, 1.0f, 1.0f, 1.25f, 1.5f, 2.0f };
+static const int voiceCounts[] = { 1, 2, 4, 8, 16, 32, MAX_SOUND_SLOTS };
+
+static int16_t renderBuffer[RENDER_FRAMES * AUDIO_OUTPUT_CHANNELS];
+
+static unsigned __nextRandom(unsigned *seed)
+{
+  *seed = *seed * 1664525u + 1013904223u;
+  return *seed >> 8;
+}
+
+/**
+ * Bench waves are made up rather than loaded, so a benchmark needs no files: a decaying saw with some noise on it,
+ * loud enough that the limiter has work to do once a few voices are stacked.
+ */
+Wave *createBenchWave(int channels, int numFrames)
+{
+  Wave *wave = calloc(1, sizeof(Wave));
+  int16_t *samples = malloc(sizeof(int16_t) * numFrames * channels);
+
+  if (!wave || !samples)
+  {
+    free(wave);
+    free(samples);
+    return NULL;
+  }
+
+  unsigned seed = (unsigned)channels;
+
+  for (int frame = 0; frame < numFrames; frame++)
+  {
+    int envelope = 32767 - (int)((int64_t)frame * 32767 / numFrames);
+
+    for (int channel = 0; channel < channels; channel++)
+    {
+      int saw = (int)((frame * (220 + channel * 3) * 65536LL / AUDIO_FREQUENCY) & 0xffff) - 32768;
+      int noise = (int)(__nextRandom(&seed) & 0x1fff) - 0x1000;
+      samples[frame * channels + channel] = (int16_t)(((saw + noise) * envelope) >> 16);
+    }
+  }
+
+  wave->samples      = samples;
+  wave->channelCount = channels;
+  wave->sampleCount  = numFrames * channels;
+  wave->sampleRate   = AUDIO_FREQUENCY;
+  return wave;
+}
+
+static void __addEvent(MixScript *script, const MixEvent *event)
+{
+  if (script->numEvents < MIX_SCRIPT_MAX_EVENTS)
+    script->events[script->numEvents++] = *event;
+}
+
+/**
+ * Keeps the given number of voices busy for the length of the script. Each one retriggers with a new wave, pitch,
+ * volume, pan and send every so often, and now and then is stopped for a while first. Events come out in frame order.
+ */
+void buildMixScript(MixScript *script, Wave **waves, int numWaves, int voices, int numFrames, unsigned seed)
+{
+  int nextFrames[MAX_SOUND_SLOTS];
+
+  voices = CLAMP(voices, 1, MAX_SOUND_SLOTS);
+  script->numFrames = numFrames;
+  script->reverb    = true;
+  script->numEvents = 0;
+
+  for (int i = 0; i < voices; i++)
+    nextFrames[i] = i * 37;
+
+  for (;;)
+  {
+    int voice = 0;
+
+    for (int i = 1; i < voices; i++)
+    {
+      if (nextFrames[i] < nextFrames[voice])
+        voice = i;
+    }
+
+    if (nextFrames[voice] >= numFrames || script->numEvents == MIX_SCRIPT_MAX_EVENTS)
+      break;
+
+    MixEvent event = { .frame = nextFrames[voice], .slotId = voice };
+    unsigned random = __nextRandom(&seed);
+
+    if (random % 8 == 0)
+    {
+      event.type = MIX_EVENT_STOP;
+      __addEvent(script, &event);
+      nextFrames[voice] += MIN_NOTE_FRAMES;
+      continue;
+    }
+
+    event.type   = MIX_EVENT_PLAY;
+    event.wave   = waves[random % numWaves];
+    event.volume = 32 + (int)(__nextRandom(&seed) % (MAX_VOLUME - 31));
+    event.pitch  = pitches[__nextRandom(&seed) % (sizeof(pitches) / sizeof(float))];
+    event.pan    = (int)(__nextRandom(&seed) % (MAX_PAN * 2 + 1)) - MAX_PAN;
+    event.send   = (random >> 4) % 4 == 0 ? MAX_SEND / 4 : 0;
+    __addEvent(script, &event);
+    nextFrames[voice] += MIN_NOTE_FRAMES + (int)(__nextRandom(&seed) % (MAX_NOTE_FRAMES - MIN_NOTE_FRAMES));
+  }
+}
+
+static void __applyEvent(Audio *audio, const MixEvent *event)
+{
+  switch (event->type)
+  {
+    case MIX_EVENT_PLAY:
+      playSound(audio, event->wave, event->slotId, event->volume, event->pitch, 0);
+      setSoundPan(audio, event->slotId, event->pan);
+      setSoundSend(audio, event->slotId, event->send);
+      break;
+    case MIX_EVENT_STOP:
+      stopSound(audio, event->slotId);
+      break;
+  }
+}
+
+static void __writeLittleEndian(FILE *file, uint32_t value, int size)
+{
+  for (int i = 0; i < size; i++)
+    fputc((int)((value >> (i * 8)) & 0xff), file);
+}
+
+static void __writeWaveHeader(FILE *file, int numFrames)
+{
+  uint32_t dataSize = (uint32_t)numFrames * AUDIO_OUTPUT_CHANNELS * sizeof(int16_t);
+
+  fwrite("RIFF", 1, 4, file);
+  __writeLittleEndian(file, WAVE_HEADER_SIZE - 8 + dataSize, 4);
+  fwrite("WAVEfmt ", 1, 8, file);
+  __writeLittleEndian(file, 16, 4);
+  __writeLittleEndian(file, 1, 2);
+  __writeLittleEndian(file, AUDIO_OUTPUT_CHANNELS, 2);
+  __writeLittleEndian(file, AUDIO_FREQUENCY, 4);
+  __writeLittleEndian(file, AUDIO_FREQUENCY * AUDIO_OUTPUT_CHANNELS * sizeof(int16_t), 4);
+  __writeLittleEndian(file, AUDIO_OUTPUT_CHANNELS * sizeof(int16_t), 2);
+  __writeLittleEndian(file, AUDIO_BITS_PER_SAMPLE, 2);
+  fwrite("data", 1, 4, file);
+  __writeLittleEndian(file, dataSize, 4);
+}
+
+static void __writeSamples(FILE *file, const int16_t *samples, int numSamples)
+{
+  for (int i = 0; i < numSamples; i++)
+    __writeLittleEndian(file, (uint16_t)samples[i], 2);
+}
+
+/**
+ * Renders the whole script into a freshly initialized mixer, splitting chunks at events so each one lands on its frame.
+ * Only the mixing is timed, in wall time: clock() would also count whatever the process's other threads are doing.
+ * The mixer is marked offline, so it's never locked against a device. When a file is given, the output is also
+ * written to it as a 16 bit stereo WAV.
+ */
+void renderMixScript(Audio *audio, const MixScript *script, bool reference, FILE *file, MixResult *result)
+{
+  unsigned checksum = FNV_OFFSET;
+  int64_t elapsed = 0;
+  int next = 0;
+
+  initializeAudio(audio);
+  audio->offline = true;
+  useReferenceMixing(audio, reference);
+
+  if (script->reverb)
+    setReverbEffect(audio, MAX_VOLUME / 2, 0.5f, 0.5f);
+
+  if (file)
+    __writeWaveHeader(file, script->numFrames);
+
+  for (int frame = 0; frame < script->numFrames;)
+  {
+    while (next < script->numEvents && script->events[next].frame <= frame)
+      __applyEvent(audio, &script->events[next++]);
+
+    int numFrames = MIN(script->numFrames - frame, RENDER_FRAMES);
+
+    if (next < script->numEvents)
+      numFrames = MIN(numFrames, script->events[next].frame - frame);
+
+    int numSamples = numFrames * AUDIO_OUTPUT_CHANNELS;
+    int64_t start = platform_getMicros();
+    mixSamplesIntoStream(audio, renderBuffer, numSamples);
+    elapsed += platform_getMicros() - start;
+
+    for (int i = 0; i < numSamples; i++)
+    {
+      checksum ^= (uint16_t)renderBuffer[i];
+      checksum *= FNV_PRIME;
+    }
+
+    if (file)
+      __writeSamples(file, renderBuffer, numSamples);
+
+    frame += numFrames;
+  }
+
+  result->frames           = script->numFrames;
+  result->checksum         = checksum;
+  result->seconds          = elapsed / 1000000.0;
+  result->samplesPerSecond = result->seconds > 0.0 ? result->frames * AUDIO_OUTPUT_CHANNELS / result->seconds : 0.0;
+}
+
+/**
+ * Renders the same length of audio with more and more voices, from one up to every sound slot. Each render is checked
+ * against the reference kernels. Returns the number of results.
+ */
+int benchmarkMixer(Audio *audio, Wave **waves, int numWaves, int seconds, MixResult *results)
+{
+  MixScript *script = malloc(sizeof(MixScript));
+  int numResults = sizeof(voiceCounts) / sizeof(int);
+
+  if (!script)
+    return 0;
+
+  for (int i = 0; i < numResults; i++)
+  {
+    MixResult reference;
+
+    buildMixScript(script, waves, numWaves, voiceCounts[i], seconds * AUDIO_FREQUENCY, BENCH_SEED);
+    renderMixScript(audio, script, false, NULL, &results[i]);
+    renderMixScript(audio, script, true, NULL, &reference);
+    results[i].voices = voiceCounts[i];
+    results[i].matchesReference = results[i].checksum == reference.checksum;
+  }
+
+  free(script);
+  return numResults;
+}
@@ -0,0 +1,53 @@
+#ifndef __MIXBENCH_H__
+#define __MIXBENCH_H__
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "audio.h"
+
+#define MIX_SCRIPT_MAX_EVENTS 16384
+#define MIX_BENCH_MAX_RESULTS 8
+
+typedef enum
+{
+  MIX_EVENT_PLAY,
+  MIX_EVENT_STOP
+} MixEventType;
+
+typedef struct
+{
+  int frame;
+  MixEventType type;
+  int slotId;
+  Wave *wave;
+  int volume;
+  float pitch;
+  int pan;
+  int send;
+} MixEvent;
+
+typedef struct
+{
+  int numFrames;
+  bool reverb;
+  int numEvents;
+  MixEvent events[MIX_SCRIPT_MAX_EVENTS];
+} MixScript;
+
+typedef struct
+{
+  int voices;
+  int frames;
+  unsigned checksum;
+  double seconds;
+  double samplesPerSecond;
+  bool matchesReference;
+} MixResult;
+
+Wave *createBenchWave(int channels, int numFrames);
+void buildMixScript(MixScript *script, Wave **waves, int numWaves, int voices, int numFrames, unsigned seed);
+void renderMixScript(Audio *audio, const MixScript *script, bool reference, FILE *file, MixResult *result);
+int benchmarkMixer(Audio *audio, Wave **waves, int numWaves, int seconds, MixResult *results);
+
+#endif
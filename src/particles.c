@@ -0,0 +1,201 @@
+#include <math.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "particles.h"
+
+/**
+ * Emitters keep their particles in C, one array per component, so Lua only ever sets an emitter's parameters and
+ * never touches a particle. Each update is a handful of straight loops over one or two arrays at a time, with no
+ * branches, which compilers vectorize as they are. Dead particles are then swapped out with the last live one, so the
+ * live ones stay packed and nothing is allocated once the emitter exists.
+ */
+
+#define PARTICLE_ARRAYS 6
+#define DRAW_BATCH_SIZE 256
+#define PI_F 3.14159265f
+#define EMITTER_SEED 0x6d696c6b
+
+static float __nextRandom(unsigned *seed)
+{
+  *seed = *seed * 1664525u + 1013904223u;
+  return (float)(*seed >> 8) / 16777216.0f;
+}
+
+Emitter *createEmitter(int capacity)
+{
+  Emitter *emitter = calloc(1, sizeof(Emitter));
+  float *arrays = malloc(sizeof(float) * MAX(capacity, 1) * PARTICLE_ARRAYS);
+
+  if (!emitter || !arrays)
+  {
+    free(emitter);
+    free(arrays);
+    return NULL;
+  }
+
+  EmitterSettings *settings = &emitter->settings;
+  settings->angle         = -PI_F / 2;
+  settings->spread        = PI_F / 4;
+  settings->minSpeed      = 20.0f;
+  settings->maxSpeed      = 40.0f;
+  settings->minLife       = 1.0f;
+  settings->maxLife       = 1.0f;
+  settings->ramp[0]       = 0x00ffffff;
+  settings->numRampColors = 1;
+  settings->size          = 1;
+
+  emitter->capacity   = capacity;
+  emitter->seed       = EMITTER_SEED;
+  emitter->x          = arrays;
+  emitter->y          = arrays + capacity;
+  emitter->xVelocity  = arrays + capacity * 2;
+  emitter->yVelocity  = arrays + capacity * 3;
+  emitter->age        = arrays + capacity * 4;
+  emitter->life       = arrays + capacity * 5;
+  return emitter;
+}
+
+void freeEmitter(Emitter *emitter)
+{
+  free(emitter->x);
+  free(emitter);
+}
+
+// Spawns particles at the emitter, as many as there's room for.
+void emitParticles(Emitter *emitter, int count)
+{
+  EmitterSettings *settings = &emitter->settings;
+  count = MIN(count, emitter->capacity - emitter->numParticles);
+
+  for (int n = 0; n < count; n++)
+  {
+    int i = emitter->numParticles++;
+    float angle = settings->angle + (__nextRandom(&emitter->seed) - 0.5f) * settings->spread;
+    float speed = settings->minSpeed + (settings->maxSpeed - settings->minSpeed) * __nextRandom(&emitter->seed);
+
+    emitter->x[i]         = settings->x;
+    emitter->y[i]         = settings->y;
+    emitter->xVelocity[i] = cosf(angle) * speed;
+    emitter->yVelocity[i] = sinf(angle) * speed;
+    emitter->age[i]       = 0.0f;
+    emitter->life[i]      = settings->minLife + (settings->maxLife - settings->minLife) * __nextRandom(&emitter->seed);
+  }
+}
+
+static void __accelerate(float *velocities, int count, float change)
+{
+  for (int i = 0; i < count; i++)
+    velocities[i] += change;
+}
+
+static void __move(float *positions, const float *velocities, int count, float seconds)
+{
+  for (int i = 0; i < count; i++)
+    positions[i] += velocities[i] * seconds;
+}
+
+static void __removeDead(Emitter *emitter)
+{
+  int count = emitter->numParticles;
+
+  for (int i = 0; i < count;)
+  {
+    if (emitter->age[i] < emitter->life[i])
+    {
+      i++;
+      continue;
+    }
+
+    count--;
+    emitter->x[i]         = emitter->x[count];
+    emitter->y[i]         = emitter->y[count];
+    emitter->xVelocity[i] = emitter->xVelocity[count];
+    emitter->yVelocity[i] = emitter->yVelocity[count];
+    emitter->age[i]       = emitter->age[count];
+    emitter->life[i]      = emitter->life[count];
+  }
+  emitter->numParticles = count;
+}
+
+/**
+ * Moves every particle on by the given time, retires the ones that have outlived their lifetime, then spawns however
+ * many the rate has built up to. Fractions of a particle carry over to the next update.
+ */
+void updateEmitter(Emitter *emitter, float seconds)
+{
+  EmitterSettings *settings = &emitter->settings;
+  int count = emitter->numParticles;
+
+  __accelerate(emitter->xVelocity, count, settings->gravityX * seconds);
+  __accelerate(emitter->yVelocity, count, settings->gravityY * seconds);
+  __move(emitter->x, emitter->xVelocity, count, seconds);
+  __move(emitter->y, emitter->yVelocity, count, seconds);
+  __accelerate(emitter->age, count, seconds);
+  __removeDead(emitter);
+
+  emitter->spawnDebt += MAX(settings->rate, 0.0f) * seconds;
+  int spawned = (int)emitter->spawnDebt;
+  emitter->spawnDebt -= spawned;
+  emitParticles(emitter, spawned);
+}
+
+// Particles step through the ramp evenly over their lifetime, from the first color to the last.
+static uint32_t __rampColor(const EmitterSettings *settings, float age, float life)
+{
+  int step = life > 0.0f ? (int)(age / life * settings->numRampColors) : 0;
+  return settings->ramp[CLAMP(step, 0, settings->numRampColors - 1)];
+}
+
+/**
+ * Particles are drawn centered on their position: as the emitter's sprite, tinted with the ramp, if it has one, or
+ * else as squares of the ramp color, made opaque. The default ramp is white with no alpha, so sprites are drawn as
+ * they are and squares in white. Sprites go through the batched sprite path.
+ */
+void drawEmitter(Emitter *emitter, Video *video)
+{
+  EmitterSettings *settings = &emitter->settings;
+
+  if (!settings->sprite)
+  {
+    int offset = settings->size / 2;
+
+    for (int i = 0; i < emitter->numParticles; i++)
+    {
+      int x = (int)FLOOR(emitter->x[i]) - offset;
+      int y = (int)FLOOR(emitter->y[i]) - offset;
+      uint32_t color = __rampColor(settings, emitter->age[i], emitter->life[i]) | 0xff000000;
+
+      if (settings->size == 1)
+        drawPixel(video, x, y, color);
+      else
+        drawFilledRect(video, x, y, settings->size, settings->size, color);
+    }
+    return;
+  }
+
+  SpriteRecord batch[DRAW_BATCH_SIZE];
+
+  for (int start = 0; start < emitter->numParticles; start += DRAW_BATCH_SIZE)
+  {
+    int batchSize = MIN(emitter->numParticles - start, DRAW_BATCH_SIZE);
+
+    for (int n = 0; n < batchSize; n++)
+    {
+      int i = start + n;
+      batch[n].index  = settings->spriteIndex;
+      batch[n].x      = (int)FLOOR(emitter->x[i]) - SPRITE_SIZE / 2;
+      batch[n].y      = (int)FLOOR(emitter->y[i]) - SPRITE_SIZE / 2;
+      batch[n].flip   = 0;
+      batch[n].color  = __rampColor(settings, emitter->age[i], emitter->life[i]);
+    }
+
+    drawSprites(video, settings->sprite, batch, batchSize, 1, 1);
+  }
+}
+
+void clearEmitter(Emitter *emitter)
+{
+  emitter->numParticles = 0;
+  emitter->spawnDebt    = 0.0f;
+}
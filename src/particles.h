@@ -0,0 +1,61 @@
+#ifndef __PARTICLES_H__
+#define __PARTICLES_H__
+
+#include <stdint.h>
+
+#include "video.h"
+
+#define MAX_EMITTER_PARTICLES 16384
+#define MAX_RAMP_COLORS 16
+
+/**
+ * What every new particle starts from. Speeds are in pixels per second, gravity in pixels per second squared,
+ * lifetimes in seconds and angles in radians. Each particle picks its own speed, lifetime and direction from the ranges.
+ * The ramp holds tints: their alpha is how strongly a sprite is tinted, and squares ignore it and are drawn opaque.
+ */
+typedef struct
+{
+  float x;
+  float y;
+  float rate;
+  float angle;
+  float spread;
+  float minSpeed;
+  float maxSpeed;
+  float gravityX;
+  float gravityY;
+  float minLife;
+  float maxLife;
+  uint32_t ramp[MAX_RAMP_COLORS];
+  int numRampColors;
+  Bitmap *sprite;
+  int spriteIndex;
+  int size;
+} EmitterSettings;
+
+/**
+ * Particles are kept as a structure of arrays, packed at the front: the live ones are always the first numParticles.
+ */
+typedef struct
+{
+  EmitterSettings settings;
+  int capacity;
+  int numParticles;
+  float spawnDebt;
+  unsigned seed;
+  float *x;
+  float *y;
+  float *xVelocity;
+  float *yVelocity;
+  float *age;
+  float *life;
+} Emitter;
+
+Emitter *createEmitter(int capacity);
+void freeEmitter(Emitter *emitter);
+void emitParticles(Emitter *emitter, int count);
+void updateEmitter(Emitter *emitter, float seconds);
+void drawEmitter(Emitter *emitter, Video *video);
+void clearEmitter(Emitter *emitter);
+
+#endif
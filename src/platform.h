@@ -2,6 +2,8 @@
 #define __PLATFORM_H__
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 void platform_close();
 void platform_lockAudioDevice();
@@ -12,4 +14,11 @@ bool platform_getCharInput(char *c);
 bool platform_backspace();
 void platform_toggleFullscreen();
 
+// Microseconds from an arbitrary start, for measuring intervals.
+int64_t platform_getMicros();
+
+// Read-only mapping of a whole file. Returns NULL for missing or empty files.
+void *platform_mapFile(const char *filename, size_t *size);
+void platform_unmapFile(void *data, size_t size);
+
 #endif
@@ -0,0 +1,79 @@
+#include "platform.h"
+
+#if defined(_WIN32)
+
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+
+void *platform_mapFile(const char *filename, size_t *size)
+{
+  HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  LARGE_INTEGER fileSize;
+  void *data = NULL;
+
+  if (file == INVALID_HANDLE_VALUE)
+    return NULL;
+
+  if (GetFileSizeEx(file, &fileSize) && fileSize.QuadPart > 0 && (unsigned long long)fileSize.QuadPart <= (size_t)-1)
+  {
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+
+    if (mapping != NULL)
+    {
+      data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+  }
+
+  CloseHandle(file);
+
+  if (data != NULL)
+    *size = (size_t)fileSize.QuadPart;
+
+  return data;
+}
+
+void platform_unmapFile(void *data, size_t size)
+{
+  (void)size;
+  UnmapViewOfFile(data);
+}
+
+#else
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+void *platform_mapFile(const char *filename, size_t *size)
+{
+  int file = open(filename, O_RDONLY);
+  struct stat fileStat;
+  void *data = NULL;
+
+  if (file < 0)
+    return NULL;
+
+  if (fstat(file, &fileStat) == 0 && fileStat.st_size > 0)
+  {
+    data = mmap(NULL, (size_t)fileStat.st_size, PROT_READ, MAP_PRIVATE, file, 0);
+
+    if (data == MAP_FAILED)
+      data = NULL;
+  }
+
+  close(file);
+
+  if (data != NULL)
+    *size = (size_t)fileStat.st_size;
+
+  return data;
+}
+
+void platform_unmapFile(void *data, size_t size)
+{
+  munmap(data, size);
+}
+
+#endif
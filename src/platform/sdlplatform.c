@@ -120,9 +120,16 @@ void platform_close()
   UNSET_BIT(flags, RUNNING);
 }
 
+static int __toMicros(Uint64 ticks)
+{
+  return (int)(ticks * 1000000 / SDL_GetPerformanceFrequency());
+}
+
 void platform_lockAudioDevice()
 {
+  Uint64 start = SDL_GetPerformanceCounter();
   SDL_LockAudioDevice(audioDevice);
+  recordAudioLockWait(&milk->modules.audio, __toMicros(SDL_GetPerformanceCounter() - start));
 }
 
 void platform_unlockAudioDevice()
@@ -161,10 +168,27 @@ void platform_toggleFullscreen()
   SDL_SetWindowFullscreen(window, CHECK_BIT(flags, FULLSCREEN) ? SDL_WINDOW_FULLSCREEN_DESKTOP : 0);
 }
 
+int64_t platform_getMicros()
+{
+  Uint64 ticks = SDL_GetPerformanceCounter();
+  Uint64 frequency = SDL_GetPerformanceFrequency();
+
+  // Split, so a counter that has been running for a while doesn't overflow when scaled.
+  return (int64_t)(ticks / frequency * 1000000 + ticks % frequency * 1000000 / frequency);
+}
+
+static Uint64 lastCallbackTime;
+
 static void __mixCallback(void *userData, uint8_t *stream, int numBytes)
 {
-  memset(stream, 0, (size_t)numBytes);
-  mixSamplesIntoStream((Audio *)userData, (int16_t *)stream, (int)(numBytes / sizeof(int16_t)));
+  Audio *audio = (Audio *)userData;
+  Uint64 start = SDL_GetPerformanceCounter();
+
+  mixAudioOutput(audio, stream, numBytes);
+
+  int interval = lastCallbackTime != 0 ? __toMicros(start - lastCallbackTime) : 0;
+  lastCallbackTime = start;
+  recordAudioCallback(audio, interval, __toMicros(SDL_GetPerformanceCounter() - start));
 }
 
 static void __initModules()
@@ -199,25 +223,86 @@ static void __initModules()
   );
 }
 
-static void __initAudioDevice()
+static bool __toAudioFormat(SDL_AudioFormat sdlFormat, AudioFormat *format)
+{
+  switch (sdlFormat)
+  {
+    case AUDIO_S16SYS:
+      *format = AUDIO_FORMAT_S16;
+      return true;
+    case AUDIO_S32SYS:
+      *format = AUDIO_FORMAT_S32;
+      return true;
+    case AUDIO_F32SYS:
+      *format = AUDIO_FORMAT_F32;
+      return true;
+    default:
+      return false;
+  }
+}
+
+/**
+ * The buffer size trades latency for safety against underruns. It defaults to AUDIO_DEFAULT_BUFFER_FRAMES, and can be
+ * set with --audio-buffer <frames> or the MILK_AUDIO_BUFFER environment variable, the command line taking precedence.
+ */
+static int __getAudioBufferFrames(int argc, char *argv[])
+{
+  const char *setting = getenv("MILK_AUDIO_BUFFER");
+
+  for (int i = 1; i < argc - 1; i++)
+  {
+    if (strcmp(argv[i], "--audio-buffer") == 0)
+      setting = argv[i + 1];
+  }
+
+  if (setting == NULL)
+    return AUDIO_DEFAULT_BUFFER_FRAMES;
+
+  int frames = atoi(setting);
+
+  if (!IS_POWER_OF_TWO(frames) || frames < AUDIO_MIN_BUFFER_FRAMES || frames > AUDIO_MAX_BUFFER_FRAMES)
+  {
+    printf("Audio buffer must be a power of two from %d to %d frames, using %d.\n", AUDIO_MIN_BUFFER_FRAMES, AUDIO_MAX_BUFFER_FRAMES, AUDIO_DEFAULT_BUFFER_FRAMES);
+    return AUDIO_DEFAULT_BUFFER_FRAMES;
+  }
+
+  return frames;
+}
+
+/**
+ * The device is opened with whatever rate, channel count, format and buffer size it prefers; the mixer converts at
+ * the output stage. Formats the mixer can't write are left to SDL to convert. Without a device the game runs silent.
+ */
+static void __initAudioDevice(int bufferFrames)
 {
   SDL_AudioSpec wantedSpec;
   SDL_AudioSpec actualSpec;
+  AudioFormat format;
+  Audio *audio = &milk->modules.audio;
 
+  SDL_zero(wantedSpec);
   wantedSpec.freq = AUDIO_FREQUENCY;
-  wantedSpec.format = AUDIO_S16LSB;
+  wantedSpec.format = AUDIO_S16SYS;
   wantedSpec.channels = AUDIO_OUTPUT_CHANNELS;
-  wantedSpec.samples = 4096;
+  wantedSpec.samples = (Uint16)bufferFrames;
   wantedSpec.callback = __mixCallback;
-  wantedSpec.userdata = (void *)&milk->modules.audio;
-  audioDevice = SDL_OpenAudioDevice(NULL, 0, &wantedSpec, &actualSpec, 0);
+  wantedSpec.userdata = (void *)audio;
+  audioDevice = SDL_OpenAudioDevice(NULL, 0, &wantedSpec, &actualSpec, SDL_AUDIO_ALLOW_ANY_CHANGE);
 
-  if (wantedSpec.format != actualSpec.format || wantedSpec.channels != actualSpec.channels || wantedSpec.freq != actualSpec.freq || wantedSpec.samples != actualSpec.samples)
+  if (audioDevice != 0 && (!__toAudioFormat(actualSpec.format, &format) || actualSpec.freq < MIN_OUTPUT_FREQUENCY || actualSpec.channels > MAX_OUTPUT_CHANNELS))
   {
-    printf("Audio device is not supported.");
-    exit(1);
+    SDL_CloseAudioDevice(audioDevice);
+    audioDevice = SDL_OpenAudioDevice(NULL, 0, &wantedSpec, &actualSpec, 0);
+    format = AUDIO_FORMAT_S16;
+  }
+
+  if (audioDevice == 0)
+  {
+    printf("Unable to open an audio device: %s\n", SDL_GetError());
+    return;
   }
 
+  setAudioOutput(audio, actualSpec.freq, actualSpec.channels, format, actualSpec.samples);
   SDL_PauseAudioDevice(audioDevice, 0);
 }
 
@@ -293,14 +378,12 @@ static void __pollInput()
 
 int main(int argc, char *argv[])
 {
-  UNUSED(argc);
-  UNUSED(argv);
   SET_BIT(flags, RUNNING);
 
   atexit(__freeModules);
 
   __initModules();
-  __initAudioDevice();
+  __initAudioDevice(__getAudioBufferFrames(argc, argv));
 
   initializeMilk(milk);
 
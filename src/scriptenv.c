@@ -1,34 +1,70 @@
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
+#include <ctype.h>
 #include <math.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "bitmap.h"
+#include "buffer.h"
 #include "common.h"
 #include "logs.h"
 #include "milk.h"
+#include "particles.h"
 #include "platform.h"
 #include "scriptenv.h"
 
-static const char ModuleRegistryKey = 'k';
-
-#define BITMAP_META "bitmap"
-#define WAVE_META "wave"
-#define WAVESTREAM_META "wavestream"
+/**
+ * Every API function is a C closure with the modules as its only upvalue, so finding them costs no table lookups.
+ * Anything else the API calls into, metamethods included, is registered the same way.
+ */
+#define __getModules(L) ((Modules *)lua_touserdata(L, lua_upvalueindex(1)))
+
+/**
+ * Engine objects are userdata tagged with their type, which is also the name of their metatable. Tags are compared by
+ * address, which is cheaper than luaL_checkudata's metatable lookup. The size check keeps us from reading a tag out of
+ * a userdata that isn't ours.
+ */
+static const char BitmapType[] = "bitmap";
+static const char WaveType[] = "wave";
+static const char WaveStreamType[] = "wavestream";
+static const char BufferType[] = "buffer";
+static const char EmitterType[] = "emitter";
 
 typedef struct
 {
+	const char *type;
 	void *handle;
 } LuaObject;
 
-static Modules *__getModules(lua_State *L)
+static void __pushObject(lua_State *L, const char *type, void *handle)
 {
-	lua_pushlightuserdata(L, (void *)&ModuleRegistryKey);
-	lua_gettable(L, LUA_REGISTRYINDEX);
-	Modules *modules = lua_touserdata(L, -1);
-	lua_pop(L, 1);
-	return modules;
+	LuaObject *luaObj = lua_newuserdata(L, sizeof(LuaObject));
+	luaObj->type = type;
+	luaObj->handle = handle;
+	luaL_setmetatable(L, type);
+}
+
+static void *__testObject(lua_State *L, int index, const char *type)
+{
+	LuaObject *luaObj = lua_touserdata(L, index);
+
+	if (!luaObj || lua_rawlen(L, index) != sizeof(LuaObject) || luaObj->type != type)
+		return NULL;
+	return luaObj->handle;
+}
+
+static void *__checkObject(lua_State *L, int index, const char *type)
+{
+	void *handle = __testObject(L, index, type);
+
+	if (!handle)
+	{
+		const char *actual = luaL_getmetafield(L, index, "__name") == LUA_TSTRING ? lua_tostring(L, -1) : luaL_typename(L, index);
+		luaL_argerror(L, index, lua_pushfstring(L, "%s expected, got %s", type, actual));
+	}
+	return handle;
 }
 
 #define input_addr(L) (&__getModules(L)->input)
@@ -122,11 +158,7 @@ static int l_bitmap(lua_State *L)
 		return lua_error(L);
 	}
 	else
-	{
-		LuaObject *luaObj = lua_newuserdata(L, sizeof(LuaObject));
-		luaObj->handle = bmp;
-		luaL_setmetatable(L, BITMAP_META);
-	}
+		__pushObject(L, BitmapType, bmp);
 	return 1;
 }
 
@@ -134,10 +166,54 @@ static int l_bitmap_gc(lua_State *L)
 {
 	LuaObject *luaObj = lua_touserdata(L, 1);
 	Bitmap *bmp = luaObj->handle;
+	if (isDrawTarget(video_addr(L), bmp))
+		setDrawTarget(video_addr(L), NULL);
 	freeBitmap(bmp);
 	return 0;
 }
 
+#define MAX_CANVAS_SIZE 4096
+
+/**
+ * Canvases are plain bitmaps, so anything that draws a bitmap can draw a canvas. They start out filled with the color key.
+ * Sprites are drawn in whole 8 pixel tiles, so a canvas's sides must be multiples of 8 for all of it to be drawable.
+ */
+static int l_canvas(lua_State *L)
+{
+	lua_Integer w = luaL_checkinteger(L, 1);
+	lua_Integer h = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, w > 0 && w <= MAX_CANVAS_SIZE && w % SPRITE_SIZE == 0, 1, "width must be a multiple of 8, up to 4096");
+	luaL_argcheck(L, h > 0 && h <= MAX_CANVAS_SIZE && h % SPRITE_SIZE == 0, 2, "height must be a multiple of 8, up to 4096");
+
+	Bitmap *bmp = createBitmap((int)w, (int)h, video_addr(L)->colorKey);
+	if (!bmp)
+		return luaL_error(L, "not enough memory for a %dx%d canvas", (int)w, (int)h);
+
+	__pushObject(L, BitmapType, bmp);
+	return 1;
+}
+
+// Uploads colors from an int32 buffer into a bitmap, row by row from the top left, for as many as both have.
+static int l_pixels(lua_State *L)
+{
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
+	Buffer *buffer = __checkObject(L, 2, BufferType);
+	luaL_argcheck(L, buffer->type == BUFFER_INT32, 2, "int32 buffer expected");
+
+	int length = MIN(buffer->length, bmp->width * bmp->height);
+	memcpy(bmp->pixels, buffer->data, length * sizeof(uint32_t));
+	return 0;
+}
+
+static int l_target(lua_State *L)
+{
+	Bitmap *bmp = NULL;
+	if (!lua_isnoneornil(L, 1))
+		bmp = __checkObject(L, 1, BitmapType);
+	setDrawTarget(video_addr(L), bmp);
+	return 0;
+}
+
 static int l_clip(lua_State *L)
 {
 	setClip(
@@ -209,10 +285,131 @@ static int l_rectfill(lua_State *L)
 	return 0;
 }
 
+static int l_circ(lua_State *L)
+{
+	drawCircle(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(uint32_t)lua_tointeger(L, 4)
+	);
+	return 0;
+}
+
+static int l_circfill(lua_State *L)
+{
+	drawFilledCircle(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(uint32_t)lua_tointeger(L, 4)
+	);
+	return 0;
+}
+
+static int l_elli(lua_State *L)
+{
+	drawEllipse(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(int)lua_tointeger(L, 4),
+		(uint32_t)lua_tointeger(L, 5)
+	);
+	return 0;
+}
+
+static int l_ellifill(lua_State *L)
+{
+	drawFilledEllipse(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(int)lua_tointeger(L, 4),
+		(uint32_t)lua_tointeger(L, 5)
+	);
+	return 0;
+}
+
+static int l_tri(lua_State *L)
+{
+	drawTriangle(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)floor(lua_tonumber(L, 3)),
+		(int)floor(lua_tonumber(L, 4)),
+		(int)floor(lua_tonumber(L, 5)),
+		(int)floor(lua_tonumber(L, 6)),
+		(uint32_t)lua_tointeger(L, 7)
+	);
+	return 0;
+}
+
+static int l_trifill(lua_State *L)
+{
+	drawFilledTriangle(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)floor(lua_tonumber(L, 3)),
+		(int)floor(lua_tonumber(L, 4)),
+		(int)floor(lua_tonumber(L, 5)),
+		(int)floor(lua_tonumber(L, 6)),
+		(uint32_t)lua_tointeger(L, 7)
+	);
+	return 0;
+}
+
+// Polygons are passed as a flat table or buffer of coordinates: { x1, y1, x2, y2, ... }
+static int __getPolygonPoints(lua_State *L, int *points)
+{
+	Buffer *buffer = __testObject(L, 1, BufferType);
+
+	if (buffer)
+	{
+		int numPoints = MIN(buffer->length / 2, MAX_POLYGON_POINTS);
+		for (int i = 0; i < numPoints * 2; i++)
+			points[i] = getBufferInt(buffer, i);
+		return numPoints;
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	int numPoints = MIN((int)lua_rawlen(L, 1) / 2, MAX_POLYGON_POINTS);
+
+	for (int i = 0; i < numPoints * 2; i++)
+	{
+		lua_rawgeti(L, 1, i + 1);
+		points[i] = (int)floor(lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+	return numPoints;
+}
+
+static int l_poly(lua_State *L)
+{
+	int points[MAX_POLYGON_POINTS * 2];
+	int numPoints = __getPolygonPoints(L, points);
+	drawPolygon(video_addr(L), points, numPoints, (uint32_t)lua_tointeger(L, 2));
+	return 0;
+}
+
+static int l_polyfill(lua_State *L)
+{
+	int points[MAX_POLYGON_POINTS * 2];
+	int numPoints = __getPolygonPoints(L, points);
+	drawFilledPolygon(video_addr(L), points, numPoints, (uint32_t)lua_tointeger(L, 2));
+	return 0;
+}
+
 static int l_sprite(lua_State *L)
 {
-	LuaObject *luaObj = luaL_checkudata(L, 1, BITMAP_META);
-	Bitmap *bmp = luaObj->handle;
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
 
 	drawSprite(
 		video_addr(L), bmp,
@@ -228,11 +425,173 @@ static int l_sprite(lua_State *L)
 	return 0;
 }
 
+static int l_spriterot(lua_State *L)
+{
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
+
+	drawRotatedSprite(
+		video_addr(L), bmp,
+		(int)lua_tointeger(L, 2),
+		(int)floor(lua_tonumber(L, 3)),
+		(int)floor(lua_tonumber(L, 4)),
+		(int)luaL_optinteger(L, 6, 1),
+		(int)luaL_optinteger(L, 7, 1),
+		(float)lua_tonumber(L, 5),
+		(float)luaL_optnumber(L, 8, 1.0),
+		(uint8_t)luaL_optinteger(L, 9, 0),
+		(uint32_t)luaL_optinteger(L, 10, 0)
+	);
+	return 0;
+}
+
+#define SPRITE_RECORD_LENGTH 5
+#define SPRITE_BATCH_SIZE 256
+
+static void __getSpriteRecords(lua_State *L, SpriteRecord *batch, int batchSize, int n)
+{
+	for (int i = 0; i < batchSize; i++, n += SPRITE_RECORD_LENGTH)
+	{
+		for (int field = 0; field < SPRITE_RECORD_LENGTH; field++)
+			lua_rawgeti(L, 2, n + field);
+
+		batch[i].index = (int)lua_tointeger(L, -5);
+		batch[i].x = (int)floor(lua_tonumber(L, -4));
+		batch[i].y = (int)floor(lua_tonumber(L, -3));
+		batch[i].flip = (uint8_t)lua_tointeger(L, -2);
+		batch[i].color = (uint32_t)lua_tointeger(L, -1);
+		lua_pop(L, SPRITE_RECORD_LENGTH);
+	}
+}
+
+static void __getBufferedSpriteRecords(const Buffer *buffer, SpriteRecord *batch, int batchSize, int n)
+{
+	for (int i = 0; i < batchSize; i++, n += SPRITE_RECORD_LENGTH)
+	{
+		batch[i].index = getBufferInt(buffer, n);
+		batch[i].x = getBufferInt(buffer, n + 1);
+		batch[i].y = getBufferInt(buffer, n + 2);
+		batch[i].flip = (uint8_t)getBufferInt(buffer, n + 3);
+		batch[i].color = (uint32_t)getBufferInt(buffer, n + 4);
+	}
+}
+
+/**
+ * sprites(bmp, records, [w, h]) draws a whole batch in one call. records is a flat table or buffer of index, x, y,
+ * flip, tint, one sprite after another. They're read in runs of SPRITE_BATCH_SIZE, so the batch needs no allocation.
+ */
+static int l_sprites(lua_State *L)
+{
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
+	Buffer *buffer = __testObject(L, 2, BufferType);
+
+	if (!buffer)
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+	int length = buffer ? buffer->length : (int)lua_rawlen(L, 2);
+	int w = (int)luaL_optinteger(L, 3, 1);
+	int h = (int)luaL_optinteger(L, 4, 1);
+	luaL_argcheck(L, length % SPRITE_RECORD_LENGTH == 0, 2, "records must have 5 values each");
+
+	SpriteRecord batch[SPRITE_BATCH_SIZE];
+	int numSprites = length / SPRITE_RECORD_LENGTH;
+
+	for (int start = 0; start < numSprites; start += SPRITE_BATCH_SIZE)
+	{
+		int batchSize = MIN(numSprites - start, SPRITE_BATCH_SIZE);
+
+		if (buffer)
+			__getBufferedSpriteRecords(buffer, batch, batchSize, start * SPRITE_RECORD_LENGTH);
+		else
+			__getSpriteRecords(L, batch, batchSize, start * SPRITE_RECORD_LENGTH + 1);
+
+		drawSprites(video_addr(L), bmp, batch, batchSize, w, h);
+	}
+	return 0;
+}
+
+static float __rawGetNumber(lua_State *L, int index, int n)
+{
+	lua_rawgeti(L, index, n);
+	float value = (float)lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	return value;
+}
+
+/**
+ * Scanline transforms come either as a flat table { u, v, ustep, vstep, ... } with one group per line starting at y,
+ * or as a function that is called with each visible line's y, and returns u, v, ustep, vstep, or nothing to skip the line.
+ */
+static int l_mode7(lua_State *L)
+{
+	Video *video = video_addr(L);
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
+	bool wrap = lua_toboolean(L, 3);
+	Mode7Line lines[FRAMEBUFFER_HEIGHT];
+
+	if (lua_isfunction(L, 2))
+	{
+		int runStart = video->clipRect.top;
+		int numLines = 0;
+
+		for (int y = video->clipRect.top; y < video->clipRect.bottom; y++)
+		{
+			lua_pushvalue(L, 2);
+			lua_pushinteger(L, y);
+			lua_call(L, 1, 4);
+
+			if (lua_isnil(L, -4))
+			{
+				drawMode7(video, bmp, runStart, lines, numLines, wrap);
+				runStart = y + 1;
+				numLines = 0;
+			}
+			else
+			{
+				lines[numLines].u = (float)lua_tonumber(L, -4);
+				lines[numLines].v = (float)lua_tonumber(L, -3);
+				lines[numLines].uStep = (float)lua_tonumber(L, -2);
+				lines[numLines].vStep = (float)lua_tonumber(L, -1);
+
+				// A canvas can be taller than the screen, so a long run is drawn a screen's worth of lines at a time.
+				if (++numLines == FRAMEBUFFER_HEIGHT)
+				{
+					drawMode7(video, bmp, runStart, lines, numLines, wrap);
+					runStart = y + 1;
+					numLines = 0;
+				}
+			}
+			lua_pop(L, 4);
+		}
+		drawMode7(video, bmp, runStart, lines, numLines, wrap);
+	}
+	else
+	{
+		luaL_checktype(L, 2, LUA_TTABLE);
+		int y = (int)luaL_optinteger(L, 4, 0);
+		int numLines = (int)MIN(lua_rawlen(L, 2) / 4, (size_t)MAX(video->clipRect.bottom - y, 0));
+
+		for (int start = 0; start < numLines; start += FRAMEBUFFER_HEIGHT)
+		{
+			int chunkLines = MIN(numLines - start, FRAMEBUFFER_HEIGHT);
+
+			for (int i = 0; i < chunkLines; i++)
+			{
+				int n = (start + i) * 4;
+				lines[i].u = __rawGetNumber(L, 2, n + 1);
+				lines[i].v = __rawGetNumber(L, 2, n + 2);
+				lines[i].uStep = __rawGetNumber(L, 2, n + 3);
+				lines[i].vStep = __rawGetNumber(L, 2, n + 4);
+			}
+			drawMode7(video, bmp, y + start, lines, chunkLines, wrap);
+		}
+	}
+	return 0;
+}
+
 static int l_tiles(lua_State *L)
 {
 	Video *video = video_addr(L);
-	LuaObject *luaObj = luaL_checkudata(L, 1, BITMAP_META);
-	Bitmap *bmp = luaObj->handle;
+	Bitmap *bmp = __checkObject(L, 1, BitmapType);
 
 	int x = FLOOR(lua_tonumber(L, 3));
 	int y = FLOOR(lua_tonumber(L, 4));
@@ -242,9 +601,17 @@ static int l_tiles(lua_State *L)
 	int hPix = h * SPRITE_SIZE;
 
 	int pitch = lua_tointeger(L, 7);
-	lua_len(L, 2);
-	int len = lua_tointeger(L, -1);
-	lua_pop(L, 1);
+	Buffer *cells = __testObject(L, 2, BufferType);
+	int len;
+
+	if (cells)
+		len = cells->length;
+	else
+	{
+		lua_len(L, 2);
+		len = lua_tointeger(L, -1);
+		lua_pop(L, 1);
+	}
 
 	int xCurrent = x;
 	int i = 1;
@@ -253,9 +620,16 @@ static int l_tiles(lua_State *L)
 
 	while (len--)
 	{
-		lua_rawgeti(L, 2, i);
-		int sprIndex = lua_tointeger(L, -1);
-		lua_pop(L, 1);
+		int sprIndex;
+
+		if (cells)
+			sprIndex = getBufferInt(cells, i - 1);
+		else
+		{
+			lua_rawgeti(L, 2, i);
+			sprIndex = lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
 
 		int right = xCurrent + wPix;
 		int bottom = y + hPix;
@@ -278,11 +652,7 @@ static int l_font(lua_State *L)
 {
 	Bitmap *bmp = NULL;
 	if (!lua_isnil(L, 1))
-	{
-		LuaObject *luaObj = luaL_checkudata(L, 1, BITMAP_META);
-		if (luaObj)
-			bmp = luaObj->handle;
-	}
+		bmp = __checkObject(L, 1, BitmapType);
 
 	drawFont(
 		video_addr(L), bmp,
@@ -299,11 +669,7 @@ static int l_fontwrap(lua_State *L)
 {
 	Bitmap *bmp = NULL;
 	if (!lua_isnil(L, 1))
-	{
-		LuaObject *luaObj = luaL_checkudata(L, 1, BITMAP_META);
-		if (luaObj)
-			bmp = luaObj->handle;
-	}
+		bmp = __checkObject(L, 1, BitmapType);
 
 	drawWrappedFont
 		(video_addr(L), bmp,
@@ -317,17 +683,54 @@ static int l_fontwrap(lua_State *L)
 	return 1;
 }
 
+static int l_lightclr(lua_State *L)
+{
+	clearLights(
+		video_addr(L),
+		(uint32_t)luaL_optinteger(L, 1, 0x000000)
+	);
+	return 0;
+}
+
+static int l_light(lua_State *L)
+{
+	addLight(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(uint32_t)luaL_optinteger(L, 4, 0xffffff)
+	);
+	return 0;
+}
+
+static int l_lightcone(lua_State *L)
+{
+	addConeLight(
+		video_addr(L),
+		(int)floor(lua_tonumber(L, 1)),
+		(int)floor(lua_tonumber(L, 2)),
+		(int)lua_tointeger(L, 3),
+		(float)lua_tonumber(L, 4),
+		(float)lua_tonumber(L, 5),
+		(uint32_t)luaL_optinteger(L, 6, 0xffffff)
+	);
+	return 0;
+}
+
+static int l_lightapply(lua_State *L)
+{
+	applyLights(video_addr(L));
+	return 0;
+}
+
 static int l_wave(lua_State *L)
 {
 	Wave *wave = loadWave(lua_tostring(L, 1));
 	if (!wave)
 		lua_pushnil(L);
 	else
-	{
-		LuaObject *luaObj = lua_newuserdata(L, sizeof(LuaObject));
-		luaObj->handle = wave;
-		luaL_setmetatable(L, WAVE_META);
-	}
+		__pushObject(L, WaveType, wave);
 	return 1;
 }
 
@@ -347,11 +750,7 @@ static int l_wavestream(lua_State *L)
 	if (!waveStream)
 		lua_pushnil(L);
 	else
-	{
-		LuaObject *luaObj = lua_newuserdata(L, sizeof(LuaObject));
-		luaObj->handle = waveStream;
-		luaL_setmetatable(L, WAVESTREAM_META);
-	}
+		__pushObject(L, WaveStreamType, waveStream);
 	return 1;
 }
 
@@ -359,18 +758,30 @@ static int l_wavestream_gc(lua_State *L)
 {
 	LuaObject *luaObj = lua_touserdata(L, 1);
 	WaveStream *waveStream = luaObj->handle;
-	if (__getModules(L)->audio.streamSlot.data == waveStream)
-		stopStream(audio_addr(L));
+	stopStreamInstances(audio_addr(L), waveStream);
 	closeWaveStream(waveStream);
 	return 0;
 }
 
 static int l_play(lua_State *L)
 {
-	LuaObject *luaObj = lua_touserdata(L, 1);
-	Wave *wave = luaObj->handle;
-	playSound(audio_addr(L), wave, (int)lua_tointeger(L, 2), (int)lua_tointeger(L, 3));
-	return 0;
+	Wave *wave = __checkObject(L, 1, WaveType);
+	int slotId = lua_isnoneornil(L, 2) ? AUTO_SOUND_SLOT : (int)lua_tointeger(L, 2);
+
+	slotId = playSound(
+		audio_addr(L),
+		wave,
+		slotId,
+		(int)lua_tointeger(L, 3),
+		(float)luaL_optnumber(L, 4, 1.0),
+		(int)luaL_optinteger(L, 5, 0)
+	);
+
+	if (slotId < 0)
+		lua_pushnil(L);
+	else
+		lua_pushinteger(L, slotId);
+	return 1;
 }
 
 static int l_pause(lua_State *L)
@@ -411,10 +822,11 @@ static int l_sndslot(lua_State *L)
 	return 1;
 }
 
+#define SECONDS_TO_FRAMES(seconds) ((int)((seconds) * AUDIO_FREQUENCY))
+
 static int l_playstream(lua_State *L)
 {
-	LuaObject *luaObj = lua_touserdata(L, 1);
-	WaveStream *waveStream = luaObj->handle;
+	WaveStream *waveStream = __checkObject(L, 1, WaveStreamType);
 
 	bool loop = false;
 	if (lua_isboolean(L, 3))
@@ -422,115 +834,803 @@ static int l_playstream(lua_State *L)
 
 	playStream(
 		audio_addr(L),
+		(int)luaL_optinteger(L, 4, 0),
 		waveStream,
 		(int)lua_tointeger(L, 2),
-		loop
+		loop,
+		SECONDS_TO_FRAMES(luaL_optnumber(L, 5, 0.0)),
+		SECONDS_TO_FRAMES(luaL_optnumber(L, 6, 0.0))
 	);
 	return 0;
 }
 
-static int l_stopstream(lua_State *L)
+static int l_crossfade(lua_State *L)
 {
-	UNUSED(L);
-	stopStream(audio_addr(L));
+	WaveStream *waveStream = __checkObject(L, 1, WaveStreamType);
+
+	crossfadeStream(
+		audio_addr(L),
+		(int)lua_tointeger(L, 2),
+		(int)lua_tointeger(L, 3),
+		waveStream,
+		(int)lua_tointeger(L, 4),
+		lua_toboolean(L, 6),
+		SECONDS_TO_FRAMES(lua_tonumber(L, 5)),
+		SECONDS_TO_FRAMES(luaL_optnumber(L, 7, 0.0))
+	);
 	return 0;
 }
 
-static int l_pausestream(lua_State *L)
+static int l_fadestream(lua_State *L)
 {
-	UNUSED(L);
-	pauseStream(audio_addr(L));
+	fadeStream(
+		audio_addr(L),
+		(int)lua_tointeger(L, 1),
+		(int)lua_tointeger(L, 2),
+		SECONDS_TO_FRAMES(lua_tonumber(L, 3)),
+		SECONDS_TO_FRAMES(luaL_optnumber(L, 4, 0.0)),
+		false
+	);
 	return 0;
 }
 
-static int l_resumestream(lua_State *L)
+static int l_stopstream(lua_State *L)
 {
-	UNUSED(L);
-	resumeStream(audio_addr(L));
+	int slotId = (int)luaL_optinteger(L, 1, -1);
+	double fade = luaL_optnumber(L, 2, 0.0);
+
+	// Only a single slot can be faded out. Stopping them all is always immediate.
+	if (fade > 0.0 && slotId != -1)
+		fadeStream(audio_addr(L), slotId, 0, SECONDS_TO_FRAMES(fade), 0, true);
+	else
+		stopStream(audio_addr(L), slotId);
 	return 0;
 }
 
-static int l_vol(lua_State *L)
+static int l_pausestream(lua_State *L)
 {
-	setMasterVolume(audio_addr(L), lua_tointeger(L, 1));
+	pauseStream(audio_addr(L), (int)luaL_optinteger(L, 1, -1));
 	return 0;
 }
 
-static int l_exit(lua_State *L)
+static int l_resumestream(lua_State *L)
 {
-	UNUSED(L);
+	resumeStream(audio_addr(L), (int)luaL_optinteger(L, 1, -1));
+	return 0;
+}
+
+static int l_streamslot(lua_State *L)
+{
+	lua_pushinteger(L,
+		getStreamState(
+			audio_addr(L),
+			(int)lua_tointeger(L, 1)
+		)
+	);
+	return 1;
+}
+
+static int l_send(lua_State *L)
+{
+	setSoundSend(audio_addr(L), (int)lua_tointeger(L, 1), (int)lua_tointeger(L, 2));
+	return 0;
+}
+
+static int l_streamsend(lua_State *L)
+{
+	setStreamSend(audio_addr(L), (int)lua_tointeger(L, 1), (int)lua_tointeger(L, 2));
+	return 0;
+}
+
+static int l_pan(lua_State *L)
+{
+	setSoundPan(audio_addr(L), (int)lua_tointeger(L, 1), (int)lua_tointeger(L, 2));
+	return 0;
+}
+
+static int l_position(lua_State *L)
+{
+	setSoundPosition(
+		audio_addr(L),
+		(int)lua_tointeger(L, 1),
+		(float)lua_tonumber(L, 2),
+		(float)lua_tonumber(L, 3)
+	);
+	return 0;
+}
+
+static int l_listener(lua_State *L)
+{
+	setListener(
+		audio_addr(L),
+		(float)lua_tonumber(L, 1),
+		(float)lua_tonumber(L, 2),
+		(float)luaL_optnumber(L, 3, DEFAULT_LISTENER_RANGE)
+	);
+	return 0;
+}
+
+static int l_lowpass(lua_State *L)
+{
+	setLowPassEffect(
+		audio_addr(L),
+		(float)luaL_optnumber(L, 1, 0.0),
+		(float)luaL_optnumber(L, 2, 0.707)
+	);
+	return 0;
+}
+
+static int l_echo(lua_State *L)
+{
+	setEchoEffect(
+		audio_addr(L),
+		(int)lua_tointeger(L, 1),
+		(float)luaL_optnumber(L, 2, 0.3),
+		(float)luaL_optnumber(L, 3, 0.4)
+	);
+	return 0;
+}
+
+static int l_reverb(lua_State *L)
+{
+	setReverbEffect(
+		audio_addr(L),
+		(int)lua_tointeger(L, 1),
+		(float)luaL_optnumber(L, 2, 0.5),
+		(float)luaL_optnumber(L, 3, 0.5)
+	);
+	return 0;
+}
+
+static float __getNumberField(lua_State *L, int index, const char *key, float fallback)
+{
+	lua_getfield(L, index, key);
+	float value = (float)luaL_optnumber(L, -1, fallback);
+	lua_pop(L, 1);
+	return value;
+}
+
+static const char *const waveformNames[] = { "square", "triangle", "saw", "noise", NULL };
+
+/**
+ * instrument(id, { wave = "square", duty = 0.5, volume = 128, attack = 0.01, decay = 0.1, sustain = 1, release = 0.1 })
+ * Envelope times are in seconds, and the sustain level is a fraction of the instrument's volume.
+ */
+static int l_instrument(lua_State *L)
+{
+	Instrument instrument;
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_getfield(L, 2, "wave");
+	instrument.waveform = (Waveform)luaL_checkoption(L, -1, "square", waveformNames);
+	lua_pop(L, 1);
+
+	instrument.duty    = (int)(__getNumberField(L, 2, "duty", 0.5f) * 256);
+	instrument.volume  = CLAMP((int)__getNumberField(L, 2, "volume", SYNTH_MAX_VOLUME), 0, SYNTH_MAX_VOLUME);
+	instrument.attack  = SECONDS_TO_FRAMES(__getNumberField(L, 2, "attack", 0.01f));
+	instrument.decay   = SECONDS_TO_FRAMES(__getNumberField(L, 2, "decay", 0.1f));
+	instrument.sustain = (int)(CLAMP(__getNumberField(L, 2, "sustain", 1.0f), 0.0f, 1.0f) * SYNTH_MAX_VOLUME);
+	instrument.release = SECONDS_TO_FRAMES(__getNumberField(L, 2, "release", 0.1f));
+
+	lua_pushboolean(L, defineInstrument(audio_addr(L), (int)lua_tointeger(L, 1), &instrument));
+	return 1;
+}
+
+/**
+ * pattern(id, { rowtime = 0.125, next = id, { instrument = 1, volume = 128, notes = "C4 E4 G4 . - ..." }, ... })
+ * Each track is a string of notes, one per row: a name like "C4" or "F#3", "." to let the track carry on, or "-" to release it.
+ */
+static int l_pattern(lua_State *L)
+{
+	Pattern pattern;
+	memset(&pattern, 0, sizeof(Pattern));
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+	pattern.rowFrames = SECONDS_TO_FRAMES(__getNumberField(L, 2, "rowtime", 0.125f));
+	pattern.next      = (int)__getNumberField(L, 2, "next", -1.0f);
+
+	int numTracks = MIN((int)lua_rawlen(L, 2), SYNTH_TRACKS);
+
+	for (int track = 0; track < numTracks; track++)
+	{
+		lua_rawgeti(L, 2, track + 1);
+		luaL_checktype(L, -1, LUA_TTABLE);
+
+		uint8_t instrument = (uint8_t)CLAMP((int)__getNumberField(L, -1, "instrument", 0.0f), 0, UINT8_MAX);
+		uint8_t volume     = (uint8_t)CLAMP((int)__getNumberField(L, -1, "volume", SYNTH_MAX_VOLUME), 0, SYNTH_MAX_VOLUME);
+
+		lua_getfield(L, -1, "notes");
+		const char *notes = luaL_optstring(L, -1, "");
+		int row = 0;
+
+		for (;;)
+		{
+			while (isspace((unsigned char)*notes))
+				notes++;
+
+			if (*notes == '\0' || row == SYNTH_MAX_ROWS)
+				break;
+
+			int note = parseNote(&notes);
+
+			if (note < 0)
+				return luaL_error(L, "invalid note in track %d: %s", track + 1, notes);
+
+			pattern.rows[row][track] = (PatternStep){ .note = (uint8_t)note, .instrument = instrument, .volume = volume };
+			row++;
+		}
+
+		pattern.rowCount = MAX(pattern.rowCount, row);
+		lua_pop(L, 2);
+	}
+
+	lua_pushboolean(L, definePattern(audio_addr(L), (int)lua_tointeger(L, 1), &pattern));
+	return 1;
+}
+
+static int l_playpattern(lua_State *L)
+{
+	playPattern(audio_addr(L), (int)lua_tointeger(L, 1));
+	return 0;
+}
+
+static int l_stoppattern(lua_State *L)
+{
+	stopPattern(audio_addr(L));
+	return 0;
+}
+
+// note(instrument, note, volume, seconds), where the note is a name like "C4" or a MIDI note number.
+static int l_note(lua_State *L)
+{
+	int note;
+
+	if (lua_type(L, 2) == LUA_TSTRING)
+	{
+		const char *name = lua_tostring(L, 2);
+		if ((note = parseNote(&name)) < 0)
+			return luaL_error(L, "invalid note: %s", lua_tostring(L, 2));
+	}
+	else
+		note = (int)lua_tointeger(L, 2);
+
+	playNote(
+		audio_addr(L),
+		(int)lua_tointeger(L, 1),
+		note,
+		(int)luaL_optinteger(L, 3, SYNTH_MAX_VOLUME),
+		SECONDS_TO_FRAMES(luaL_optnumber(L, 4, 0.25))
+	);
+	return 0;
+}
+
+static int l_vol(lua_State *L)
+{
+	setMasterVolume(audio_addr(L), lua_tointeger(L, 1));
+	return 0;
+}
+
+static void __setIntField(lua_State *L, const char *key, int value)
+{
+	lua_pushinteger(L, value);
+	lua_setfield(L, -2, key);
+}
+
+// { count, max, p50, p90, p99, buckets = { ... } }, where bucket n counts values up to 2^n, from 2^(n-1).
+static void __pushStatSummary(lua_State *L, const char *key, const StatSummary *summary)
+{
+	lua_createtable(L, 0, 6);
+	__setIntField(L, "count", summary->count);
+	__setIntField(L, "max", summary->max);
+	__setIntField(L, "p50", summary->p50);
+	__setIntField(L, "p90", summary->p90);
+	__setIntField(L, "p99", summary->p99);
+
+	lua_createtable(L, STAT_BUCKETS, 0);
+	for (int i = 0; i < STAT_BUCKETS; i++)
+	{
+		lua_pushinteger(L, summary->buckets[i]);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_setfield(L, -2, "buckets");
+	lua_setfield(L, -2, key);
+}
+
+static int l_audiostats(lua_State *L)
+{
+	Audio *audio = audio_addr(L);
+	AudioStats stats;
+
+	getAudioStats(audio, &stats);
+	if (lua_toboolean(L, 1))
+		resetAudioStats(audio);
+
+	lua_createtable(L, 0, 13);
+	__setIntField(L, "frequency", stats.frequency);
+	__setIntField(L, "buffer", stats.bufferFrames);
+	__setIntField(L, "callbacks", stats.callbacks);
+	__setIntField(L, "underruns", stats.underruns);
+	__setIntField(L, "last", stats.lastCallbackMicros);
+	__setIntField(L, "average", stats.averageCallbackMicros);
+	__setIntField(L, "max", stats.maxCallbackMicros);
+	__setIntField(L, "starves", stats.streamStarves);
+	__pushStatSummary(L, "callback", &stats.callback);
+	__pushStatSummary(L, "voices", &stats.voices);
+	__pushStatSummary(L, "streambytes", &stats.streamBytes);
+	__pushStatSummary(L, "lockwait", &stats.lockWait);
+	__pushStatSummary(L, "latency", &stats.playLatency);
+	return 1;
+}
+
+static const char *const bufferTypeNames[] = { "int8", "int16", "int32", "float32", NULL };
+
+/**
+ * buffer(type, n) makes a zeroed buffer of n elements, and buffer(type, table) makes one holding the table's numbers.
+ * Buffers are indexed from 1 like tables, and reading past the end gives nil.
+ */
+static int l_buffer(lua_State *L)
+{
+	BufferElementType type = (BufferElementType)luaL_checkoption(L, 1, NULL, bufferTypeNames);
+	bool fromTable = lua_istable(L, 2);
+	int length = fromTable ? (int)lua_rawlen(L, 2) : (int)luaL_checkinteger(L, 2);
+	luaL_argcheck(L, length >= 0, 2, "length can't be negative");
+
+	Buffer *buffer = createBuffer(type, length);
+	if (!buffer)
+		return luaL_error(L, "not enough memory for a buffer of %d", length);
+
+	// Pushed before it's filled, so it's collected even if a value raises an error.
+	__pushObject(L, BufferType, buffer);
+
+	for (int i = 0; fromTable && i < length; i++)
+	{
+		lua_rawgeti(L, 2, i + 1);
+		if (!lua_isnumber(L, -1))
+			return luaL_error(L, "buffer values must be numbers, got %s at %d", luaL_typename(L, -1), i + 1);
+		setBufferValue(buffer, i, lua_tonumber(L, -1));
+		lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int l_buffer_gc(lua_State *L)
+{
+	LuaObject *luaObj = lua_touserdata(L, 1);
+	freeBuffer(luaObj->handle);
+	return 0;
+}
+
+static int l_buffer_index(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+
+	if (lua_type(L, 2) != LUA_TNUMBER)
+	{
+		lua_getmetatable(L, 1);
+		lua_pushvalue(L, 2);
+		lua_rawget(L, -2);
+		return 1;
+	}
+
+	lua_Integer index = lua_tointeger(L, 2);
+
+	if (index < 1 || index > buffer->length)
+		lua_pushnil(L);
+	else if (buffer->type == BUFFER_FLOAT32)
+		lua_pushnumber(L, getBufferValue(buffer, (int)index - 1));
+	else
+		lua_pushinteger(L, getBufferInt(buffer, (int)index - 1));
+	return 1;
+}
+
+static int l_buffer_newindex(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	lua_Integer index = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, index >= 1 && index <= buffer->length, 2, "index out of range");
+
+	setBufferValue(buffer, (int)index - 1, luaL_checknumber(L, 3));
+	return 0;
+}
+
+static int l_buffer_len(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	lua_pushinteger(L, buffer->length);
+	return 1;
+}
+
+// Reads an optional i, j range starting at the given argument. Like string.sub, the range is clamped to the buffer.
+static int __getBufferRange(lua_State *L, int arg, const Buffer *buffer, int *start)
+{
+	lua_Integer first = luaL_optinteger(L, arg, 1);
+	lua_Integer last = luaL_optinteger(L, arg + 1, buffer->length);
+
+	first = MAX(first, 1);
+	last = MIN(last, buffer->length);
+	*start = (int)first - 1;
+	return first > last ? 0 : (int)(last - first + 1);
+}
+
+// buf:fill(value, [i, j])
+static int l_buffer_fill(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	double value = luaL_checknumber(L, 2);
+	int start;
+	int count = __getBufferRange(L, 3, buffer, &start);
+
+	fillBuffer(buffer, start, count, value);
+	return 0;
+}
+
+// buf:copy(source, [at, i, j]) copies source[i..j] to buf, starting at index at. Whatever doesn't fit is left out.
+static int l_buffer_copy(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	Buffer *source = __checkObject(L, 2, BufferType);
+	lua_Integer at = luaL_optinteger(L, 3, 1);
+	luaL_argcheck(L, at >= 1, 3, "index out of range");
+
+	int start;
+	int count = __getBufferRange(L, 4, source, &start);
+
+	if (at <= buffer->length)
+		copyBuffer(buffer, (int)at - 1, source, start, MIN(count, buffer->length - (int)at + 1));
+	return 0;
+}
+
+// buf:slice([i, j]) returns a new buffer of the same type, holding a copy of buf[i..j].
+static int l_buffer_slice(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	int start;
+	int count = __getBufferRange(L, 2, buffer, &start);
+
+	Buffer *slice = createBuffer(buffer->type, count);
+	if (!slice)
+		return luaL_error(L, "not enough memory for a buffer of %d", count);
+
+	copyBuffer(slice, 0, buffer, start, count);
+	__pushObject(L, BufferType, slice);
+	return 1;
+}
+
+static Buffer *__checkOperand(lua_State *L, const Buffer *buffer)
+{
+	Buffer *other = __testObject(L, 2, BufferType);
+
+	if (other)
+		luaL_argcheck(L, other->type == buffer->type && other->length == buffer->length, 2, "buffers must match in type and length");
+	return other;
+}
+
+// buf:add(number) adds to every element. buf:add(other, [scale]) adds other, times scale, element by element.
+static int l_buffer_add(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	Buffer *other = __checkOperand(L, buffer);
+
+	if (other)
+		addBuffer(buffer, other, luaL_optnumber(L, 3, 1.0));
+	else
+		addToBuffer(buffer, luaL_checknumber(L, 2));
+	return 0;
+}
+
+// buf:mul(number) scales every element. buf:mul(other) multiplies element by element.
+static int l_buffer_mul(lua_State *L)
+{
+	Buffer *buffer = __checkObject(L, 1, BufferType);
+	Buffer *other = __checkOperand(L, buffer);
+
+	if (other)
+		multiplyByBuffer(buffer, other);
+	else
+		multiplyBuffer(buffer, luaL_checknumber(L, 2));
+	return 0;
+}
+
+static const luaL_Reg bufferMethods[] =
+{
+	{"__gc", l_buffer_gc},
+	{"__index", l_buffer_index},
+	{"__newindex", l_buffer_newindex},
+	{"__len", l_buffer_len},
+	{"fill", l_buffer_fill},
+	{"copy", l_buffer_copy},
+	{"slice", l_buffer_slice},
+	{"add", l_buffer_add},
+	{"mul", l_buffer_mul},
+	{NULL, NULL}
+};
+
+#define DEFAULT_EMITTER_CAPACITY 1024
+
+// particles([capacity]) makes an emitter that holds up to capacity live particles. It starts out not spawning any.
+static int l_particles(lua_State *L)
+{
+	int capacity = (int)luaL_optinteger(L, 1, DEFAULT_EMITTER_CAPACITY);
+	luaL_argcheck(L, capacity > 0 && capacity <= MAX_EMITTER_PARTICLES, 1, "capacity out of range");
+
+	Emitter *emitter = createEmitter(capacity);
+	if (!emitter)
+		return luaL_error(L, "not enough memory for %d particles", capacity);
+
+	__pushObject(L, EmitterType, emitter);
+	return 1;
+}
+
+static int l_emitter_gc(lua_State *L)
+{
+	LuaObject *luaObj = lua_touserdata(L, 1);
+	freeEmitter(luaObj->handle);
+	return 0;
+}
+
+static void __getRampField(lua_State *L, EmitterSettings *settings)
+{
+	lua_getfield(L, 2, "colors");
+
+	if (lua_istable(L, -1))
+	{
+		int numColors = CLAMP((int)lua_rawlen(L, -1), 1, MAX_RAMP_COLORS);
+		for (int i = 0; i < numColors; i++)
+		{
+			lua_rawgeti(L, -1, i + 1);
+			settings->ramp[i] = (uint32_t)lua_tointeger(L, -1);
+			lua_pop(L, 1);
+		}
+		settings->numRampColors = numColors;
+	}
+	lua_pop(L, 1);
+}
+
+// The emitter holds on to its sprite's bitmap as its user value, so the bitmap can't be collected from under it.
+static void __getSpriteField(lua_State *L, EmitterSettings *settings)
+{
+	lua_getfield(L, 2, "sprite");
+
+	if (lua_toboolean(L, -1))
+	{
+		settings->sprite = __testObject(L, -1, BitmapType);
+		luaL_argcheck(L, settings->sprite, 2, "sprite must be a bitmap");
+		lua_setuservalue(L, 1);
+	}
+	else if (lua_isboolean(L, -1))
+	{
+		settings->sprite = NULL;
+		lua_setuservalue(L, 1);
+	}
+	else
+		lua_pop(L, 1);
+}
+
+/**
+ * em:set({ x, y, rate, angle, spread, minspeed, maxspeed, gravityx, gravityy, minlife, maxlife, colors, sprite, index, size })
+ * Only the fields given change. rate is in particles per second, and colors is the ramp each particle steps through
+ * over its life. Ramp colors are tints, as in sprite(): alpha is how strongly a sprite takes the color, and squares
+ * are always drawn in it opaque. sprite = false goes back to drawing squares of the given size.
+ */
+static int l_emitter_set(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	EmitterSettings *settings = &emitter->settings;
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	settings->x           = __getNumberField(L, 2, "x", settings->x);
+	settings->y           = __getNumberField(L, 2, "y", settings->y);
+	settings->rate        = __getNumberField(L, 2, "rate", settings->rate);
+	settings->angle       = __getNumberField(L, 2, "angle", settings->angle);
+	settings->spread      = __getNumberField(L, 2, "spread", settings->spread);
+	settings->minSpeed    = __getNumberField(L, 2, "minspeed", settings->minSpeed);
+	settings->maxSpeed    = __getNumberField(L, 2, "maxspeed", settings->maxSpeed);
+	settings->gravityX    = __getNumberField(L, 2, "gravityx", settings->gravityX);
+	settings->gravityY    = __getNumberField(L, 2, "gravityy", settings->gravityY);
+	settings->minLife     = __getNumberField(L, 2, "minlife", settings->minLife);
+	settings->maxLife     = __getNumberField(L, 2, "maxlife", settings->maxLife);
+	settings->spriteIndex = (int)__getNumberField(L, 2, "index", (float)settings->spriteIndex);
+	settings->size        = MAX((int)__getNumberField(L, 2, "size", (float)settings->size), 1);
+	__getRampField(L, settings);
+	__getSpriteField(L, settings);
+	return 0;
+}
+
+// em:move(x, y) moves where new particles spawn. Particles already out keep going.
+static int l_emitter_move(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	emitter->settings.x = (float)luaL_checknumber(L, 2);
+	emitter->settings.y = (float)luaL_checknumber(L, 3);
+	return 0;
+}
+
+// em:emit(n) spawns a burst of n particles at once, on top of the rate.
+static int l_emitter_emit(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	emitParticles(emitter, (int)luaL_checkinteger(L, 2));
+	return 0;
+}
+
+// em:update([seconds]) advances the emitter by one frame, or by the given time.
+static int l_emitter_update(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	updateEmitter(emitter, (float)luaL_optnumber(L, 2, 1.0 / FRAMERATE));
+	return 0;
+}
+
+static int l_emitter_draw(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	drawEmitter(emitter, video_addr(L));
+	return 0;
+}
+
+static int l_emitter_clear(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	clearEmitter(emitter);
+	return 0;
+}
+
+static int l_emitter_len(lua_State *L)
+{
+	Emitter *emitter = __checkObject(L, 1, EmitterType);
+	lua_pushinteger(L, emitter->numParticles);
+	return 1;
+}
+
+static const luaL_Reg emitterMethods[] =
+{
+	{"__gc", l_emitter_gc},
+	{"__len", l_emitter_len},
+	{"set", l_emitter_set},
+	{"move", l_emitter_move},
+	{"emit", l_emitter_emit},
+	{"update", l_emitter_update},
+	{"draw", l_emitter_draw},
+	{"clear", l_emitter_clear},
+	{NULL, NULL}
+};
+
+static int l_exit(lua_State *L)
+{
+	UNUSED(L);
 	platform_close();
 	return 0;
 }
 
-static void __registerModules(lua_State *L, Modules *modules)
+static void __pushApiClosure(lua_State *L, Modules *modules, lua_CFunction api_func)
 {
-	lua_pushlightuserdata(L, (void *)&ModuleRegistryKey);
 	lua_pushlightuserdata(L, (void *)modules);
-	lua_settable(L, LUA_REGISTRYINDEX);
+	lua_pushcclosure(L, api_func, 1);
 }
 
-static void __pushApiFunction(lua_State *L, const char *name, int (*api_func)(lua_State *))
+static void __pushApiFunction(lua_State *L, Modules *modules, const char *name, lua_CFunction api_func)
 {
-	lua_pushcfunction(L, api_func);
+	__pushApiClosure(L, modules, api_func);
 	lua_setglobal(L, name);
 }
 
-static void __registerApiFunctions(lua_State *L)
-{
-	__pushApiFunction(L, "key", l_key);
-	__pushApiFunction(L, "keyp", l_keyp);
-	__pushApiFunction(L, "btn", l_btn);
-	__pushApiFunction(L, "btnp", l_btnp);
-	__pushApiFunction(L, "mouse", l_mouse);
-	__pushApiFunction(L, "mousebtn", l_mousebtn);
-	__pushApiFunction(L, "mousebtnp", l_mousebtnp);
-	__pushApiFunction(L, "bitmap", l_bitmap);
-	__pushApiFunction(L, "clip", l_clip);
-	__pushApiFunction(L, "clrs", l_clrs);
-	__pushApiFunction(L, "pset", l_pset);
-	__pushApiFunction(L, "line", l_line);
-	__pushApiFunction(L, "rect", l_rect);
-	__pushApiFunction(L, "rectfill", l_rectfill);
-	__pushApiFunction(L, "sprite", l_sprite);
-	__pushApiFunction(L, "tiles", l_tiles);
-	__pushApiFunction(L, "font", l_font);
-	__pushApiFunction(L, "fontwrap", l_fontwrap);
-	__pushApiFunction(L, "wave", l_wave);
-	__pushApiFunction(L, "stream", l_wavestream);
-	__pushApiFunction(L, "play", l_play);
-	__pushApiFunction(L, "pause", l_pause);
-	__pushApiFunction(L, "stop", l_stop);
-	__pushApiFunction(L, "resume", l_resume);
-	__pushApiFunction(L, "playstream", l_playstream);
-	__pushApiFunction(L, "stopstream", l_stopstream);
-	__pushApiFunction(L, "pausestream", l_pausestream);
-	__pushApiFunction(L, "resumestream", l_resumestream);
-	__pushApiFunction(L, "sndslot", l_sndslot);
-	__pushApiFunction(L, "vol", l_vol);
-	__pushApiFunction(L, "exit", l_exit);
-}
-
-static void __registerMetatable(lua_State *L, const char *name, lua_CFunction gc)
+static void __registerApiFunctions(lua_State *L, Modules *modules)
+{
+	__pushApiFunction(L, modules, "key", l_key);
+	__pushApiFunction(L, modules, "keyp", l_keyp);
+	__pushApiFunction(L, modules, "btn", l_btn);
+	__pushApiFunction(L, modules, "btnp", l_btnp);
+	__pushApiFunction(L, modules, "mouse", l_mouse);
+	__pushApiFunction(L, modules, "mousebtn", l_mousebtn);
+	__pushApiFunction(L, modules, "mousebtnp", l_mousebtnp);
+	__pushApiFunction(L, modules, "bitmap", l_bitmap);
+	__pushApiFunction(L, modules, "canvas", l_canvas);
+	__pushApiFunction(L, modules, "pixels", l_pixels);
+	__pushApiFunction(L, modules, "target", l_target);
+	__pushApiFunction(L, modules, "clip", l_clip);
+	__pushApiFunction(L, modules, "clrs", l_clrs);
+	__pushApiFunction(L, modules, "pset", l_pset);
+	__pushApiFunction(L, modules, "line", l_line);
+	__pushApiFunction(L, modules, "rect", l_rect);
+	__pushApiFunction(L, modules, "rectfill", l_rectfill);
+	__pushApiFunction(L, modules, "circ", l_circ);
+	__pushApiFunction(L, modules, "circfill", l_circfill);
+	__pushApiFunction(L, modules, "elli", l_elli);
+	__pushApiFunction(L, modules, "ellifill", l_ellifill);
+	__pushApiFunction(L, modules, "tri", l_tri);
+	__pushApiFunction(L, modules, "trifill", l_trifill);
+	__pushApiFunction(L, modules, "poly", l_poly);
+	__pushApiFunction(L, modules, "polyfill", l_polyfill);
+	__pushApiFunction(L, modules, "sprite", l_sprite);
+	__pushApiFunction(L, modules, "sprites", l_sprites);
+	__pushApiFunction(L, modules, "spriterot", l_spriterot);
+	__pushApiFunction(L, modules, "tiles", l_tiles);
+	__pushApiFunction(L, modules, "mode7", l_mode7);
+	__pushApiFunction(L, modules, "font", l_font);
+	__pushApiFunction(L, modules, "fontwrap", l_fontwrap);
+	__pushApiFunction(L, modules, "lightclr", l_lightclr);
+	__pushApiFunction(L, modules, "light", l_light);
+	__pushApiFunction(L, modules, "lightcone", l_lightcone);
+	__pushApiFunction(L, modules, "lightapply", l_lightapply);
+	__pushApiFunction(L, modules, "wave", l_wave);
+	__pushApiFunction(L, modules, "stream", l_wavestream);
+	__pushApiFunction(L, modules, "play", l_play);
+	__pushApiFunction(L, modules, "pause", l_pause);
+	__pushApiFunction(L, modules, "stop", l_stop);
+	__pushApiFunction(L, modules, "resume", l_resume);
+	__pushApiFunction(L, modules, "playstream", l_playstream);
+	__pushApiFunction(L, modules, "stopstream", l_stopstream);
+	__pushApiFunction(L, modules, "pausestream", l_pausestream);
+	__pushApiFunction(L, modules, "resumestream", l_resumestream);
+	__pushApiFunction(L, modules, "fadestream", l_fadestream);
+	__pushApiFunction(L, modules, "crossfade", l_crossfade);
+	__pushApiFunction(L, modules, "streamslot", l_streamslot);
+	__pushApiFunction(L, modules, "send", l_send);
+	__pushApiFunction(L, modules, "streamsend", l_streamsend);
+	__pushApiFunction(L, modules, "pan", l_pan);
+	__pushApiFunction(L, modules, "position", l_position);
+	__pushApiFunction(L, modules, "listener", l_listener);
+	__pushApiFunction(L, modules, "lowpass", l_lowpass);
+	__pushApiFunction(L, modules, "echo", l_echo);
+	__pushApiFunction(L, modules, "reverb", l_reverb);
+	__pushApiFunction(L, modules, "instrument", l_instrument);
+	__pushApiFunction(L, modules, "pattern", l_pattern);
+	__pushApiFunction(L, modules, "playpattern", l_playpattern);
+	__pushApiFunction(L, modules, "stoppattern", l_stoppattern);
+	__pushApiFunction(L, modules, "note", l_note);
+	__pushApiFunction(L, modules, "sndslot", l_sndslot);
+	__pushApiFunction(L, modules, "vol", l_vol);
+	__pushApiFunction(L, modules, "audiostats", l_audiostats);
+	__pushApiFunction(L, modules, "buffer", l_buffer);
+	__pushApiFunction(L, modules, "particles", l_particles);
+	__pushApiFunction(L, modules, "exit", l_exit);
+}
+
+static void __registerMetatable(lua_State *L, Modules *modules, const char *name, lua_CFunction gc)
 {
 	luaL_newmetatable(L, name);
-	lua_pushcfunction(L, gc);
+	__pushApiClosure(L, modules, gc);
 	lua_setfield(L, -2, "__gc");
 	lua_pushvalue(L, -1);
 	lua_setfield(L, -2, "__index");
 	lua_pop(L, 1);
 }
 
+/**
+ * Methods live in the metatable, which is also its own __index unless the type brings one. Buffers index through a
+ * function, which passes anything that isn't a number on to the methods.
+ */
+static void __registerMethods(lua_State *L, Modules *modules, const char *name, const luaL_Reg *methods)
+{
+	luaL_newmetatable(L, name);
+	for (; methods->name; methods++)
+	{
+		__pushApiClosure(L, modules, methods->func);
+		lua_setfield(L, -2, methods->name);
+	}
+
+	lua_getfield(L, -1, "__index");
+	if (lua_isnil(L, -1))
+	{
+		lua_pushvalue(L, -2);
+		lua_setfield(L, -3, "__index");
+	}
+	lua_pop(L, 2);
+}
+
 void openScriptEnv(ScriptEnv *scriptEnv, Modules *modules)
 {
 	lua_State *L = luaL_newstate();
 	scriptEnv->state = (void *)L;
+	scriptEnv->updateRef = LUA_NOREF;
+	scriptEnv->drawRef = LUA_NOREF;
 	luaL_openlibs(L);
-	__registerModules(L, modules);
-	__registerApiFunctions(L);
-	__registerMetatable(L, BITMAP_META, l_bitmap_gc);
-	__registerMetatable(L, WAVE_META, l_wave_gc);
-	__registerMetatable(L, WAVESTREAM_META, l_wavestream_gc);
+	__registerApiFunctions(L, modules);
+	__registerMetatable(L, modules, BitmapType, l_bitmap_gc);
+	__registerMetatable(L, modules, WaveType, l_wave_gc);
+	__registerMetatable(L, modules, WaveStreamType, l_wavestream_gc);
+	__registerMethods(L, modules, BufferType, bufferMethods);
+	__registerMethods(L, modules, EmitterType, emitterMethods);
 }
 
 void closeScriptEnv(ScriptEnv *scriptEnv)
@@ -551,23 +1651,37 @@ bool loadEntryPoint(ScriptEnv *scriptEnv)
 	return true;
 }
 
+static int __refGlobal(lua_State *L, const char *name)
+{
+	lua_getglobal(L, name);
+	return luaL_ref(L, LUA_REGISTRYINDEX);
+}
+
+/**
+ * _update and _draw are looked up once _init has run, and called through registry references from then on, which saves
+ * a global lookup each frame. Assigning new ones after that takes a reload.
+ */
 bool invokeInit(ScriptEnv *scriptEnv)
 {
 	lua_State *L = scriptEnv->state;
 	lua_getglobal(L, "_init");
-	if (lua_pcall(L, 0, 0, 0) != 0)
+	bool succeeded = lua_pcall(L, 0, 0, 0) == 0;
+	if (!succeeded)
 	{
 		logError(lua_tostring(L, -1));
 		lua_pop(L, -1);
-		return false;
 	}
-	return true;
+	luaL_unref(L, LUA_REGISTRYINDEX, scriptEnv->updateRef);
+	luaL_unref(L, LUA_REGISTRYINDEX, scriptEnv->drawRef);
+	scriptEnv->updateRef = __refGlobal(L, "_update");
+	scriptEnv->drawRef = __refGlobal(L, "_draw");
+	return succeeded;
 }
 
 void invokeUpdate(ScriptEnv *scriptEnv)
 {
 	lua_State *L = scriptEnv->state;
-	lua_getglobal(L, "_update");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, scriptEnv->updateRef);
 	if (lua_pcall(L, 0, 0, 0) != 0)
 	{
 		logError(lua_tostring(L, -1));
@@ -578,7 +1692,7 @@ void invokeUpdate(ScriptEnv *scriptEnv)
 void invokeDraw(ScriptEnv *scriptEnv)
 {
 	lua_State *L = scriptEnv->state;
-	lua_getglobal(L, "_draw");
+	lua_rawgeti(L, LUA_REGISTRYINDEX, scriptEnv->drawRef);
 	if (lua_pcall(L, 0, 0, 0) != 0)
 	{
 		logError(lua_tostring(L, -1));
@@ -17,6 +17,8 @@ typedef struct Modules
 typedef struct
 {
   void *state;
+  int updateRef;
+  int drawRef;
 } ScriptEnv;
 
 void openScriptEnv(ScriptEnv *scriptEnv, Modules *modules);
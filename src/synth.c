@@ -0,0 +1,344 @@
+#include <ctype.h>
+#include <math.h>
+#include <string.h>
+
+#include "common.h"
+#include "synth.h"
+
+/**
+ * A small chiptune synth that renders straight into the mix bus. Each voice is one oscillator, square, triangle, saw
+ * or noise, shaped by a linear ADSR envelope. The first SYNTH_TRACKS voices belong to the pattern sequencer, one per
+ * track. The rest play one-off notes for sound effects, stealing the oldest when they run out.
+ *
+ * Voices are rendered in stretches where nothing but the phase and the envelope level changes: up to the next row of
+ * the pattern, the end of an envelope stage or the end of a held note. That keeps the inner loops free of bookkeeping,
+ * and keeps the timing of rows sample-accurate whatever size the chunks are.
+ */
+
+#define LEVEL_SHIFT 16
+#define LEVEL_MAX (1 << LEVEL_SHIFT)
+#define OSCILLATOR_AMPLITUDE 8192 // A quarter of full scale, so that four full tracks just fit.
+#define NOISE_CLOCK_SHIFT 28      // The noise generator is clocked 16 times per cycle.
+#define NOISE_SEED 1
+#define MIDI_NOTES 128
+#define MIDI_A4 69
+#define FREQUENCY_A4 440.0
+#define SUSTAIN_LEVEL(instrument) ((instrument)->sustain * LEVEL_MAX / SYNTH_MAX_VOLUME)
+
+static uint32_t noteSteps[MIDI_NOTES];
+static bool noteStepsBuilt = false;
+
+// Shared by every synth, so only the first to be initialized builds them.
+static void __buildNoteSteps()
+{
+  if (noteStepsBuilt)
+    return;
+
+  for (int note = 0; note < MIDI_NOTES; note++)
+  {
+    double frequency = FREQUENCY_A4 * pow(2.0, (note - MIDI_A4) / 12.0);
+    noteSteps[note] = (uint32_t)(frequency * 4294967296.0 / SYNTH_FREQUENCY);
+  }
+  noteStepsBuilt = true;
+}
+
+void initializeSynth(Synth *synth)
+{
+  memset(synth, 0, sizeof(Synth));
+  synth->pattern = -1;
+  __buildNoteSteps();
+}
+
+static void __enterStage(SynthVoice *voice, EnvelopeStage stage)
+{
+  const Instrument *instrument = voice->instrument;
+  int frames;
+
+  switch (stage)
+  {
+    case ENVELOPE_ATTACK:
+      voice->levelTarget = LEVEL_MAX;
+      frames = instrument->attack;
+      break;
+    case ENVELOPE_DECAY:
+      voice->levelTarget = SUSTAIN_LEVEL(instrument);
+      frames = instrument->decay;
+      break;
+    case ENVELOPE_SUSTAIN:
+      // Nothing left to hear until the note is released.
+      voice->stage       = voice->level > 0 ? ENVELOPE_SUSTAIN : ENVELOPE_OFF;
+      voice->stageFrames = -1;
+      voice->levelStep   = 0;
+      return;
+    case ENVELOPE_RELEASE:
+      voice->levelTarget = 0;
+      voice->holdFrames  = -1;
+      frames = instrument->release;
+      break;
+    default:
+      voice->stage = ENVELOPE_OFF;
+      voice->level = 0;
+      return;
+  }
+
+  frames = MAX(frames, 1);
+  voice->stage       = stage;
+  voice->stageFrames = frames;
+  voice->levelStep   = (voice->levelTarget - voice->level) / frames;
+}
+
+static void __noteOn(Synth *synth, SynthVoice *voice, const Instrument *instrument, int note, int volume)
+{
+  // A voice that is still sounding keeps its phase and level, so retriggering it doesn't click.
+  if (voice->stage == ENVELOPE_OFF)
+  {
+    voice->phase = 0;
+    voice->noise = NOISE_SEED;
+    voice->level = 0;
+  }
+
+  voice->instrument = instrument;
+  voice->volume     = instrument->volume * CLAMP(volume, 0, SYNTH_MAX_VOLUME) / SYNTH_MAX_VOLUME;
+  voice->phaseStep  = noteSteps[note & (MIDI_NOTES - 1)];
+  voice->holdFrames = -1;
+  voice->started    = ++synth->notesStarted;
+  __enterStage(voice, ENVELOPE_ATTACK);
+}
+
+static void __noteOff(SynthVoice *voice)
+{
+  if (voice->stage != ENVELOPE_OFF && voice->stage != ENVELOPE_RELEASE)
+    __enterStage(voice, ENVELOPE_RELEASE);
+}
+
+void playSynthNote(Synth *synth, int instrument, int note, int volume, int durationFrames)
+{
+  if (instrument < 0 || instrument >= SYNTH_MAX_INSTRUMENTS || !synth->instruments[instrument].defined)
+    return;
+
+  if (note <= NOTE_REST || note >= MIDI_NOTES)
+    return;
+
+  SynthVoice *voice = &synth->voices[SYNTH_TRACKS];
+
+  for (int i = SYNTH_TRACKS; i < SYNTH_VOICES; i++)
+  {
+    if (synth->voices[i].stage == ENVELOPE_OFF)
+    {
+      voice = &synth->voices[i];
+      break;
+    }
+
+    if (synth->voices[i].started < voice->started)
+      voice = &synth->voices[i];
+  }
+
+  __noteOn(synth, voice, &synth->instruments[instrument], note, volume);
+  voice->holdFrames = MAX(durationFrames, 1);
+}
+
+void playSynthPattern(Synth *synth, int pattern)
+{
+  if (pattern < 0 || pattern >= SYNTH_MAX_PATTERNS || !synth->patterns[pattern].defined)
+    return;
+
+  synth->pattern       = pattern;
+  synth->row           = 0;
+  synth->rowFramesLeft = 0;
+}
+
+void stopSynth(Synth *synth)
+{
+  synth->pattern = -1;
+
+  for (int i = 0; i < SYNTH_VOICES; i++)
+    __noteOff(&synth->voices[i]);
+}
+
+static void __startRow(Synth *synth)
+{
+  const Pattern *pattern = &synth->patterns[synth->pattern];
+
+  if (synth->row >= pattern->rowCount)
+  {
+    int next = pattern->next;
+
+    if (next < 0 || next >= SYNTH_MAX_PATTERNS || !synth->patterns[next].defined || synth->patterns[next].rowCount == 0)
+    {
+      synth->pattern = -1;
+      return;
+    }
+
+    synth->pattern = next;
+    synth->row     = 0;
+    pattern        = &synth->patterns[next];
+  }
+
+  for (int track = 0; track < SYNTH_TRACKS; track++)
+  {
+    const PatternStep *step = &pattern->rows[synth->row][track];
+    SynthVoice *voice = &synth->voices[track];
+
+    if (step->note == NOTE_OFF)
+      __noteOff(voice);
+    else if (step->note != NOTE_REST && step->note < MIDI_NOTES && step->instrument < SYNTH_MAX_INSTRUMENTS
+      && synth->instruments[step->instrument].defined)
+      __noteOn(synth, voice, &synth->instruments[step->instrument], step->note, step->volume);
+  }
+
+  synth->row++;
+  synth->rowFramesLeft = MAX(pattern->rowFrames, 1);
+}
+
+// The oscillator's output, from -OSCILLATOR_AMPLITUDE to OSCILLATOR_AMPLITUDE, is scaled by the envelope and then the volume.
+#define RENDER_OSCILLATOR(output)\
+  for (int i = 0; i < numFrames; i++)\
+  {\
+    int32_t value  = (output);\
+    int32_t sample = (((value * (level >> 1)) >> 15) * volume) >> 7;\
+    bus[i * 2]     += sample;\
+    bus[i * 2 + 1] += sample;\
+    phase += phaseStep;\
+    level += levelStep;\
+  }
+
+// A 15-bit LFSR, as on the NES, clocked at a multiple of the note's frequency.
+static inline int32_t __noiseSample(uint32_t *noise, uint32_t phase, uint32_t phaseStep)
+{
+  if (((phase + phaseStep) ^ phase) >> NOISE_CLOCK_SHIFT)
+    *noise = (*noise >> 1) | (((*noise ^ (*noise >> 1)) & 1) << 14);
+
+  return (*noise & 1) ? OSCILLATOR_AMPLITUDE : -OSCILLATOR_AMPLITUDE;
+}
+
+static void __renderOscillator(SynthVoice *voice, int32_t *bus, int numFrames)
+{
+  uint32_t phase     = voice->phase;
+  uint32_t phaseStep = voice->phaseStep;
+  int32_t level      = voice->level;
+  int32_t levelStep  = voice->levelStep;
+  int32_t volume     = voice->volume;
+
+  switch (voice->instrument->waveform)
+  {
+    case WAVEFORM_SQUARE:
+    {
+      uint32_t duty = (uint32_t)CLAMP(voice->instrument->duty, 1, 255) << 24;
+      RENDER_OSCILLATOR(phase < duty ? OSCILLATOR_AMPLITUDE : -OSCILLATOR_AMPLITUDE);
+      break;
+    }
+    case WAVEFORM_TRIANGLE:
+      RENDER_OSCILLATOR(((int32_t)(((phase >> 31) ? ~phase : phase) >> 15) - 32768) >> 2);
+      break;
+    case WAVEFORM_SAW:
+      RENDER_OSCILLATOR(((int32_t)(phase >> 16) - 32768) >> 2);
+      break;
+    case WAVEFORM_NOISE:
+    {
+      uint32_t noise = voice->noise;
+      RENDER_OSCILLATOR(__noiseSample(&noise, phase, phaseStep));
+      voice->noise = (uint16_t)noise;
+      break;
+    }
+  }
+
+  voice->phase = phase;
+  voice->level = level;
+}
+
+static void __renderVoice(SynthVoice *voice, int32_t *bus, int numFrames)
+{
+  while (numFrames > 0 && voice->stage != ENVELOPE_OFF)
+  {
+    int frames = numFrames;
+
+    if (voice->stageFrames >= 0)
+      frames = MIN(frames, voice->stageFrames);
+    if (voice->holdFrames >= 0)
+      frames = MIN(frames, voice->holdFrames);
+
+    __renderOscillator(voice, bus, frames);
+    bus       += frames * 2;
+    numFrames -= frames;
+
+    if (voice->stageFrames > 0 && (voice->stageFrames -= frames) == 0)
+    {
+      voice->level = voice->levelTarget;
+      __enterStage(voice, voice->stage + 1);
+    }
+
+    if (voice->holdFrames > 0 && (voice->holdFrames -= frames) == 0)
+      __noteOff(voice);
+  }
+}
+
+void renderSynth(Synth *synth, int32_t *bus, int numFrames)
+{
+  while (numFrames > 0)
+  {
+    int frames = numFrames;
+
+    if (synth->pattern != -1 && synth->rowFramesLeft == 0)
+      __startRow(synth);
+
+    if (synth->pattern != -1)
+      frames = MIN(frames, synth->rowFramesLeft);
+
+    for (int i = 0; i < SYNTH_VOICES; i++)
+      __renderVoice(&synth->voices[i], bus, frames);
+
+    if (synth->pattern != -1)
+      synth->rowFramesLeft -= frames;
+
+    bus       += frames * 2;
+    numFrames -= frames;
+  }
+}
+
+/**
+ * Parses a note name such as "C4", "F#3" or "Bb2" into its MIDI note number, or "." into NOTE_REST and "-" into
+ * NOTE_OFF, and moves past it. Returns -1 if the text doesn't start with a note.
+ */
+int parseNote(const char **text)
+{
+  static const int semitones[] = { 9, 11, 0, 2, 4, 5, 7 }; // A to G
+  const char *position = *text;
+  int note;
+
+  if (*position == '.' || *position == '-')
+  {
+    *text = position + 1;
+    return *position == '.' ? NOTE_REST : NOTE_OFF;
+  }
+
+  char letter = (char)toupper((unsigned char)*position);
+
+  if (letter < 'A' || letter > 'G')
+    return -1;
+
+  note = semitones[letter - 'A'];
+  position++;
+
+  if (*position == '#')
+  {
+    note++;
+    position++;
+  }
+  else if (*position == 'b')
+  {
+    note--;
+    position++;
+  }
+
+  if (!isdigit((unsigned char)*position))
+    return -1;
+
+  note += (*position - '0' + 1) * 12;
+  position++;
+
+  if (note <= NOTE_REST || note >= MIDI_NOTES)
+    return -1;
+
+  *text = position;
+  return note;
+}
@@ -0,0 +1,100 @@
+#ifndef __SYNTH_H__
+#define __SYNTH_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SYNTH_FREQUENCY 44100
+#define SYNTH_MAX_INSTRUMENTS 32
+#define SYNTH_MAX_PATTERNS 32
+#define SYNTH_MAX_ROWS 64
+#define SYNTH_TRACKS 4
+#define SYNTH_NOTE_VOICES 4
+#define SYNTH_VOICES (SYNTH_TRACKS + SYNTH_NOTE_VOICES)
+#define SYNTH_MAX_VOLUME 128
+#define NOTE_REST 0
+#define NOTE_OFF 255
+
+typedef enum
+{
+  WAVEFORM_SQUARE,
+  WAVEFORM_TRIANGLE,
+  WAVEFORM_SAW,
+  WAVEFORM_NOISE
+} Waveform;
+
+typedef struct
+{
+  bool defined;
+  Waveform waveform;
+  int duty;       // Square wave duty cycle, out of 256.
+  int volume;
+  int attack;     // Envelope times are in frames, the sustain level is out of SYNTH_MAX_VOLUME.
+  int decay;
+  int sustain;
+  int release;
+} Instrument;
+
+typedef struct
+{
+  uint8_t note;   // MIDI note number, or NOTE_REST to let the track carry on, or NOTE_OFF to release it.
+  uint8_t instrument;
+  uint8_t volume;
+} PatternStep;
+
+typedef struct
+{
+  bool defined;
+  int rowCount;
+  int rowFrames;
+  int next;       // Pattern that plays once this one ends, or -1 to stop.
+  PatternStep rows[SYNTH_MAX_ROWS][SYNTH_TRACKS];
+} Pattern;
+
+typedef enum
+{
+  ENVELOPE_OFF,
+  ENVELOPE_ATTACK,
+  ENVELOPE_DECAY,
+  ENVELOPE_SUSTAIN,
+  ENVELOPE_RELEASE
+} EnvelopeStage;
+
+typedef struct
+{
+  const Instrument *instrument;
+  int volume;
+  uint32_t phase;
+  uint32_t phaseStep;
+  uint16_t noise;
+  EnvelopeStage stage;
+  int stageFrames;    // Frames left in the stage. Sustain lasts until the note is released.
+  int32_t level;      // Envelope level, Q16.
+  int32_t levelStep;
+  int32_t levelTarget;
+  int holdFrames;    // Frames until a note voice releases itself, or -1 to hold.
+  unsigned started;
+} SynthVoice;
+
+typedef struct
+{
+  // Written by the game thread while it holds the device lock
+  Instrument instruments[SYNTH_MAX_INSTRUMENTS];
+  Pattern patterns[SYNTH_MAX_PATTERNS];
+
+  // Owned by the mixer
+  SynthVoice voices[SYNTH_VOICES];
+  int pattern;        // Pattern being sequenced, or -1.
+  int row;
+  int rowFramesLeft;
+  unsigned notesStarted;
+} Synth;
+
+void initializeSynth(Synth *synth);
+void playSynthNote(Synth *synth, int instrument, int note, int volume, int durationFrames);
+void playSynthPattern(Synth *synth, int pattern);
+void stopSynth(Synth *synth);
+void renderSynth(Synth *synth, int32_t *bus, int numFrames);
+int parseNote(const char **text);
+
+#endif
@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "audio.h"
+#include "common.h"
+#include "mixbench.h"
+#include "platform.h"
+#include "wave.h"
+
+/**
+ * Renders the mixer offline, with no window or audio device.
+ *
+ *   mixbench                              Benchmarks each voice count, checking every render against the reference kernels.
+ *   mixbench --voices 16 --out mix.wav    Renders a single script, and writes it to a WAV file.
+ *
+ * --seconds <n> sets the length of each render and --seed <n> picks the script. --wave <file> plays a sound loaded from
+ * disk instead of the generated ones. --expect <checksum> fails unless a single render's checksum matches it.
+ */
+
+#define DEFAULT_SECONDS 10
+#define DEFAULT_VOICES 16
+#define DEFAULT_SEED 1
+
+// Offline mixers never take the device lock, but the audio code still links against it.
+void platform_lockAudioDevice() {}
+void platform_unlockAudioDevice() {}
+
+int64_t platform_getMicros()
+{
+  return (int64_t)clock() * 1000000 / CLOCKS_PER_SEC;
+}
+
+static Audio audio;
+static MixScript script;
+
+static const char *__getOption(int argc, char *argv[], const char *name)
+{
+  for (int i = 1; i < argc - 1; i++)
+  {
+    if (strcmp(argv[i], name) == 0)
+      return argv[i + 1];
+  }
+  return NULL;
+}
+
+static int __getIntOption(int argc, char *argv[], const char *name, int fallback)
+{
+  const char *value = __getOption(argc, argv, name);
+  return value ? (int)strtol(value, NULL, 0) : fallback;
+}
+
+static void __printResult(const MixResult *result)
+{
+  printf("%6d  %10.2fM  %8.1fx  %08x  %s\n",
+    result->voices,
+    result->samplesPerSecond / 1000000.0,
+    result->samplesPerSecond / (AUDIO_FREQUENCY * AUDIO_OUTPUT_CHANNELS),
+    result->checksum,
+    result->matchesReference ? "match" : "MISMATCH");
+}
+
+static int __renderOne(int argc, char *argv[], Wave **waves, int numWaves, int seconds)
+{
+  const char *outName = __getOption(argc, argv, "--out");
+  const char *expected = __getOption(argc, argv, "--expect");
+  int voices = __getIntOption(argc, argv, "--voices", DEFAULT_VOICES);
+  FILE *file = NULL;
+  MixResult result, reference;
+
+  if (outName && !(file = fopen(outName, "wb")))
+  {
+    printf("Could not open %s.\n", outName);
+    return EXIT_FAILURE;
+  }
+
+  buildMixScript(&script, waves, numWaves, voices, seconds * AUDIO_FREQUENCY, (unsigned)__getIntOption(argc, argv, "--seed", DEFAULT_SEED));
+  renderMixScript(&audio, &script, false, file, &result);
+  renderMixScript(&audio, &script, true, NULL, &reference);
+  result.voices = CLAMP(voices, 1, MAX_SOUND_SLOTS);
+  result.matchesReference = result.checksum == reference.checksum;
+
+  if (file)
+    fclose(file);
+
+  printf("voices  samples/s   realtime  checksum  reference\n");
+  __printResult(&result);
+
+  if (expected && (unsigned)strtoul(expected, NULL, 16) != result.checksum)
+  {
+    printf("Expected checksum %s.\n", expected);
+    return EXIT_FAILURE;
+  }
+
+  return result.matchesReference ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static int __benchmark(Wave **waves, int numWaves, int seconds)
+{
+  MixResult results[MIX_BENCH_MAX_RESULTS];
+  int numResults = benchmarkMixer(&audio, waves, numWaves, seconds, results);
+  bool matches = true;
+
+  printf("%d seconds per render\n", seconds);
+  printf("voices  samples/s   realtime  checksum  reference\n");
+
+  for (int i = 0; i < numResults; i++)
+  {
+    __printResult(&results[i]);
+    matches &= results[i].matchesReference;
+  }
+
+  return matches ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int main(int argc, char *argv[])
+{
+  const char *waveName = __getOption(argc, argv, "--wave");
+  int seconds = __getIntOption(argc, argv, "--seconds", DEFAULT_SECONDS);
+  Wave *waves[2];
+  int numWaves;
+  int status;
+
+  if (waveName)
+  {
+    if (!(waves[0] = loadWave(waveName)))
+    {
+      printf("Could not load %s.\n", waveName);
+      return EXIT_FAILURE;
+    }
+    numWaves = 1;
+  }
+  else
+  {
+    waves[0] = createBenchWave(1, AUDIO_FREQUENCY * 2);
+    waves[1] = createBenchWave(2, AUDIO_FREQUENCY);
+    numWaves = 2;
+  }
+
+  if (__getOption(argc, argv, "--voices") || __getOption(argc, argv, "--out") || __getOption(argc, argv, "--expect"))
+    status = __renderOne(argc, argv, waves, numWaves, MAX(seconds, 1));
+  else
+    status = __benchmark(waves, numWaves, MAX(seconds, 1));
+
+  disableAudio(&audio);
+
+  for (int i = 0; i < numWaves; i++)
+    freeWave(waves[i]);
+
+  return status;
+}
@@ -5,6 +5,12 @@
 #include "common.h"
 #include "video.h"
 
+#ifdef MILK_AVX2
+#include <immintrin.h>
+#elif defined(MILK_SSE2)
+#include <emmintrin.h>
+#endif
+
 /**
  * Milk handles drawing, clipping, and blending pixels on a per pixel basis.
  * Although this isn't very efficient, it hasn't been much of an issue so far.
@@ -30,27 +36,44 @@ static uint32_t embeddedFontData[] =
 void initializeVideo(Video *video)
 {
   memset(&video->framebuffer, 0, sizeof(video->framebuffer));
+  clearLights(video, 0xffffff);
   resetDrawState(video);
 }
 
 void resetDrawState(Video *video)
 {
-  video->colorKey         = 0xff000000;
+  video->colorKey = 0xff000000;
+  setDrawTarget(video, NULL);
+}
+
+void setDrawTarget(Video *video, Bitmap *bmp)
+{
+  video->target = bmp ? *bmp : (Bitmap) {
+    .pixels = video->framebuffer,
+    .width  = FRAMEBUFFER_WIDTH,
+    .height = FRAMEBUFFER_HEIGHT
+  };
+
   video->clipRect.top     = 0;
   video->clipRect.left    = 0;
-  video->clipRect.bottom  = FRAMEBUFFER_HEIGHT;
-  video->clipRect.right   = FRAMEBUFFER_WIDTH;
+  video->clipRect.bottom  = video->target.height;
+  video->clipRect.right   = video->target.width;
+}
+
+bool isDrawTarget(Video *video, Bitmap *bmp)
+{
+  return video->target.pixels == bmp->pixels;
 }
 
 void setClip(Video *video, int x, int y, int w, int h)
 {
-  video->clipRect.left    = CLAMP(x, 0, FRAMEBUFFER_WIDTH);
-  video->clipRect.right   = CLAMP(x + w, 0, FRAMEBUFFER_WIDTH);
-  video->clipRect.top     = CLAMP(y, 0, FRAMEBUFFER_HEIGHT);
-  video->clipRect.bottom  = CLAMP(y + h, 0, FRAMEBUFFER_HEIGHT);
+  video->clipRect.left    = CLAMP(x, 0, video->target.width);
+  video->clipRect.right   = CLAMP(x + w, 0, video->target.width);
+  video->clipRect.top     = CLAMP(y, 0, video->target.height);
+  video->clipRect.bottom  = CLAMP(y + h, 0, video->target.height);
 }
 
-#define FRAMEBUFFER_POS(x, y) (y * FRAMEBUFFER_WIDTH + x)
+#define TARGET_POS(video, x, y) ((y) * (video)->target.width + (x))
 
 void clearFramebuffer(Video *video, uint32_t color)
 {
@@ -59,18 +82,18 @@ void clearFramebuffer(Video *video, uint32_t color)
 
   for (int y = clip.top; y < clip.bottom; y++)
   {
-    int start = FRAMEBUFFER_POS(clip.left, y);
+    int start = TARGET_POS(video, clip.left, y);
     int end = start + length;
 
     for (int x = start; x < end; x++)
-      video->framebuffer[x] = color;
+      video->target.pixels[x] = color;
   }
 }
 
 void drawPixel(Video *video, int x, int y, uint32_t color)
 {
   if (video->clipRect.left <= x  && x < video->clipRect.right && video->clipRect.top <= y && y < video->clipRect.bottom)
-      video->framebuffer[FRAMEBUFFER_POS(x, y)] = color;
+      video->target.pixels[TARGET_POS(video, x, y)] = color;
 }
 
 void drawLine(Video *video, int x0, int y0, int x1, int y1, uint32_t color)
@@ -80,7 +103,7 @@ void drawLine(Video *video, int x0, int y0, int x1, int y1, uint32_t color)
   int xStep     = SIGN(xDistance);
   int yStep     = SIGN(yDistance);
   xDistance     = abs(xDistance) << 1;
-  yDistance     = abs(xDistance) << 1;
+  yDistance     = abs(yDistance) << 1;
 
   drawPixel(video, x0, y0, color);
 
@@ -116,10 +139,23 @@ void drawLine(Video *video, int x0, int y0, int x1, int y1, uint32_t color)
   }
 }
 
-static void __horizontalLine(Video *video, int x, int y, int w, uint32_t color)
+static void __fillSpan(Video *video, int x0, int x1, int y, uint32_t color)
 {
-  for (int i = x; i <= x + w; i++)
-    drawPixel(video, i, y, color);
+  Rect clip = video->clipRect;
+
+  if (y < clip.top || y >= clip.bottom)
+    return;
+
+  x0 = MAX(x0, clip.left);
+  x1 = MIN(x1, clip.right - 1);
+
+  if (x0 > x1)
+    return;
+
+  uint32_t *pixel = &video->target.pixels[TARGET_POS(video, x0, y)];
+
+  for (int x = x0; x <= x1; x++)
+    *pixel++ = color;
 }
 
 static void __verticalLine(Video *video, int x, int y, int h, uint32_t color)
@@ -130,17 +166,271 @@ static void __verticalLine(Video *video, int x, int y, int h, uint32_t color)
 
 void drawRect(Video *video, int x, int y, int w, int h, uint32_t color)
 {
-  __horizontalLine(video, x, y, w, color);     // Top edge
-  __horizontalLine(video, x, y + h, w, color); // Bottom edge
-  __verticalLine(video, x, y, h, color);       // Left edge
-  __verticalLine(video, x + w, y, h, color);   // Right edge
+  __fillSpan(video, x, x + w, y, color);      // Top edge
+  __fillSpan(video, x, x + w, y + h, color);  // Bottom edge
+  __verticalLine(video, x, y, h, color);      // Left edge
+  __verticalLine(video, x + w, y, h, color);  // Right edge
 }
 
 void drawFilledRect(Video *video, int x, int y, int w, int h, uint32_t color)
 {
-  for (int i = y; i < y + h; i++)
-    for (int j = x; j < x + w; j++)
-      drawPixel(video, j, i, color);
+  int yStart  = MAX(y, video->clipRect.top);
+  int yEnd    = MIN(y + h, video->clipRect.bottom);
+
+  for (int i = yStart; i < yEnd; i++)
+    __fillSpan(video, x, x + w - 1, i, color);
+}
+
+static void __plotQuadrants(Video *video, int xc, int yc, int x, int y, bool fill, uint32_t color)
+{
+  if (fill)
+  {
+    __fillSpan(video, xc - x, xc + x, yc - y, color);
+    __fillSpan(video, xc - x, xc + x, yc + y, color);
+  }
+  else
+  {
+    drawPixel(video, xc + x, yc + y, color);
+    drawPixel(video, xc - x, yc + y, color);
+    drawPixel(video, xc + x, yc - y, color);
+    drawPixel(video, xc - x, yc - y, color);
+  }
+}
+
+static void __circle(Video *video, int xc, int yc, int radius, bool fill, uint32_t color)
+{
+  if (radius < 0)
+    return;
+
+  int x     = radius;
+  int y     = 0;
+  int error = 1 - radius;
+
+  while (x >= y)
+  {
+    __plotQuadrants(video, xc, yc, x, y, fill, color);
+    __plotQuadrants(video, xc, yc, y, x, fill, color);
+
+    y++;
+    if (error < 0)
+      error += 2 * y + 1;
+    else
+    {
+      x--;
+      error += 2 * (y - x) + 1;
+    }
+  }
+}
+
+void drawCircle(Video *video, int x, int y, int radius, uint32_t color)
+{
+  __circle(video, x, y, radius, false, color);
+}
+
+void drawFilledCircle(Video *video, int x, int y, int radius, uint32_t color)
+{
+  __circle(video, x, y, radius, true, color);
+}
+
+// Kennedy's integer ellipse algorithm: walk the first octant pair while the slope is above -1, then the second.
+static void __ellipse(Video *video, int xc, int yc, int xRadius, int yRadius, bool fill, uint32_t color)
+{
+  if (xRadius < 0 || yRadius < 0)
+    return;
+
+  if (xRadius == 0 || yRadius == 0)
+  {
+    drawFilledRect(video, xc - xRadius, yc - yRadius, 2 * xRadius + 1, 2 * yRadius + 1, color);
+    return;
+  }
+
+  int64_t twoASquare = (int64_t)2 * xRadius * xRadius;
+  int64_t twoBSquare = (int64_t)2 * yRadius * yRadius;
+
+  int x             = xRadius;
+  int y             = 0;
+  int64_t xChange   = (int64_t)yRadius * yRadius * (1 - 2 * xRadius);
+  int64_t yChange   = (int64_t)xRadius * xRadius;
+  int64_t error     = 0;
+  int64_t xStopping = twoBSquare * xRadius;
+  int64_t yStopping = 0;
+
+  while (xStopping >= yStopping)
+  {
+    __plotQuadrants(video, xc, yc, x, y, fill, color);
+    y++;
+    yStopping += twoASquare;
+    error     += yChange;
+    yChange   += twoASquare;
+
+    if (2 * error + xChange > 0)
+    {
+      x--;
+      xStopping -= twoBSquare;
+      error     += xChange;
+      xChange   += twoBSquare;
+    }
+  }
+
+  x         = 0;
+  y         = yRadius;
+  xChange   = (int64_t)yRadius * yRadius;
+  yChange   = (int64_t)xRadius * xRadius * (1 - 2 * yRadius);
+  error     = 0;
+  xStopping = 0;
+  yStopping = twoASquare * yRadius;
+
+  while (xStopping <= yStopping)
+  {
+    __plotQuadrants(video, xc, yc, x, y, fill, color);
+    x++;
+    xStopping += twoBSquare;
+    error     += xChange;
+    xChange   += twoBSquare;
+
+    if (2 * error + yChange > 0)
+    {
+      y--;
+      yStopping -= twoASquare;
+      error     += yChange;
+      yChange   += twoASquare;
+    }
+  }
+}
+
+void drawEllipse(Video *video, int x, int y, int xRadius, int yRadius, uint32_t color)
+{
+  __ellipse(video, x, y, xRadius, yRadius, false, color);
+}
+
+void drawFilledEllipse(Video *video, int x, int y, int xRadius, int yRadius, uint32_t color)
+{
+  __ellipse(video, x, y, xRadius, yRadius, true, color);
+}
+
+void drawTriangle(Video *video, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+  drawLine(video, x0, y0, x1, y1, color);
+  drawLine(video, x1, y1, x2, y2, color);
+  drawLine(video, x2, y2, x0, y0, color);
+}
+
+// Wide enough for any int coordinate, and for shallow edges that cross thousands of pixels per scanline.
+typedef struct
+{
+  int64_t x;    // 16.16 fixed point
+  int64_t step; // 16.16 fixed point, per scanline
+} Edge;
+
+static void __initEdge(Edge *edge, int x0, int y0, int x1, int y1, int yStart)
+{
+  edge->step  = y1 != y0 ? ((int64_t)x1 - x0) * 65536 / ((int64_t)y1 - y0) : 0;
+  edge->x     = (int64_t)x0 * 65536 + (1 << 15) + edge->step * ((int64_t)yStart - y0);
+}
+
+#define SWAP(a, b) do { int tmp = a; a = b; b = tmp; } while(0)
+
+void drawFilledTriangle(Video *video, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color)
+{
+  if (y0 > y1) { SWAP(x0, x1); SWAP(y0, y1); }
+  if (y1 > y2) { SWAP(x1, x2); SWAP(y1, y2); }
+  if (y0 > y1) { SWAP(x0, x1); SWAP(y0, y1); }
+
+  int yStart  = MAX(y0, video->clipRect.top);
+  int yEnd    = MIN(y2, video->clipRect.bottom - 1);
+
+  if (yStart > yEnd)
+    return;
+
+  if (y0 == y2)
+  {
+    __fillSpan(video, MIN(x0, MIN(x1, x2)), MAX(x0, MAX(x1, x2)), y0, color);
+    return;
+  }
+
+  Edge longEdge, shortEdge;
+  __initEdge(&longEdge, x0, y0, x2, y2, yStart);
+
+  if (yStart < y1)
+    __initEdge(&shortEdge, x0, y0, x1, y1, yStart);
+  else
+    __initEdge(&shortEdge, x1, y1, x2, y2, yStart);
+
+  for (int y = yStart; y <= yEnd; y++)
+  {
+    // The short edge switches over at the middle vertex. A flat top starts on the lower edge already.
+    if (y == y1 && y1 != y0)
+      __initEdge(&shortEdge, x1, y1, x2, y2, y);
+
+    int xLong   = (int)(longEdge.x >> 16);
+    int xShort  = (int)(shortEdge.x >> 16);
+
+    __fillSpan(video, MIN(xLong, xShort), MAX(xLong, xShort), y, color);
+
+    longEdge.x  += longEdge.step;
+    shortEdge.x += shortEdge.step;
+  }
+}
+
+void drawPolygon(Video *video, const int *points, int numPoints, uint32_t color)
+{
+  if (numPoints < 2)
+    return;
+
+  for (int i = 0, j = numPoints - 1; i < numPoints; j = i++)
+    drawLine(video, points[j * 2], points[j * 2 + 1], points[i * 2], points[i * 2 + 1], color);
+}
+
+// Even-odd scanline fill. Edges are sampled at pixel centers so that shared edges are never filled twice.
+void drawFilledPolygon(Video *video, const int *points, int numPoints, uint32_t color)
+{
+  if (numPoints < 3)
+    return;
+
+  numPoints = MIN(numPoints, MAX_POLYGON_POINTS);
+
+  int yMin = points[1];
+  int yMax = points[1];
+
+  for (int i = 1; i < numPoints; i++)
+  {
+    yMin = MIN(yMin, points[i * 2 + 1]);
+    yMax = MAX(yMax, points[i * 2 + 1]);
+  }
+
+  yMin = MAX(yMin, video->clipRect.top);
+  yMax = MIN(yMax, video->clipRect.bottom - 1);
+
+  float crossings[MAX_POLYGON_POINTS];
+
+  for (int y = yMin; y <= yMax; y++)
+  {
+    float ySample = y + 0.5f;
+    int numCrossings = 0;
+
+    for (int i = 0, j = numPoints - 1; i < numPoints; j = i++)
+    {
+      float xi = (float)points[i * 2], yi = (float)points[i * 2 + 1];
+      float xj = (float)points[j * 2], yj = (float)points[j * 2 + 1];
+
+      if ((yi <= ySample && ySample < yj) || (yj <= ySample && ySample < yi))
+      {
+        float crossing = xi + (ySample - yi) * (xj - xi) / (yj - yi);
+        int k = numCrossings++;
+
+        // Insertion sort, there are only ever a handful of crossings per scanline.
+        while (k > 0 && crossings[k - 1] > crossing)
+        {
+          crossings[k] = crossings[k - 1];
+          k--;
+        }
+        crossings[k] = crossing;
+      }
+    }
+
+    for (int i = 0; i + 1 < numCrossings; i += 2)
+      __fillSpan(video, (int)ceilf(crossings[i] - 0.5f), (int)ceilf(crossings[i + 1] - 0.5f) - 1, y, color);
+  }
 }
 
 #define A_COMP(color) ((color & 0xff000000) >> 24)
@@ -193,12 +483,17 @@ static void __drawBuffer(Video *video, uint32_t *buffer, int x, int y, int w, in
   }
 }
 
-#define BUFFER_CHUNK(bmp, row, column) (&bmp->pixels[row * bmp->width * SPRITE_SIZE + column * SPRITE_SIZE])
+#define BUFFER_CHUNK(bmp, row, column) (&(bmp)->pixels[(row) * (bmp)->width * SPRITE_SIZE + (column) * SPRITE_SIZE])
 
 void drawSprite(Video *video, Bitmap *bmp, int index, int x, int y, int w, int h, float scale, uint8_t flip, uint32_t color)
 {
   int numRows     = bmp->height / SPRITE_SIZE;
   int numColumns  = bmp->width / SPRITE_SIZE;
+
+  // Bitmaps smaller than a sprite have no sprites in them.
+  if (numRows == 0 || numColumns == 0)
+    return;
+
   int row         = FLOOR(index / numColumns);
   int column      = FLOOR(index % numColumns);
 
@@ -208,6 +503,321 @@ void drawSprite(Video *video, Bitmap *bmp, int index, int x, int y, int w, int h
   __drawBuffer(video, BUFFER_CHUNK(bmp, row, column), x, y, w * SPRITE_SIZE, h * SPRITE_SIZE, bmp->width, scale, flip, color);
 }
 
+/**
+ * Batched sprites are never scaled, so each one is clipped once as a whole and copied row by row, rather than going
+ * through __drawBuffer's per pixel scaling and clipping. Untinted pixels skip the blend, which would only have made
+ * them opaque. The output is the same as drawing each sprite with drawSprite.
+ */
+static void __blitBuffer(Video *video, uint32_t *buffer, int x, int y, int w, int h, int pitch, uint8_t flip, uint32_t color)
+{
+  Rect clip   = video->clipRect;
+  int xStart  = MAX(x, clip.left);
+  int xEnd    = MIN(x + w, clip.right);
+  int yStart  = MAX(y, clip.top);
+  int yEnd    = MIN(y + h, clip.bottom);
+
+  if (xStart >= xEnd || yStart >= yEnd)
+    return;
+
+  int xStep       = CHECK_BIT(flip, 1) ? -1 : 1;
+  int yStep       = CHECK_BIT(flip, 2) ? -1 : 1;
+  int xSource     = CHECK_BIT(flip, 1) ? w - 1 - (xStart - x) : xStart - x;
+  int ySource     = CHECK_BIT(flip, 2) ? h - 1 - (yStart - y) : yStart - y;
+  int length      = xEnd - xStart;
+  bool isTinted   = A_COMP(color) != 0;
+  uint32_t key    = video->colorKey;
+
+  for (int yDest = yStart; yDest < yEnd; yDest++, ySource += yStep)
+  {
+    uint32_t *source  = &buffer[ySource * pitch + xSource];
+    uint32_t *dest    = &video->target.pixels[TARGET_POS(video, xStart, yDest)];
+
+    for (int i = 0; i < length; i++, source += xStep)
+    {
+      uint32_t pixel = *source;
+
+      if (pixel == key)
+        continue;
+
+      if (isTinted)
+        BLEND(pixel, color);
+      else
+        pixel |= 0xff000000;
+
+      dest[i] = pixel;
+    }
+  }
+}
+
+/**
+ * Draws a batch of w by h sprites from the same sheet. Sprites whose index is off the sheet are skipped, so a batch
+ * can leave holes with -1, the same as tiles.
+ */
+void drawSprites(Video *video, Bitmap *bmp, const SpriteRecord *sprites, int numSprites, int w, int h)
+{
+  int numRows     = bmp->height / SPRITE_SIZE;
+  int numColumns  = bmp->width / SPRITE_SIZE;
+
+  if (numRows == 0 || numColumns == 0)
+    return;
+
+  for (int i = 0; i < numSprites; i++)
+  {
+    const SpriteRecord *sprite = &sprites[i];
+    int row     = sprite->index / numColumns;
+    int column  = sprite->index % numColumns;
+
+    if (sprite->index < 0 || row >= numRows)
+      continue;
+
+    int columns = CLAMP(w, 1, numColumns - column);
+    int rows    = CLAMP(h, 1, numRows - row);
+
+    __blitBuffer(video, BUFFER_CHUNK(bmp, row, column), sprite->x, sprite->y, columns * SPRITE_SIZE, rows * SPRITE_SIZE, bmp->width, sprite->flip, sprite->color);
+  }
+}
+
+/**
+ * Rotated blits are inverse mapped: the destination bounding box is clipped once, and each scanline
+ * walks the source in 16.16 fixed point. The span of each scanline that actually lands inside the
+ * source is solved up front, so the cost follows the number of covered pixels instead of the box.
+ */
+static void __drawRotatedBuffer(Video *video, uint32_t *buffer, int x, int y, int w, int h, int pitch, float angle, float scale, uint8_t flip, uint32_t color)
+{
+  if (scale <= 0)
+    return;
+
+  float cosine      = cosf(angle);
+  float sine        = sinf(angle);
+  float halfWidth   = w * scale * 0.5f;
+  float halfHeight  = h * scale * 0.5f;
+  float xCenter     = x + halfWidth;
+  float yCenter     = y + halfHeight;
+  float xExtent     = fabsf(cosine) * halfWidth + fabsf(sine) * halfHeight;
+  float yExtent     = fabsf(sine) * halfWidth + fabsf(cosine) * halfHeight;
+
+  Rect clip   = video->clipRect;
+  int xStart  = MAX((int)FLOOR(xCenter - xExtent), clip.left);
+  int xEnd    = MIN((int)FLOOR(xCenter + xExtent) + 1, clip.right);
+  int yStart  = MAX((int)FLOOR(yCenter - yExtent), clip.top);
+  int yEnd    = MIN((int)FLOOR(yCenter + yExtent) + 1, clip.bottom);
+
+  if (xStart >= xEnd || yStart >= yEnd)
+    return;
+
+  // Source space steps for one destination pixel along x and along y.
+  float uStep     = cosine / scale;
+  float vStep     = -sine / scale;
+  float uRowStep  = sine / scale;
+  float vRowStep  = cosine / scale;
+
+  float xRelative = xStart + 0.5f - xCenter;
+  float yRelative = yStart + 0.5f - yCenter;
+  float uRow      = xRelative * uStep + yRelative * uRowStep + w * 0.5f;
+  float vRow      = xRelative * vStep + yRelative * vRowStep + h * 0.5f;
+
+  int uFixedStep  = (int)(uStep * 65536.0f);
+  int vFixedStep  = (int)(vStep * 65536.0f);
+  unsigned uLimit = (unsigned)w << 16;
+  unsigned vLimit = (unsigned)h << 16;
+  bool xFlip      = CHECK_BIT(flip, 1);
+  bool yFlip      = CHECK_BIT(flip, 2);
+
+  for (int yDest = yStart; yDest < yEnd; yDest++, uRow += uRowStep, vRow += vRowStep)
+  {
+    // Solve for the run of pixels where 0 <= u < w and 0 <= v < h.
+    float tMin = 0;
+    float tMax = (float)(xEnd - xStart);
+
+    if (uStep != 0)
+    {
+      float t0 = -uRow / uStep, t1 = (w - uRow) / uStep;
+      tMin = MAX(tMin, MIN(t0, t1));
+      tMax = MIN(tMax, MAX(t0, t1));
+    }
+    else if (uRow < 0 || uRow >= w)
+      continue;
+
+    if (vStep != 0)
+    {
+      float t0 = -vRow / vStep, t1 = (h - vRow) / vStep;
+      tMin = MAX(tMin, MIN(t0, t1));
+      tMax = MIN(tMax, MAX(t0, t1));
+    }
+    else if (vRow < 0 || vRow >= h)
+      continue;
+
+    int runStart  = (int)FLOOR(tMin);
+    int runEnd    = MIN((int)FLOOR(tMax) + 1, xEnd - xStart);
+
+    int u = (int)((uRow + runStart * uStep) * 65536.0f);
+    int v = (int)((vRow + runStart * vStep) * 65536.0f);
+    uint32_t *pixel = &video->target.pixels[TARGET_POS(video, xStart, yDest)] + runStart;
+
+    for (int i = runStart; i < runEnd; i++, pixel++, u += uFixedStep, v += vFixedStep)
+    {
+      // The run is solved in floating point, so the edges are still bounds checked.
+      if ((unsigned)u >= uLimit || (unsigned)v >= vLimit)
+        continue;
+
+      int xSource = u >> 16;
+      int ySource = v >> 16;
+
+      if (xFlip)
+        xSource = w - 1 - xSource;
+      if (yFlip)
+        ySource = h - 1 - ySource;
+
+      uint32_t source = buffer[ySource * pitch + xSource];
+
+      if (source != video->colorKey)
+      {
+        BLEND(source, color);
+        *pixel = source;
+      }
+    }
+  }
+}
+
+void drawRotatedSprite(Video *video, Bitmap *bmp, int index, int x, int y, int w, int h, float angle, float scale, uint8_t flip, uint32_t color)
+{
+  int numRows     = bmp->height / SPRITE_SIZE;
+  int numColumns  = bmp->width / SPRITE_SIZE;
+
+  // Bitmaps smaller than a sprite have no sprites in them.
+  if (numRows == 0 || numColumns == 0)
+    return;
+
+  int row         = FLOOR(index / numColumns);
+  int column      = FLOOR(index % numColumns);
+
+  w = CLAMP(w, 1, numColumns - column);
+  h = CLAMP(h, 1, numRows - row);
+
+  __drawRotatedBuffer(video, BUFFER_CHUNK(bmp, row, column), x, y, w * SPRITE_SIZE, h * SPRITE_SIZE, bmp->width, angle, scale, flip, color);
+}
+
+// Power of two sources wrap with a mask. Unsigned fixed point overflows in multiples of the size, so the walk never needs rewrapping.
+static void __drawMode7MaskedRow(uint32_t *dest, int length, Bitmap *bmp, uint32_t colorKey, float u, float v, float uStep, float vStep)
+{
+  u = fmodf(u, (float)bmp->width);
+  v = fmodf(v, (float)bmp->height);
+  u += u < 0 ? bmp->width : 0;
+  v += v < 0 ? bmp->height : 0;
+
+  uint32_t uFixed     = (uint32_t)(u * 65536.0f);
+  uint32_t vFixed     = (uint32_t)(v * 65536.0f);
+  uint32_t uFixedStep = (uint32_t)(int32_t)(uStep * 65536.0f);
+  uint32_t vFixedStep = (uint32_t)(int32_t)(vStep * 65536.0f);
+  uint32_t uMask      = (uint32_t)bmp->width - 1;
+  uint32_t vMask      = (uint32_t)bmp->height - 1;
+  int i               = 0;
+
+#ifdef MILK_AVX2
+  int pitchShift = 0;
+  while ((1 << pitchShift) < bmp->width)
+    pitchShift++;
+
+  __m256i lanes     = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+  __m256i uVector   = _mm256_add_epi32(_mm256_set1_epi32((int)uFixed), _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int)uFixedStep)));
+  __m256i vVector   = _mm256_add_epi32(_mm256_set1_epi32((int)vFixed), _mm256_mullo_epi32(lanes, _mm256_set1_epi32((int)vFixedStep)));
+  __m256i uStride   = _mm256_set1_epi32((int)(uFixedStep * 8));
+  __m256i vStride   = _mm256_set1_epi32((int)(vFixedStep * 8));
+  __m256i uMasks    = _mm256_set1_epi32((int)uMask);
+  __m256i vMasks    = _mm256_set1_epi32((int)vMask);
+  __m256i keys      = _mm256_set1_epi32((int)colorKey);
+  __m128i shift     = _mm_cvtsi32_si128(pitchShift);
+
+  for (; i + 8 <= length; i += 8)
+  {
+    __m256i xSource = _mm256_and_si256(_mm256_srli_epi32(uVector, 16), uMasks);
+    __m256i ySource = _mm256_and_si256(_mm256_srli_epi32(vVector, 16), vMasks);
+    __m256i indices = _mm256_add_epi32(_mm256_sll_epi32(ySource, shift), xSource);
+    __m256i texels  = _mm256_i32gather_epi32((const int *)bmp->pixels, indices, 4);
+    __m256i keyed   = _mm256_cmpeq_epi32(texels, keys);
+    __m256i current = _mm256_loadu_si256((__m256i *)(dest + i));
+
+    _mm256_storeu_si256((__m256i *)(dest + i), _mm256_blendv_epi8(texels, current, keyed));
+    uVector = _mm256_add_epi32(uVector, uStride);
+    vVector = _mm256_add_epi32(vVector, vStride);
+  }
+
+  uFixed += uFixedStep * (uint32_t)i;
+  vFixed += vFixedStep * (uint32_t)i;
+#endif
+
+  for (; i < length; i++, uFixed += uFixedStep, vFixed += vFixedStep)
+  {
+    uint32_t pixel = bmp->pixels[((vFixed >> 16) & vMask) * bmp->width + ((uFixed >> 16) & uMask)];
+
+    if (pixel != colorKey)
+      dest[i] = pixel;
+  }
+}
+
+static void __drawMode7Row(uint32_t *dest, int length, Bitmap *bmp, uint32_t colorKey, float u, float v, float uStep, float vStep, bool wrap)
+{
+  if (wrap)
+  {
+    u = fmodf(u, (float)bmp->width);
+    v = fmodf(v, (float)bmp->height);
+  }
+
+  int64_t uFixed      = (int64_t)(u * 65536.0);
+  int64_t vFixed      = (int64_t)(v * 65536.0);
+  int64_t uFixedStep  = (int64_t)(uStep * 65536.0);
+  int64_t vFixedStep  = (int64_t)(vStep * 65536.0);
+
+  for (int i = 0; i < length; i++, uFixed += uFixedStep, vFixed += vFixedStep)
+  {
+    int xSource = (int)(uFixed >> 16);
+    int ySource = (int)(vFixed >> 16);
+
+    if (wrap)
+    {
+      xSource %= bmp->width;
+      ySource %= bmp->height;
+      xSource += xSource < 0 ? bmp->width : 0;
+      ySource += ySource < 0 ? bmp->height : 0;
+    }
+    else
+    {
+      xSource = CLAMP(xSource, 0, bmp->width - 1);
+      ySource = CLAMP(ySource, 0, bmp->height - 1);
+    }
+
+    uint32_t pixel = bmp->pixels[ySource * bmp->width + xSource];
+
+    if (pixel != colorKey)
+      dest[i] = pixel;
+  }
+}
+
+void drawMode7(Video *video, Bitmap *bmp, int y, const Mode7Line *lines, int numLines, bool wrap)
+{
+  Rect clip   = video->clipRect;
+  int yStart  = MAX(y, clip.top);
+  int yEnd    = MIN(y + numLines, clip.bottom);
+  int length  = clip.right - clip.left;
+  bool masked = wrap && IS_POWER_OF_TWO(bmp->width) && IS_POWER_OF_TWO(bmp->height);
+
+  if (length <= 0)
+    return;
+
+  for (int yDest = yStart; yDest < yEnd; yDest++)
+  {
+    const Mode7Line *line = &lines[yDest - y];
+    uint32_t *dest = &video->target.pixels[TARGET_POS(video, clip.left, yDest)];
+    float u = line->u + line->uStep * clip.left;
+    float v = line->v + line->vStep * clip.left;
+
+    if (masked)
+      __drawMode7MaskedRow(dest, length, bmp, video->colorKey, u, v, line->uStep, line->vStep);
+    else
+      __drawMode7Row(dest, length, bmp, video->colorKey, u, v, line->uStep, line->vStep, wrap);
+  }
+}
+
 #define IS_ASCII(c) (0 < c)
 
 void drawFont(Video *video, Bitmap *bmp, int x, int y, const char *text, int scale, uint32_t color)
@@ -245,7 +855,7 @@ void drawFont(Video *video, Bitmap *bmp, int x, int y, const char *text, int sca
         int row = FLOOR((curr - 33) / numColumns);
         int col = FLOOR((curr - 33) % numColumns);
 
-        __drawBuffer(video, BUFFER_CHUNK(bmp, row, col), xCurrent, yCurrent, SPRITE_SIZE, SPRITE_SIZE, bitmap.width, scale, 0, color);
+        __drawBuffer(video, BUFFER_CHUNK(&bitmap, row, col), xCurrent, yCurrent, SPRITE_SIZE, SPRITE_SIZE, bitmap.width, scale, 0, color);
 
         xCurrent += SPRITE_SIZE * scale;
       }
@@ -308,7 +918,7 @@ void drawWrappedFont(Video *video, Bitmap *bmp, int x, int y, int w, const char
         int row = FLOOR((c - 33) / numColumns);
         int col = FLOOR((c - 33) % numColumns);
 
-        __drawBuffer(video, BUFFER_CHUNK(bmp, row, col), xCurrent, yCurrent, SPRITE_SIZE, SPRITE_SIZE, bitmap.width, scale, 0, color);
+        __drawBuffer(video, BUFFER_CHUNK(&bitmap, row, col), xCurrent, yCurrent, SPRITE_SIZE, SPRITE_SIZE, bitmap.width, scale, 0, color);
 
         xCurrent += SPRITE_SIZE * scale;
       }
@@ -348,3 +958,219 @@ int getFontWidth(const char *text)
   }
   return width;
 }
+
+/**
+ * Lighting happens in two stages. Lights accumulate additively into a low resolution light map, each
+ * one only touching the texels under its bounds, with falloff looked up from a shared table instead of
+ * computed per texel. The light map is then upsampled one scanline at a time and multiplied over the
+ * framebuffer in a single pass, so the cost of the blend does not depend on how many lights there are.
+ */
+
+#define LIGHT_FALLOFF_STEPS 256
+#define LIGHT_MAX           256
+
+static uint8_t lightFalloff[LIGHT_FALLOFF_STEPS];
+
+// Indexed by squared distance over squared radius, so texels never need a square root.
+static void __initLightFalloff()
+{
+  if (lightFalloff[0] != 0)
+    return;
+
+  for (int i = 0; i < LIGHT_FALLOFF_STEPS; i++)
+  {
+    float inverse = 1.0f - (float)i / (LIGHT_FALLOFF_STEPS - 1);
+    lightFalloff[i] = (uint8_t)(255.0f * inverse * inverse + 0.5f);
+  }
+}
+
+void clearLights(Video *video, uint32_t ambient)
+{
+  __initLightFalloff();
+
+  uint16_t *texel = video->lightmap;
+
+  for (int i = 0; i < LIGHTMAP_WIDTH * LIGHTMAP_HEIGHT; i++)
+  {
+    *texel++ = R_COMP(ambient);
+    *texel++ = G_COMP(ambient);
+    *texel++ = B_COMP(ambient);
+  }
+}
+
+typedef struct
+{
+  float xDirection;
+  float yDirection;
+  float spreadCosine;
+} Cone;
+
+static bool __insideCone(const Cone *cone, float xDistance, float yDistance, int distanceSquared)
+{
+  float dot = xDistance * cone->xDirection + yDistance * cone->yDirection;
+  float boundary = cone->spreadCosine * cone->spreadCosine * distanceSquared;
+
+  // Compare squares to avoid normalizing, which means the sign of each side has to be checked separately.
+  return cone->spreadCosine >= 0
+    ? dot >= 0 && dot * dot >= boundary
+    : dot >= 0 || dot * dot <= boundary;
+}
+
+static void __accumulateLight(Video *video, int x, int y, int radius, uint32_t color, const Cone *cone)
+{
+  if (radius <= 0)
+    return;
+
+  // Light positions are in framebuffer space, texel centers sit in the middle of each LIGHTMAP_SCALE block.
+  float xCenter = (float)x / LIGHTMAP_SCALE - 0.5f;
+  float yCenter = (float)y / LIGHTMAP_SCALE - 0.5f;
+  float texelRadius = (float)radius / LIGHTMAP_SCALE;
+
+  int xStart  = MAX((int)FLOOR(xCenter - texelRadius), 0);
+  int xEnd    = MIN((int)FLOOR(xCenter + texelRadius) + 1, LIGHTMAP_WIDTH);
+  int yStart  = MAX((int)FLOOR(yCenter - texelRadius), 0);
+  int yEnd    = MIN((int)FLOOR(yCenter + texelRadius) + 1, LIGHTMAP_HEIGHT);
+
+  if (xStart >= xEnd || yStart >= yEnd)
+    return;
+
+  // Distances are measured in 1/16 texels so that small lights still have a smooth falloff.
+  int radiusSquared = (int)(texelRadius * 16 * texelRadius * 16);
+  if (radiusSquared <= 0)
+    return;
+
+  int falloffScale = (int)(((int64_t)(LIGHT_FALLOFF_STEPS - 1) << 16) / radiusSquared);
+  int red   = R_COMP(color);
+  int green = G_COMP(color);
+  int blue  = B_COMP(color);
+
+  for (int ty = yStart; ty < yEnd; ty++)
+  {
+    float yDistance = (ty - yCenter) * 16;
+    uint16_t *texel = &video->lightmap[(ty * LIGHTMAP_WIDTH + xStart) * 3];
+
+    for (int tx = xStart; tx < xEnd; tx++, texel += 3)
+    {
+      float xDistance = (tx - xCenter) * 16;
+      int distanceSquared = (int)(xDistance * xDistance + yDistance * yDistance);
+
+      if (distanceSquared >= radiusSquared)
+        continue;
+
+      if (cone && !__insideCone(cone, xDistance, yDistance, distanceSquared))
+        continue;
+
+      int intensity = lightFalloff[((int64_t)distanceSquared * falloffScale) >> 16];
+
+      texel[0] = MIN(texel[0] + ((red * intensity) >> 8), LIGHT_MAX);
+      texel[1] = MIN(texel[1] + ((green * intensity) >> 8), LIGHT_MAX);
+      texel[2] = MIN(texel[2] + ((blue * intensity) >> 8), LIGHT_MAX);
+    }
+  }
+}
+
+void addLight(Video *video, int x, int y, int radius, uint32_t color)
+{
+  __accumulateLight(video, x, y, radius, color, NULL);
+}
+
+void addConeLight(Video *video, int x, int y, int radius, float angle, float spread, uint32_t color)
+{
+  Cone cone = {
+    .xDirection   = cosf(angle),
+    .yDirection   = sinf(angle),
+    .spreadCosine = cosf(CLAMP(spread, 0.0f, 3.14159265f))
+  };
+
+  __accumulateLight(video, x, y, radius, color, &cone);
+}
+
+// Full brightness is 256, so that a fully lit pixel keeps its exact color through the multiply.
+#define LIGHT_LEVEL(value) ((value) + ((value) >> 7))
+
+/**
+ * Expands one framebuffer row worth of light, bilinearly filtered, into 16 bit B, G, R, A lanes.
+ * Lanes are laid out the same as the bytes of a pixel in memory, so the blend can multiply them straight across.
+ */
+static void __upsampleLightRow(Video *video, int y, uint16_t *lightRow)
+{
+  uint16_t blended[LIGHTMAP_WIDTH * 3];
+
+  int yFixed  = CLAMP(((y * 2 + 1) * 128) / LIGHTMAP_SCALE - 128, 0, (LIGHTMAP_HEIGHT - 1) * 256);
+  int yTexel  = MIN(yFixed >> 8, LIGHTMAP_HEIGHT - 2);
+  int yWeight = yFixed - yTexel * 256;
+  const uint16_t *top = &video->lightmap[yTexel * LIGHTMAP_WIDTH * 3];
+  const uint16_t *bottom = top + LIGHTMAP_WIDTH * 3;
+
+  for (int i = 0; i < LIGHTMAP_WIDTH * 3; i++)
+    blended[i] = (uint16_t)((top[i] * (256 - yWeight) + bottom[i] * yWeight) >> 8);
+
+  for (int x = 0; x < FRAMEBUFFER_WIDTH; x++, lightRow += 4)
+  {
+    int xFixed  = CLAMP(((x * 2 + 1) * 128) / LIGHTMAP_SCALE - 128, 0, (LIGHTMAP_WIDTH - 1) * 256);
+    int xTexel  = MIN(xFixed >> 8, LIGHTMAP_WIDTH - 2);
+    int xWeight = xFixed - xTexel * 256;
+    const uint16_t *left = &blended[xTexel * 3];
+    const uint16_t *right = left + 3;
+
+    int red   = (left[0] * (256 - xWeight) + right[0] * xWeight) >> 8;
+    int green = (left[1] * (256 - xWeight) + right[1] * xWeight) >> 8;
+    int blue  = (left[2] * (256 - xWeight) + right[2] * xWeight) >> 8;
+
+    lightRow[0] = LIGHT_LEVEL(MIN(blue, 255));
+    lightRow[1] = LIGHT_LEVEL(MIN(green, 255));
+    lightRow[2] = LIGHT_LEVEL(MIN(red, 255));
+    lightRow[3] = LIGHT_MAX;
+  }
+}
+
+static void __multiplyRow(uint32_t *pixels, const uint16_t *lightRow, int length)
+{
+  int i = 0;
+
+#ifdef MILK_SSE2
+  __m128i zero = _mm_setzero_si128();
+
+  for (; i + 4 <= length; i += 4)
+  {
+    __m128i source  = _mm_loadu_si128((__m128i *)(pixels + i));
+    __m128i low     = _mm_unpacklo_epi8(source, zero);
+    __m128i high    = _mm_unpackhi_epi8(source, zero);
+
+    low   = _mm_srli_epi16(_mm_mullo_epi16(low, _mm_loadu_si128((__m128i *)(lightRow + i * 4))), 8);
+    high  = _mm_srli_epi16(_mm_mullo_epi16(high, _mm_loadu_si128((__m128i *)(lightRow + i * 4 + 8))), 8);
+
+    _mm_storeu_si128((__m128i *)(pixels + i), _mm_packus_epi16(low, high));
+  }
+#endif
+
+  for (; i < length; i++)
+  {
+    uint32_t pixel = pixels[i];
+    const uint16_t *light = &lightRow[i * 4];
+
+    pixels[i] = ((((pixel >> 24) & 0xff) * light[3] >> 8) << 24)
+      | ((((pixel >> 16) & 0xff) * light[2] >> 8) << 16)
+      | ((((pixel >> 8) & 0xff) * light[1] >> 8) << 8)
+      | (((pixel & 0xff) * light[0]) >> 8);
+  }
+}
+
+/**
+ * The light map covers the screen, so the pass only applies when the framebuffer is the draw target, and does nothing
+ * while a canvas is. Only the clip rect is lit, so clipping around a HUD keeps it out of the pass.
+ */
+void applyLights(Video *video)
+{
+  Rect clip = video->clipRect;
+  uint16_t lightRow[FRAMEBUFFER_WIDTH * 4];
+
+  if (video->target.pixels != video->framebuffer || clip.left >= clip.right)
+    return;
+
+  for (int y = clip.top; y < clip.bottom; y++)
+  {
+    __upsampleLightRow(video, y, lightRow);
+    __multiplyRow(&video->framebuffer[y * FRAMEBUFFER_WIDTH + clip.left], lightRow + clip.left * 4, clip.right - clip.left);
+  }
+}
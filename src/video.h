@@ -1,6 +1,7 @@
 #ifndef __VIDEO_H__
 #define __VIDEO_H__
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -11,6 +12,10 @@
 #define FRAMEBUFFER_HEIGHT 216
 #define SPRITE_SIZE 8
 #define FONT_SPRITE_SPACING 6
+#define MAX_POLYGON_POINTS 256
+#define LIGHTMAP_SCALE 4
+#define LIGHTMAP_WIDTH (FRAMEBUFFER_WIDTH / LIGHTMAP_SCALE)
+#define LIGHTMAP_HEIGHT (FRAMEBUFFER_HEIGHT / LIGHTMAP_SCALE)
 
 typedef struct
 {
@@ -20,24 +25,67 @@ typedef struct
   int right;
 } Rect;
 
+/**
+ * One row of a mode 7 plane: the source position that lands on the leftmost pixel of the scanline,
+ * and how far the source moves for every pixel to the right.
+ */
+typedef struct
+{
+  float u;
+  float v;
+  float uStep;
+  float vStep;
+} Mode7Line;
+
+/**
+ * One sprite of a batch: everything drawSprite takes that can change from sprite to sprite, short of scale.
+ */
+typedef struct
+{
+  int index;
+  int x;
+  int y;
+  uint8_t flip;
+  uint32_t color;
+} SpriteRecord;
+
 typedef struct
 {
   uint32_t framebuffer[FRAMEBUFFER_WIDTH * FRAMEBUFFER_HEIGHT];
+  uint16_t lightmap[LIGHTMAP_WIDTH * LIGHTMAP_HEIGHT * 3];
+  Bitmap target;
   uint32_t colorKey;
   Rect clipRect;
 } Video;
 
 void initializeVideo(Video *video);
 void resetDrawState(Video *video);
+void setDrawTarget(Video *video, Bitmap *bmp);
+bool isDrawTarget(Video *video, Bitmap *bmp);
 void setClip(Video *video, int x, int y, int w, int h);
 void clearFramebuffer(Video *video, uint32_t color);
 void drawPixel(Video *video, int x, int y, uint32_t color);
 void drawLine(Video *video, int x0, int y0, int x1, int y1, uint32_t color);
 void drawRect(Video *video, int x, int y, int w, int h, uint32_t color);
 void drawFilledRect(Video *video, int x, int y, int w, int h, uint32_t color);
+void drawCircle(Video *video, int x, int y, int radius, uint32_t color);
+void drawFilledCircle(Video *video, int x, int y, int radius, uint32_t color);
+void drawEllipse(Video *video, int x, int y, int xRadius, int yRadius, uint32_t color);
+void drawFilledEllipse(Video *video, int x, int y, int xRadius, int yRadius, uint32_t color);
+void drawTriangle(Video *video, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void drawFilledTriangle(Video *video, int x0, int y0, int x1, int y1, int x2, int y2, uint32_t color);
+void drawPolygon(Video *video, const int *points, int numPoints, uint32_t color);
+void drawFilledPolygon(Video *video, const int *points, int numPoints, uint32_t color);
 void drawSprite(Video *video, Bitmap *bmp, int index, int x, int y, int w, int h, float scale, uint8_t flip, uint32_t color);
+void drawSprites(Video *video, Bitmap *bmp, const SpriteRecord *sprites, int numSprites, int w, int h);
+void drawRotatedSprite(Video *video, Bitmap *bmp, int index, int x, int y, int w, int h, float angle, float scale, uint8_t flip, uint32_t color);
+void drawMode7(Video *video, Bitmap *bmp, int y, const Mode7Line *lines, int numLines, bool wrap);
 void drawFont(Video *video, Bitmap *bmp, int x, int y, const char *text, int scale, uint32_t color);
 void drawWrappedFont(Video *video, Bitmap *bmp, int x, int y, int w, const char *text, int scale, uint32_t color);
 int getFontWidth(const char *text);
+void clearLights(Video *video, uint32_t ambient);
+void addLight(Video *video, int x, int y, int radius, uint32_t color);
+void addConeLight(Video *video, int x, int y, int radius, float angle, float spread, uint32_t color);
+void applyLights(Video *video);
 
 #endif
@@ -1,168 +1,639 @@
+#include <SDL_mutex.h>
+#include <SDL_thread.h>
 #include <stdint.h>
+#include <string.h>
 
 #include "audio.h"
 #include "common.h"
+#include "platform.h"
 #include "wave.h"
 
-#define RIFF_MARKER_LE    0x46464952   // "RIFF"
-#define WAVE_MARKER_LE    0x45564157   // "WAVE"
-#define FORMAT_MARKER_LE  0x20746d66 // "fmt0"
-#define DATA_MARKER_LE    0x61746164   // "data"
+#if defined(MILK_SSE2)
+#include <emmintrin.h>
+#endif
+
+#define RIFF_MARKER_LE    0x46464952 // "RIFF"
+#define WAVE_MARKER_LE    0x45564157 // "WAVE"
+#define FORMAT_MARKER_LE  0x20746d66 // "fmt "
+#define DATA_MARKER_LE    0x61746164 // "data"
+#define FACT_MARKER_LE    0x74636166 // "fact"
+
+#define RIFF_HEADER_SIZE    12
+#define CHUNK_HEADER_SIZE   8
+#define FORMAT_CHUNK_SIZE   16
+#define EXTENSIBLE_SIZE     26
+
+#define PCM         0x0001
+#define IEEE_FLOAT  0x0003
+#define IMA_ADPCM   0x0011
+#define EXTENSIBLE  0xfffe
+
+#define ADPCM_FORMAT_SIZE       20
+#define ADPCM_BITS_PER_SAMPLE   4
+#define ADPCM_HEADER_SIZE(channels)  (4 * (channels))
+#define ADPCM_MAX_STEP_INDEX    88
 
-#define PCM     1
 #define MONO    1
 #define STEREO  2
 
-#define VALID_RIFF_MARKER(header)         (header == RIFF_MARKER_LE)
-#define VALID_WAVE_MARKER(header)         (header == WAVE_MARKER_LE)
-#define VALID_FORMAT_MARKER(header)       (header == FORMAT_MARKER_LE)
-#define VALID_DATA_MARKER(header)         (header == DATA_MARKER_LE)
-#define VALID_FORMAT_TYPE(format)         (format == PCM)
 #define VALID_CHANNEL_COUNT(channelCount) (channelCount == MONO || channelCount == STEREO)
-#define VALID_SAMPLE_SIZE(size)           (size == AUDIO_BITS_PER_SAMPLE)
+#define VALID_PCM_SIZE(bits)              (bits == 8 || bits == 16 || bits == 24 || bits == 32)
+#define VALID_FLOAT_SIZE(bits)            (bits == 32)
+#define VALID_ADPCM_BLOCK(info)           ((info)->bitsPerSample == ADPCM_BITS_PER_SAMPLE && (info)->blockAlign > ADPCM_HEADER_SIZE((info)->channels)\
+                                            && (info)->blockAlign % ADPCM_HEADER_SIZE((info)->channels) == 0)
 
 typedef struct
 {
-  uint32_t riff;
-  uint32_t fileSize;
-  uint32_t wave;
-} RiffChunk;
-
-typedef struct
-{
-  uint32_t marker;
-  uint32_t size;
   uint16_t type;
   uint16_t channels;
   uint32_t sampleRate;
-  uint32_t byteRate;
-  uint16_t blockAlign;
   uint16_t bitsPerSample;
-} FormatChunk;
+  uint16_t blockAlign;
+  uint16_t samplesPerBlock;
+  uint32_t factFrames;
+  const uint8_t *data;
+  uint32_t dataSize;
+} WaveInfo;
 
-typedef struct
+static uint16_t __readU16(const uint8_t *bytes)
 {
-  uint32_t marker;
-  uint32_t size;
-} DataChunk;
+  return (uint16_t)(bytes[0] | bytes[1] << 8);
+}
 
-typedef struct
+static uint32_t __readU32(const uint8_t *bytes)
+{
+  return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 | (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+/**
+ * Walks the RIFF chunk list rather than assuming a fixed 44 byte header, so files carrying LIST, fact, cue etc. load fine.
+ * A data chunk that claims more than the file holds (common with files written by crashed or streaming recorders) is truncated.
+ */
+static bool __parseWave(WaveInfo *info, const uint8_t *file, size_t fileSize)
+{
+  bool hasFormat = false;
+  bool hasData = false;
+  size_t position = RIFF_HEADER_SIZE;
+
+  memset(info, 0, sizeof(WaveInfo));
+
+  if (fileSize < RIFF_HEADER_SIZE || __readU32(file) != RIFF_MARKER_LE || __readU32(file + 8) != WAVE_MARKER_LE)
+    return false;
+
+  while (position + CHUNK_HEADER_SIZE <= fileSize)
+  {
+    uint32_t marker = __readU32(file + position);
+    size_t chunkSize = __readU32(file + position + 4);
+    const uint8_t *chunk = file + position + CHUNK_HEADER_SIZE;
+    size_t available = fileSize - position - CHUNK_HEADER_SIZE;
+
+    if (marker == FORMAT_MARKER_LE && chunkSize >= FORMAT_CHUNK_SIZE && chunkSize <= available)
+    {
+      info->type = __readU16(chunk);
+      info->channels = __readU16(chunk + 2);
+      info->sampleRate = __readU32(chunk + 4);
+      info->blockAlign = __readU16(chunk + 12);
+      info->bitsPerSample = __readU16(chunk + 14);
+
+      if (info->type == IMA_ADPCM && chunkSize >= ADPCM_FORMAT_SIZE)
+        info->samplesPerBlock = __readU16(chunk + 18);
+
+      // WAVE_FORMAT_EXTENSIBLE keeps the real format tag at the start of the sub-format GUID.
+      if (info->type == EXTENSIBLE && chunkSize >= EXTENSIBLE_SIZE)
+        info->type = __readU16(chunk + 24);
+
+      hasFormat = true;
+    }
+    else if (marker == FACT_MARKER_LE && chunkSize >= 4 && chunkSize <= available)
+      info->factFrames = __readU32(chunk);
+    else if (marker == DATA_MARKER_LE && !hasData)
+    {
+      info->data = chunk;
+      info->dataSize = (uint32_t)MIN(chunkSize, available);
+      hasData = true;
+    }
+
+    if (chunkSize > available)
+      break;
+
+    position += CHUNK_HEADER_SIZE + chunkSize + (chunkSize & 1);
+  }
+
+  if (!hasFormat || !hasData || !VALID_CHANNEL_COUNT(info->channels) || info->sampleRate == 0)
+    return false;
+
+  return (info->type == PCM && VALID_PCM_SIZE(info->bitsPerSample))
+    || (info->type == IEEE_FLOAT && VALID_FLOAT_SIZE(info->bitsPerSample))
+    || (info->type == IMA_ADPCM && VALID_ADPCM_BLOCK(info));
+}
+
+static void __convertU8(int16_t *dest, const uint8_t *src, int count)
+{
+  int i = 0;
+
+#if defined(MILK_SSE2)
+  const __m128i signBit = _mm_set1_epi8((char)0x80);
+  const __m128i zero = _mm_setzero_si128();
+
+  for (; i + 16 <= count; i += 16)
+  {
+    // Flipping the top bit recenters unsigned 8 bit samples, and unpacking into the high byte scales them to 16 bits.
+    __m128i bytes = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&src[i]), signBit);
+    _mm_storeu_si128((__m128i *)&dest[i], _mm_unpacklo_epi8(zero, bytes));
+    _mm_storeu_si128((__m128i *)&dest[i + 8], _mm_unpackhi_epi8(zero, bytes));
+  }
+#endif
+
+  for (; i < count; i++)
+    dest[i] = (int16_t)((src[i] - 128) * 256);
+}
+
+static void __convertS24(int16_t *dest, const uint8_t *src, int count)
+{
+  for (int i = 0; i < count; i++)
+    dest[i] = (int16_t)__readU16(&src[i * 3 + 1]);
+}
+
+static void __convertS32(int16_t *dest, const uint8_t *src, int count)
 {
-  RiffChunk riff;
-  FormatChunk format;
-  DataChunk data;
-} WavHeader;
+  int i = 0;
 
-static bool __readHeader(WavHeader *header, FILE *file)
+#if defined(MILK_SSE2)
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128i low = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)&src[i * 4]), 16);
+    __m128i high = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)&src[i * 4 + 16]), 16);
+    _mm_storeu_si128((__m128i *)&dest[i], _mm_packs_epi32(low, high));
+  }
+#endif
+
+  for (; i < count; i++)
+    dest[i] = (int16_t)__readU16(&src[i * 4 + 2]);
+}
+
+static void __convertF32(int16_t *dest, const uint8_t *src, int count)
+{
+  int i = 0;
+
+#if defined(MILK_SSE2)
+  const __m128 scale = _mm_set1_ps(32768.0f);
+  const __m128 upper = _mm_set1_ps(32767.0f);
+  const __m128 lower = _mm_set1_ps(-32768.0f);
+
+  for (; i + 8 <= count; i += 8)
+  {
+    __m128 low = _mm_mul_ps(_mm_loadu_ps((const float *)&src[i * 4]), scale);
+    __m128 high = _mm_mul_ps(_mm_loadu_ps((const float *)&src[i * 4 + 16]), scale);
+    low = _mm_max_ps(_mm_min_ps(low, upper), lower);
+    high = _mm_max_ps(_mm_min_ps(high, upper), lower);
+    _mm_storeu_si128((__m128i *)&dest[i], _mm_packs_epi32(_mm_cvtps_epi32(low), _mm_cvtps_epi32(high)));
+  }
+#endif
+
+  for (; i < count; i++)
+  {
+    float sample;
+    memcpy(&sample, &src[i * 4], sizeof(float));
+    dest[i] = (int16_t)lrintf(CLAMP(sample * 32768.0f, -32768.0f, 32767.0f));
+  }
+}
+
+static void __convertSamples(int16_t *dest, const WaveInfo *info, int count)
+{
+  if (info->type == IEEE_FLOAT)
+    __convertF32(dest, info->data, count);
+  else if (info->bitsPerSample == 8)
+    __convertU8(dest, info->data, count);
+  else if (info->bitsPerSample == 16)
+    memcpy(dest, info->data, (size_t)count * sizeof(int16_t));
+  else if (info->bitsPerSample == 24)
+    __convertS24(dest, info->data, count);
+  else
+    __convertS32(dest, info->data, count);
+}
+
+/**
+ * IMA ADPCM waves are kept compressed in the mapping, at 4 bits per sample, and decoded by the mixer as voices play.
+ * Each block starts with a 4 byte header per channel holding the first sample and step index; the rest are nibbles,
+ * interleaved per channel in groups of 8 samples (4 bytes). Blocks decode independently, which makes seeking cheap.
+ */
+
+static const int adpcmSteps[ADPCM_MAX_STEP_INDEX + 1] =
+{
+  7, 8, 9, 10, 11, 12, 13, 14, 16, 17, 19, 21, 23, 25, 28, 31, 34, 37, 41, 45, 50, 55, 60, 66, 73, 80, 88, 97, 107, 118,
+  130, 143, 157, 173, 190, 209, 230, 253, 279, 307, 337, 371, 408, 449, 494, 544, 598, 658, 724, 796, 876, 963, 1060,
+  1166, 1282, 1411, 1552, 1707, 1878, 2066, 2272, 2499, 2749, 3024, 3327, 3660, 4026, 4428, 4871, 5358, 5894, 6484,
+  7132, 7845, 8630, 9493, 10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+static const int adpcmIndexAdjust[16] = { -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8 };
+
+static int __adpcmFramesIn(int bytes, int channelCount)
+{
+  int header = ADPCM_HEADER_SIZE(channelCount);
+  return bytes < header ? 0 : (bytes - header) / header * 8 + 1;
+}
+
+static void __initAdpcm(Wave *wave, const WaveInfo *info)
+{
+  int channelCount = info->channels;
+  int framesPerBlock = __adpcmFramesIn(info->blockAlign, channelCount);
+
+  if (info->samplesPerBlock > 0)
+    framesPerBlock = MIN(framesPerBlock, info->samplesPerBlock);
+
+  uint32_t fullBlocks = info->dataSize / info->blockAlign;
+  int lastBlockFrames = MIN(framesPerBlock, __adpcmFramesIn((int)(info->dataSize % info->blockAlign), channelCount));
+  int frameCount = (int)fullBlocks * framesPerBlock + lastBlockFrames;
+
+  if (info->factFrames > 0)
+    frameCount = MIN(frameCount, (int)info->factFrames);
+
+  wave->encoding = WAVE_IMA_ADPCM;
+  wave->blocks = info->data;
+  wave->blockSize = info->blockAlign;
+  wave->framesPerBlock = framesPerBlock;
+  wave->sampleCount = frameCount * channelCount;
+}
+
+void resetAdpcmDecoder(AdpcmDecoder *decoder)
 {
-  return fread(header, sizeof(WavHeader), 1, file) == 1 && VALID_FORMAT_TYPE(header->format.type)
-    && VALID_RIFF_MARKER(header->riff.riff) && VALID_WAVE_MARKER(header->riff.wave)
-    && VALID_FORMAT_MARKER(header->format.marker) && VALID_DATA_MARKER(header->data.marker)
-    && VALID_CHANNEL_COUNT(header->format.channels) && VALID_SAMPLE_SIZE(header->format.bitsPerSample);
+  memset(decoder, 0, sizeof(AdpcmDecoder));
 }
 
+static int __decodeNibble(AdpcmDecoder *decoder, int channel, int nibble)
+{
+  int step = adpcmSteps[decoder->stepIndex[channel]];
+  int difference = step >> 3;
+
+  if (nibble & 1) difference += step >> 2;
+  if (nibble & 2) difference += step >> 1;
+  if (nibble & 4) difference += step;
+
+  int predictor = decoder->predictor[channel] + ((nibble & 8) ? -difference : difference);
+  decoder->predictor[channel] = CLAMP(predictor, INT16_MIN, INT16_MAX);
+  decoder->stepIndex[channel] = CLAMP(decoder->stepIndex[channel] + adpcmIndexAdjust[nibble], 0, ADPCM_MAX_STEP_INDEX);
+  return decoder->predictor[channel];
+}
+
+/**
+ * Writes frames firstFrame to lastFrame, inclusive, into dest. Decoding is sequential, so firstFrame may be at most
+ * two frames behind where the previous call finished (those are kept in the history); anything earlier, or further
+ * ahead than the current block, restarts from the start of the block it falls in.
+ */
+void decodeAdpcm(const Wave *wave, AdpcmDecoder *decoder, int16_t *dest, int firstFrame, int lastFrame)
+{
+  int channelCount = wave->channelCount;
+  int framesPerBlock = wave->framesPerBlock;
+  int header = ADPCM_HEADER_SIZE(channelCount);
+
+  bool behind = firstFrame < decoder->frame - 2;
+  bool beyondBlock = firstFrame > decoder->frame && firstFrame / framesPerBlock != decoder->frame / framesPerBlock;
+
+  if (behind || beyondBlock)
+    decoder->frame = firstFrame / framesPerBlock * framesPerBlock;
+
+  for (int frame = firstFrame; frame < decoder->frame && frame <= lastFrame; frame++)
+  {
+    const int16_t *history = decoder->history + (2 - (decoder->frame - frame)) * channelCount;
+    memcpy(dest + (frame - firstFrame) * channelCount, history, channelCount * sizeof(int16_t));
+  }
+
+  for (; decoder->frame <= lastFrame; decoder->frame++)
+  {
+    const uint8_t *block = wave->blocks + (size_t)(decoder->frame / framesPerBlock) * wave->blockSize;
+    int index = decoder->frame % framesPerBlock;
+    int16_t decoded[2];
+
+    for (int channel = 0; channel < channelCount; channel++)
+    {
+      if (index == 0)
+      {
+        decoder->predictor[channel] = (int16_t)__readU16(block + channel * 4);
+        decoder->stepIndex[channel] = MIN(block[channel * 4 + 2], ADPCM_MAX_STEP_INDEX);
+        decoded[channel] = (int16_t)decoder->predictor[channel];
+      }
+      else
+      {
+        int sample = index - 1;
+        uint8_t byte = block[header + (sample / 8) * header + channel * 4 + (sample % 8) / 2];
+        decoded[channel] = (int16_t)__decodeNibble(decoder, channel, (sample & 1) ? byte >> 4 : byte & 0x0f);
+      }
+    }
+
+    memmove(decoder->history, decoder->history + channelCount, channelCount * sizeof(int16_t));
+    memcpy(decoder->history + channelCount, decoded, channelCount * sizeof(int16_t));
+
+    if (decoder->frame >= firstFrame)
+      memcpy(dest + (decoder->frame - firstFrame) * channelCount, decoded, channelCount * sizeof(int16_t));
+  }
+}
+
+/**
+ * Sounds are memory mapped. S16 data is used in place, so loading it costs a page table update instead of a copy;
+ * any other format is converted once, here, and the mapping dropped.
+ */
 Wave *loadWave(const char *filename)
 {
-  FILE *file = NULL;
-  WavHeader header;
+  size_t fileSize;
+  uint8_t *file = platform_mapFile(filename, &fileSize);
+  WaveInfo info;
 
-  if ((file = fopen(filename, "rb")) == NULL)
+  if (file == NULL)
     return NULL;
 
-  if (!__readHeader(&header, file))
+  if (!__parseWave(&info, file, fileSize))
   {
-    fclose(file);
+    platform_unmapFile(file, fileSize);
     return NULL;
   }
 
-  int sampleSize = header.format.channels * header.format.bitsPerSample / 8;
-  int sampleCount = (int)header.data.size / sampleSize;
-  int signalSize = sampleSize * sampleCount;
-  int16_t *samples = malloc((size_t)signalSize);
+  Wave *wave = calloc(1, sizeof(Wave));
+  wave->channelCount = info.channels;
+  wave->sampleRate = (int)info.sampleRate;
 
-  if (fread(samples, signalSize, 1, file) != 1)
+  if (info.type == IMA_ADPCM)
   {
-    free(samples);
-    fclose(file);
-    return NULL;
+    __initAdpcm(wave, &info);
+    wave->mapping = file;
+    wave->mappingSize = fileSize;
+    return wave;
+  }
+
+  int frameSize = info.channels * info.bitsPerSample / 8;
+  int sampleCount = (int)(info.dataSize / (uint32_t)frameSize) * info.channels;
+  wave->sampleCount = sampleCount;
+
+  if (info.type == PCM && info.bitsPerSample == 16 && ((uintptr_t)info.data & 1) == 0)
+  {
+    wave->samples = (int16_t *)info.data;
+    wave->mapping = file;
+    wave->mappingSize = fileSize;
+  }
+  else
+  {
+    wave->samples = malloc(MAX((size_t)sampleCount, 1) * sizeof(int16_t));
+    __convertSamples(wave->samples, &info, sampleCount);
+    platform_unmapFile(file, fileSize);
   }
 
-  Wave *wave = malloc(sizeof(Wave));
-  wave->samples = samples;
-  wave->sampleCount = (int)(signalSize / sizeof(int16_t));
-  wave->channelCount = header.format.channels;
-  fclose(file);
   return wave;
 }
 
 void freeWave(Wave *wave)
 {
-  free(wave->samples);
+  if (wave->mapping)
+    platform_unmapFile(wave->mapping, wave->mappingSize);
+  else
+    free(wave->samples);
+
   free(wave);
 }
 
+/**
+ * A single prefetch thread services every open stream. It wakes whenever the mixer consumes samples (or at least every
+ * PREFETCH_INTERVAL_MS), and tops each ring back up from disk, so the audio callback only ever copies from memory.
+ *
+ * Looping happens here too: the sample after the last one in the file is simply the first one again, written straight
+ * into the ring. Rewinds are requested by the mixer and acknowledged with the ring position at which the rewound data
+ * begins, so the mixer can skip anything that was prefetched before the request.
+ */
+
+#define RING_MASK             (WAVE_STREAM_BUFFER_SAMPLES - 1)
+#define PREFETCH_INTERVAL_MS  10
+
+static struct
+{
+  SDL_Thread *thread;
+  SDL_mutex *lock;
+  SDL_sem *wake;
+  SDL_atomic_t running;
+  WaveStream *streams;
+} prefetcher;
+
+static void __lockStreams()
+{
+  if (prefetcher.lock)
+    SDL_LockMutex(prefetcher.lock);
+}
+
+static void __unlockStreams()
+{
+  if (prefetcher.lock)
+    SDL_UnlockMutex(prefetcher.lock);
+}
+
 WaveStream *openWaveStream(const char *filename)
 {
+  size_t fileSize;
+  uint8_t *mapping = platform_mapFile(filename, &fileSize);
   FILE *file = NULL;
-  WavHeader header;
+  WaveInfo info;
 
-  if ((file = fopen(filename, "rb")) == NULL)
+  if (mapping == NULL)
     return NULL;
 
-  if (!__readHeader(&header, file))
+  // Streams are read straight off disk by the prefetcher, so only S16 is accepted. The mapping is just for the header.
+  bool valid = __parseWave(&info, mapping, fileSize) && info.type == PCM && info.bitsPerSample == 16;
+  long dataStart = valid ? (long)(info.data - mapping) : 0;
+  platform_unmapFile(mapping, fileSize);
+
+  if (!valid || (file = fopen(filename, "rb")) == NULL)
+    return NULL;
+
+  if (fseek(file, dataStart, SEEK_SET) != 0)
   {
     fclose(file);
     return NULL;
   }
 
-  uint32_t sampleSize = header.format.channels * header.format.bitsPerSample / 8;
-  uint32_t sampleCount = header.data.size / sampleSize;
-  uint32_t signalSize = sampleSize * sampleCount;
+  uint32_t frameSize = info.channels * sizeof(int16_t);
+  uint32_t signalSize = info.dataSize / frameSize * frameSize;
 
-  WaveStream *waveStream = malloc(sizeof(WaveStream));
+  WaveStream *waveStream = calloc(1, sizeof(WaveStream));
+  waveStream->ring = calloc(WAVE_STREAM_BUFFER_SAMPLES, sizeof(int16_t));
   waveStream->chunk = calloc(1, AUDIO_CHUNK_SIZE);
   waveStream->file = file;
-  waveStream->sampleCount = 0;
-  waveStream->channelCount = header.format.channels;
-  waveStream->start = ftell(file);
+  waveStream->channelCount = info.channels;
+  waveStream->start = dataStart;
   waveStream->end = waveStream->start + (long)signalSize;
+  waveStream->position = waveStream->start;
+
+  __lockStreams();
+  waveStream->next = prefetcher.streams;
+  prefetcher.streams = waveStream;
+  __unlockStreams();
   return waveStream;
 }
 
 void closeWaveStream(WaveStream *waveStream)
 {
+  __lockStreams();
+  WaveStream **link = &prefetcher.streams;
+  while (*link && *link != waveStream)
+    link = &(*link)->next;
+  if (*link)
+    *link = waveStream->next;
+  __unlockStreams();
+
   fclose(waveStream->file);
+  free(waveStream->ring);
   free(waveStream->chunk);
   free(waveStream);
 }
 
-bool readWaveStream(WaveStream *waveStream, int numSamples, bool loop)
+static void __seekStart(WaveStream *waveStream)
 {
-  long totalBytesRead = 0;
-  long requestedBytes = numSamples * (long)sizeof(int16_t);
-  long remainingBytes = waveStream->end - waveStream->position;
-  long bytesToRead = MIN(remainingBytes, requestedBytes);
+  fseek(waveStream->file, waveStream->start, SEEK_SET);
+  waveStream->position = waveStream->start;
+  waveStream->atEnd = false;
+}
 
-  fread(waveStream->chunk, (size_t)bytesToRead, 1, waveStream->file);
+static void __prefetch(WaveStream *waveStream)
+{
+  unsigned rewindRequests = (unsigned)SDL_AtomicGet(&waveStream->rewindRequests);
 
-  totalBytesRead += bytesToRead;
-  bool finished = ftell(waveStream->file) == waveStream->end;
+  // Everything written from here on belongs to the rewound stream. The mixer skips ahead to this position.
+  if (rewindRequests != waveStream->rewindsHandled)
+  {
+    __seekStart(waveStream);
+    SDL_AtomicSet(&waveStream->ended, 0);
+    SDL_AtomicSet(&waveStream->rewindPosition, SDL_AtomicGet(&waveStream->writePosition));
+    SDL_AtomicSet(&waveStream->rewindsCompleted, (int)rewindRequests);
+    waveStream->rewindsHandled = rewindRequests;
+  }
+
+  unsigned writePosition = (unsigned)SDL_AtomicGet(&waveStream->writePosition);
 
-  if (finished && loop)
+  while (!waveStream->atEnd)
   {
-    bytesToRead = requestedBytes - remainingBytes;
-    fseek(waveStream->file, waveStream->start, SEEK_SET);
-    fread(waveStream->chunk + (bytesToRead / sizeof(int16_t)) + 1, (size_t)bytesToRead, 1, waveStream->file);
-    totalBytesRead += bytesToRead;
+    unsigned readPosition = (unsigned)SDL_AtomicGet(&waveStream->readPosition);
+    unsigned freeSpace = WAVE_STREAM_BUFFER_SAMPLES - (writePosition - readPosition);
+    unsigned contiguous = WAVE_STREAM_BUFFER_SAMPLES - (writePosition & RING_MASK);
+    long remaining = (waveStream->end - waveStream->position) / (long)sizeof(int16_t);
+    unsigned samplesToRead = MIN(MIN(freeSpace, contiguous), (unsigned)remaining);
+
+    samplesToRead -= samplesToRead % waveStream->channelCount;
+
+    if (samplesToRead == 0 && remaining > 0)
+      break;
+
+    size_t samplesRead = fread(&waveStream->ring[writePosition & RING_MASK], sizeof(int16_t), samplesToRead, waveStream->file);
+    writePosition += (unsigned)samplesRead;
+    waveStream->position += (long)(samplesRead * sizeof(int16_t));
+    SDL_AtomicSet(&waveStream->writePosition, (int)writePosition);
+
+    if (samplesRead < samplesToRead || waveStream->position >= waveStream->end)
+    {
+      if (SDL_AtomicGet(&waveStream->loop) && waveStream->end > waveStream->start && samplesRead == samplesToRead)
+        __seekStart(waveStream);
+      else
+      {
+        waveStream->atEnd = true;
+        SDL_AtomicSet(&waveStream->endPosition, (int)writePosition);
+        SDL_AtomicSet(&waveStream->ended, 1);
+      }
+    }
   }
+}
 
-  waveStream->sampleCount = (int)(totalBytesRead / sizeof(int16_t));
-  waveStream->position = ftell(waveStream->file);
-  return finished && !loop;
+void pumpWaveStreams()
+{
+  __lockStreams();
+  for (WaveStream *waveStream = prefetcher.streams; waveStream; waveStream = waveStream->next)
+    __prefetch(waveStream);
+  __unlockStreams();
 }
 
-void waveStreamSeekStart(WaveStream *waveStream)
+static int __prefetchThread(void *data)
 {
-  fseek(waveStream->file, waveStream->start, SEEK_SET);
-  waveStream->position = waveStream->start;
+  UNUSED(data);
+  while (SDL_AtomicGet(&prefetcher.running))
+  {
+    SDL_SemWaitTimeout(prefetcher.wake, PREFETCH_INTERVAL_MS);
+    pumpWaveStreams();
+  }
+  return 0;
+}
+
+void startWaveStreamPrefetch()
+{
+  if (prefetcher.thread)
+    return;
+
+  prefetcher.lock = SDL_CreateMutex();
+  prefetcher.wake = SDL_CreateSemaphore(0);
+  SDL_AtomicSet(&prefetcher.running, 1);
+  prefetcher.thread = SDL_CreateThread(__prefetchThread, "milk wave prefetch", NULL);
+}
+
+void stopWaveStreamPrefetch()
+{
+  if (!prefetcher.thread)
+    return;
+
+  SDL_AtomicSet(&prefetcher.running, 0);
+  SDL_SemPost(prefetcher.wake);
+  SDL_WaitThread(prefetcher.thread, NULL);
+  SDL_DestroySemaphore(prefetcher.wake);
+  SDL_DestroyMutex(prefetcher.lock);
+  prefetcher.thread = NULL;
+  prefetcher.wake = NULL;
+  prefetcher.lock = NULL;
+}
+
+// Called from the mixer. A stream is ready once the prefetcher has acknowledged its last rewind.
+bool isWaveStreamReady(WaveStream *waveStream)
+{
+  if (waveStream->awaitingRewind)
+  {
+    if ((int)((unsigned)SDL_AtomicGet(&waveStream->rewindsCompleted) - waveStream->awaitedRewind) < 0)
+      return false;
+
+    unsigned rewindPosition = (unsigned)SDL_AtomicGet(&waveStream->rewindPosition);
+    if ((int)(rewindPosition - (unsigned)SDL_AtomicGet(&waveStream->readPosition)) > 0)
+      SDL_AtomicSet(&waveStream->readPosition, (int)rewindPosition);
+    waveStream->awaitingRewind = false;
+  }
+
+  // Ready means there's something to play, so a stream that's just been rewound doesn't start with a gap.
+  return SDL_AtomicGet(&waveStream->writePosition) != SDL_AtomicGet(&waveStream->readPosition) || SDL_AtomicGet(&waveStream->ended);
+}
+
+// Called from the mixer. Copies out whatever has been prefetched, up to numSamples, and returns true once the stream has ended.
+bool readWaveStream(WaveStream *waveStream, int numSamples)
+{
+  waveStream->sampleCount = 0;
+
+  if (!isWaveStreamReady(waveStream))
+    return false;
+
+  bool ended = SDL_AtomicGet(&waveStream->ended);
+  unsigned readPosition = (unsigned)SDL_AtomicGet(&waveStream->readPosition);
+  unsigned available = (unsigned)SDL_AtomicGet(&waveStream->writePosition) - readPosition;
+  unsigned samplesToRead = MIN(available, (unsigned)numSamples);
+  unsigned first = MIN(samplesToRead, WAVE_STREAM_BUFFER_SAMPLES - (readPosition & RING_MASK));
+
+  memcpy(waveStream->chunk, &waveStream->ring[readPosition & RING_MASK], first * sizeof(int16_t));
+  memcpy(waveStream->chunk + first, waveStream->ring, (samplesToRead - first) * sizeof(int16_t));
+
+  readPosition += samplesToRead;
+  SDL_AtomicSet(&waveStream->readPosition, (int)readPosition);
+  waveStream->sampleCount = (int)samplesToRead;
+
+  if (prefetcher.wake)
+    SDL_SemPost(prefetcher.wake);
+
+  return ended && readPosition == (unsigned)SDL_AtomicGet(&waveStream->endPosition);
+}
+
+// Called from the mixer. Playback resumes from the start as soon as the prefetcher has acknowledged the rewind.
+void waveStreamSeekStart(WaveStream *waveStream, bool loop)
+{
+  SDL_AtomicSet(&waveStream->loop, loop);
+  waveStream->awaitedRewind = (unsigned)SDL_AtomicAdd(&waveStream->rewindRequests, 1) + 1;
+  waveStream->awaitingRewind = true;
+
+  if (prefetcher.wake)
+    SDL_SemPost(prefetcher.wake);
 }
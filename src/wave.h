@@ -1,22 +1,72 @@
 #ifndef __WAVE_H__
 #define __WAVE_H__
 
+#include <SDL_atomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#define WAVE_STREAM_BUFFER_SAMPLES 32768
+
+typedef enum
+{
+  WAVE_PCM,
+  WAVE_IMA_ADPCM
+} WaveEncoding;
+
 typedef struct
 {
   int16_t *samples;
   int channelCount;
   int sampleCount;
+  int sampleRate;
+  void *mapping; // Non-null when samples (or blocks) point into the mapped file.
+  size_t mappingSize;
+
+  // IMA ADPCM waves stay compressed and have no samples. sampleCount still counts decoded samples.
+  WaveEncoding encoding;
+  const uint8_t *blocks;
+  int blockSize;
+  int framesPerBlock;
 } Wave;
 
 typedef struct
 {
+  int predictor[2];
+  int stepIndex[2];
+  int frame;            // Next frame the decoder will produce.
+  int16_t history[4];   // The two frames before it, interleaved.
+} AdpcmDecoder;
+
+/**
+ * Streams are decoded ahead of time by a prefetch thread into a ring of WAVE_STREAM_BUFFER_SAMPLES samples.
+ * The prefetcher is the only writer and the mixer the only reader, and positions only ever grow, so the ring needs no locks.
+ */
+typedef struct WaveStream
+{
+  // Owned by the prefetcher
   long position;
   long start;
   long end;
   FILE *file;
+  bool atEnd;
+  unsigned rewindsHandled;
+  struct WaveStream *next;
+
+  // Shared between the prefetcher and the mixer
+  int16_t *ring;
+  SDL_atomic_t writePosition;
+  SDL_atomic_t readPosition;
+  SDL_atomic_t rewindRequests;
+  SDL_atomic_t rewindsCompleted;
+  SDL_atomic_t rewindPosition;
+  SDL_atomic_t ended;
+  SDL_atomic_t endPosition;
+  SDL_atomic_t loop;
+
+  // Owned by the mixer
+  bool awaitingRewind;
+  unsigned awaitedRewind;
   int channelCount;
   int sampleCount;
   int16_t *chunk;
@@ -24,9 +74,15 @@ typedef struct
 
 Wave *loadWave(const char *filename);
 void freeWave(Wave *wave);
+void resetAdpcmDecoder(AdpcmDecoder *decoder);
+void decodeAdpcm(const Wave *wave, AdpcmDecoder *decoder, int16_t *dest, int firstFrame, int lastFrame);
 WaveStream *openWaveStream(const char *filename);
 void closeWaveStream(WaveStream *waveStream);
-bool readWaveStream(WaveStream *waveStream, int numSamples, bool loop);
-void waveStreamSeekStart(WaveStream *waveStream);
+bool isWaveStreamReady(WaveStream *waveStream);
+bool readWaveStream(WaveStream *waveStream, int numSamples);
+void waveStreamSeekStart(WaveStream *waveStream, bool loop);
+void startWaveStreamPrefetch();
+void stopWaveStreamPrefetch();
+void pumpWaveStreams();
 
 #endif